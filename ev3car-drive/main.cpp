@@ -23,198 +23,388 @@
   * 
   * ev3drive:
   * -initializes 2 motors
+  * -calibrates steering end stops by stall detection (or uses cached calibration)
   * -reads UDP messages
   * -moves first motor to position (steering)
   * -lets second motor rotate forward or backward
+  * -watches drive encoder progress of turns, re-centres steering (TURN)
+  *  or stops (TURNSTOP) on arrival and acknowledges with datagram
   * -stops second motor on timeout
+  * -measures command latency and reports it back periodically (see shared/latency.h)
+  * -limits forward duty cycle near obstacles published by ev3laser and reports interventions (see shared/safety_envelope.h)
   *
   * See Usage() function for syntax details (or run the program without arguments)
   */
 
 
+#include "steering.h"
+
 #include "shared/misc.h"
 #include "shared/net_udp.h"
+#include "shared/sysfs.h"
+#include "shared/motor_cache.h"
+#include "shared/latency.h"
+#include "shared/safety_envelope.h"
 
 #include "ev3dev-lang-cpp/ev3dev.h"
 
+#include <sys/epoll.h> //epoll_create1, epoll_ctl, epoll_wait
+#include <sys/timerfd.h> //timerfd_create, timerfd_settime
+#include <fcntl.h> //O_RDONLY
 #include <signal.h> //sigaction, sig_atomic_t
 #include <endian.h> //htobe16, htobe32, htobe64
 #include <stdio.h> //printf, etc
+#include <string.h> //memset
+#include <unistd.h> //read, close
 
 using namespace ev3dev;
 
 // GLOBAL VARIABLES
 volatile sig_atomic_t g_finish_program = 0;
-//volatile sig_atomic_t g_end_turn = 0;
-//volatile sig_atomic_t g_end_turn_stop = 0;
 // temporary control packet, subject to change
 struct car_drive_packet {
 	uint64_t timestamp_us;
 	int16_t command;
 	int16_t param1;//forward/backward
-	int16_t param2;//steering segment
+	int16_t param2;//steering segment: sign is direction (positive left), magnitude is turn length in drive counts
 };
 
 const int CONTROL_PACKET_BYTES = 14; //8 + 3*2 = 14 bytes
 enum Commands { KEEPALIVE = 0, TURN = 1, FORWARD = 2, BACKWARD = 3, STOP = 4, TURNSTOP = 5 };
 
-const int TURN_SLEEP = 1500;
+/**
+ * Turn acknowledgement is sent back to the sender of TURN/TURNSTOP
+ * in the control packet layout:
+ * -timestamp_us - of the acknowledged command
+ * -command - TURN or TURNSTOP
+ * -param1 - TurnStatus
+ * -param2 - drive counts travelled past the target when arrival was noticed
+ */
+enum TurnStatus { TURN_COMPLETED = 0, TURN_CANCELLED = 1 };
+
+struct turn_watch {
+	bool active;
+	int16_t command; //TURN or TURNSTOP
+	uint64_t timestamp_us; //of the command
+	int target; //drive position
+	int direction; //1 forward, -1 backward
+	sockaddr_in sender;
+};
+
 const int RAMP_UP_MS = 500;
-const int INIT_STEERING_POWER = 100;
+const int TURN_WATCH_MS = 10; //drive encoder polling period while turning
 
 int steerLeft;
 int steerForward;
 int steerRight;
 medium_motor steer(OUTPUT_B);
 large_motor drive(OUTPUT_A);
-int turnPosition;
-
-void MainLoop(int socket_udp);
-void ProcessMessage(const car_drive_packet &packet);
-
-//void* CompleteTurn(void* v);
-//void* CompleteTurnStop(void* v);
+MotorCommandCache steerCache(&steer);
+MotorCommandCache driveCache(&drive);
+int drivePositionFd;
+turn_watch turn;
+int turnsCompleted;
+int turnsCancelled;
+int turnsOvershoot;
+CommandLatency latency;
+sockaddr_in controller; //where the last command came from, telemetry goes there
+bool hasController;
+SafetyEnvelope *safety;
+int driveDuty; //requested by the last command, limited again on safety tick
+int16_t driveCommand; //the command that requested driveDuty
+
+void MainLoop(int socket_udp, int timeout_ms);
+void ProcessMessage(int socket_udp, const car_drive_packet &packet, const sockaddr_in &sender);
+
+void StartTurn(int socket_udp, const car_drive_packet &packet, const sockaddr_in &sender);
+bool WatchTurn(int socket_udp);
+void CancelTurn(int socket_udp);
+void SendTurnAcknowledgement(int socket_udp, int16_t status, int16_t overshoot);
+void SendLatencyTelemetry(int socket_udp);
+
+void SetDrive(int socket_udp, int16_t command, int duty);
+void ApplyDrive(int socket_udp);
+void SendSafetyIntervention(int socket_udp, int requested, int applied);
 
 void InitMotor(motor *m);
+void InitSteering();
 void StopMotors();
+int ReadDrivePosition();
 
-int RecvCarDrivePacket(int socket_udp, car_drive_packet *packet);
+int InitTimer();
+void ArmTimer(int timer_fd, int period_ms);
+void DisarmTimer(int timer_fd);
+void InitEpoll(int *epoll_fd, const int *fds, int fds_count);
+
+int RecvCarDrivePacket(int socket_udp, car_drive_packet *packet, sockaddr_in *sender);
 void DecodeCarDrivePacket(car_drive_packet *packet, const char *data);
+void EncodeCarDrivePacket(const car_drive_packet &packet, char *data);
 
 void Usage();
-void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms);
+void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms, int *stop_mm, int *slow_mm);
 void Finish(int signal);
 
 
 int main(int argc, char **argv) {			
-	int socket_udp, port, timeout_ms;
+	int socket_udp, port, timeout_ms, stop_mm, slow_mm;
 	sockaddr_in destination_udp;
+	uint64_t start_us;
 	
-	ProcessArguments(argc, argv, &port, &timeout_ms);
+	ProcessArguments(argc, argv, &port, &timeout_ms, &stop_mm, &slow_mm);
+	SafetyEnvelope envelope(stop_mm, slow_mm);
+	safety = &envelope;
 	SetStandardInputNonBlocking();
 	
 	//init
 	RegisterSignals(Finish);
 
 	//init steering
-	steer.reset();
-	InitMotor(&steer);	
-	steer.set_duty_cycle_sp(-INIT_STEERING_POWER);
-	steer.run_direct();
-	Sleep(TURN_SLEEP * 2);
-	steer.stop();
-	steer.set_position(0);
-	steerRight = steer.position();
-	steer.set_duty_cycle_sp(INIT_STEERING_POWER);
-	steer.run_direct();
-	Sleep(TURN_SLEEP*2);
-	steer.stop();
-	steerLeft = steer.position();
-	steerForward = (steerLeft + steerRight) / 2;
-	steer.set_speed_sp(600);
-	steer.set_position_sp(steerForward);
-	steer.run_to_abs_pos();
-	Sleep(TURN_SLEEP);
-	printf("ev3car-drive: left %d, right %d, forward %d, duty_cycle %d, pos %d\n", steerLeft, steerRight, steerForward, steer.duty_cycle(), steer.position());
+	InitMotor(&steer);
+	InitSteering();
 	//init drive
 	drive.reset();
 	InitMotor(&drive);
 	drive.set_ramp_up_sp(RAMP_UP_MS);
+	drivePositionFd = OpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, drive.device_index(), "position", O_RDONLY);
 
-	InitNetworkUDP(&socket_udp, &destination_udp, NULL, port, timeout_ms);
+	//the timeout is handled by timerfd in MainLoop
+	InitNetworkUDP(&socket_udp, &destination_udp, NULL, port, 0);
+	NotifyReady();
 
 	//work
-	MainLoop(socket_udp);
+	start_us = TimestampUs();
+	MainLoop(socket_udp, timeout_ms);
 	
 	//cleanup
+	CancelTurn(socket_udp);
+	steerCache.Invalidate(); //stop for real, whatever the cache thinks
+	driveCache.Invalidate();
 	StopMotors();
-	steer.set_position_sp(steerForward);
-	steer.run_to_abs_pos();
+	steerCache.SetPositionSp(steerForward);
+	steerCache.RunToAbsPos();
+	close(drivePositionFd);
 	CloseNetworkUDP(socket_udp);
+
+	printf("ev3car-drive: turns completed %d, cancelled %d, average overshoot %d counts\n", turnsCompleted, turnsCancelled,
+		turnsCompleted ? turnsOvershoot / turnsCompleted : 0);
+
+	const MotorCommandCache *caches[] = { &steerCache, &driveCache };
+	PrintMotorCacheSummary("ev3car-drive", caches, 2, start_us);
+	safety->Print("ev3car-drive");
 		
 	printf("ev3car-drive: bye\n");
 		
 	return 0;
 }
 
-void MainLoop(int socket_udp) {
-	int status;
+void MainLoop(int socket_udp, int timeout_ms) {
+	const int MAX_EVENTS = 6;
+	struct epoll_event events[MAX_EVENTS];
+	int status, timer_fd, watch_fd, telemetry_fd, safety_fd, epoll_fd, n;
+	uint64_t expirations, received_us;
+	bool watch_armed = false;
 	car_drive_packet packet;
-	
-	while(!g_finish_program) {
-		status=RecvCarDrivePacket(socket_udp, &packet);
-		if(status < 0) break;
-		if(status == 0) {
-			//timeout
-			StopMotors();
-			fprintf(stderr, "ev3car-drive: waiting for drive controller...\n");
+	sockaddr_in sender;
+
+	timer_fd = InitTimer();
+	watch_fd = InitTimer();
+	telemetry_fd = InitTimer();
+	safety_fd = InitTimer();
+	const int fds[] = { socket_udp, timer_fd, watch_fd, telemetry_fd, safety_fd, STDIN_FILENO };
+	InitEpoll(&epoll_fd, fds, sizeof(fds) / sizeof(fds[0]));
+	ArmTimer(timer_fd, timeout_ms);
+	ArmTimer(telemetry_fd, LATENCY_TELEMETRY_MS);
+	if (safety->Enabled()) ArmTimer(safety_fd, SAFETY_CHECK_MS);
+
+	while (!g_finish_program) {
+		if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) == -1) {
+			if (errno == EINTR) continue; //check g_finish_program
+			DieErrno("ev3car-drive: epoll_wait failed");
+		}
+
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+
+			if (fd == timer_fd) {
+				//timeout
+				if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+					DieErrno("ev3car-drive: timerfd read failed");
+				CancelTurn(socket_udp);
+				StopMotors();
+				latency.ResetOffset(); //the next controller may have different clock
+				fprintf(stderr, "ev3car-drive: waiting for drive controller...\n");
+			} else if (fd == socket_udp) {
+				while ((status = RecvCarDrivePacket(socket_udp, &packet, &sender)) > 0) {
+					received_us = TimestampUs();
+					ArmTimer(timer_fd, timeout_ms);
+					controller = sender;
+					hasController = true;
+					latency.Received(packet.timestamp_us, received_us);
+					ProcessMessage(socket_udp, packet, sender);
+					if (packet.command != KEEPALIVE) latency.Actuated(packet.timestamp_us, received_us, TimestampUs());
+				}
+				if (status < 0) goto finish;
+			} else if (fd == watch_fd) {
+				if (read(watch_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+					DieErrno("ev3car-drive: timerfd read failed");
+				if (watch_armed) WatchTurn(socket_udp);
+			} else if (fd == telemetry_fd) {
+				if (read(telemetry_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+					DieErrno("ev3car-drive: timerfd read failed");
+				SendLatencyTelemetry(socket_udp);
+			} else if (fd == safety_fd) {
+				if (read(safety_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+					DieErrno("ev3car-drive: timerfd read failed");
+				//between the commands the obstacles may come closer
+				if (driveDuty > 0) ApplyDrive(socket_udp);
+			} else if (fd == STDIN_FILENO) {
+				if (IsStandardInputEOF()) goto finish;
+			}
+		}
+
+		//the watch tick runs only while there is turn in progress
+		if (turn.active && !watch_armed) {
+			ArmTimer(watch_fd, TURN_WATCH_MS);
+			watch_armed = true;
+		} else if (!turn.active && watch_armed) {
+			DisarmTimer(watch_fd);
+			watch_armed = false;
 		}
-		else ProcessMessage(packet);
-		if(IsStandardInputEOF()) break;
 	}
+finish:
+	close(epoll_fd);
+	close(safety_fd);
+	close(telemetry_fd);
+	close(watch_fd);
+	close(timer_fd);
+
+	latency.Print("ev3car-drive");
 }
 
-void ProcessMessage(const car_drive_packet &packet) {	
+void ProcessMessage(int socket_udp, const car_drive_packet &packet, const sockaddr_in &sender) {	
 	if (packet.command == KEEPALIVE) return;
-	//g_end_turn = 0;
-	//g_end_turn_stop = 0;
+	//any other command supersedes the turn in progress
+	CancelTurn(socket_udp);
 	if (packet.command == TURN || packet.command == TURNSTOP) {
 		//TURN
 		if (packet.param2 == 0) {
 
-			steer.set_position_sp(steerForward);
+			steerCache.SetPositionSp(steerForward);
 		} else if (packet.param2 > 0) {
-			steer.set_position_sp(steerLeft);
+			steerCache.SetPositionSp(steerLeft);
 		} else {
-			steer.set_position_sp(steerRight);
+			steerCache.SetPositionSp(steerRight);
 		}
-		steer.run_to_abs_pos();
+		steerCache.RunToAbsPos();
 		//FORWARD / BACKWARD
-		if(packet.param1 > 0) drive.set_duty_cycle_sp(100);
-		else drive.set_duty_cycle_sp(-100);
-		drive.run_direct();
-		turnPosition = drive.position() + packet.param2 < 0 && packet.param1 > 0 ? -packet.param2 : packet.param2;
-		/*if (packet.param2 != 0) {
-			g_end_turn = 1;
-			pthread_t completeThread;
-			int rc = pthread_create(&completeThread, NULL, CompleteTurn, NULL);
-			if (rc) {
-				fprintf(stderr, "ev3car-drive: return code from pThread() was %d\n", rc);
-			}
-		}*/
-
+		SetDrive(socket_udp, packet.command, packet.param1 > 0 ? 100 : -100);
+		StartTurn(socket_udp, packet, sender);
 	} else if (packet.command == FORWARD) {
-		steer.set_position_sp(steerForward);
-		steer.run_to_abs_pos();
-		drive.set_duty_cycle_sp(100);
-		drive.run_direct();
+		steerCache.SetPositionSp(steerForward);
+		steerCache.RunToAbsPos();
+		SetDrive(socket_udp, packet.command, 100);
 	} else if (packet.command == BACKWARD) {
-		steer.set_position_sp(steerForward);
-		steer.run_to_abs_pos();
-		drive.set_duty_cycle_sp(-100);
-		drive.run_direct();
+		steerCache.SetPositionSp(steerForward);
+		steerCache.RunToAbsPos();
+		SetDrive(socket_udp, packet.command, -100);
 	} else if (packet.command == STOP) {
 		StopMotors();
 	}
 }
 
-/*void* CompleteTurn(void* v) {
-	while (drive.position() < turnPosition) SleepUs(TURN_SLEEP);
-	if (g_end_turn) {
-		steer.set_position_sp(steerForward);
-		steer.run_to_abs_pos();
+void StartTurn(int socket_udp, const car_drive_packet &packet, const sockaddr_in &sender) {
+	//TURN straight has nothing to complete
+	if (packet.param2 == 0 && packet.command == TURN) return;
+
+	turn.command = packet.command;
+	turn.timestamp_us = packet.timestamp_us;
+	turn.direction = packet.param1 > 0 ? 1 : -1;
+	turn.target = ReadDrivePosition() + turn.direction * abs(packet.param2);
+	turn.sender = sender;
+	turn.active = true;
+
+	WatchTurn(socket_udp); //zero length TURNSTOP completes right away
+}
+
+// returns true if the turn was completed
+bool WatchTurn(int socket_udp) {
+	if (!turn.active) return false;
+
+	int overshoot = (ReadDrivePosition() - turn.target) * turn.direction;
+	if (overshoot < 0) return false;
+
+	if (turn.command == TURNSTOP) {
+		driveCache.Stop();
+		driveDuty = 0;
 	}
-	return NULL;
-}*/
+	steerCache.SetPositionSp(steerForward);
+	steerCache.RunToAbsPos();
+
+	turn.active = false;
+	++turnsCompleted;
+	turnsOvershoot += overshoot;
+	SendTurnAcknowledgement(socket_udp, TURN_COMPLETED, overshoot > INT16_MAX ? INT16_MAX : overshoot);
+	return true;
+}
 
-/*void* CompleteTurnStop(void* v) {
-	while (drive.position() < turnPosition) SleepUs(TURN_SLEEP);
-	if (g_end_turn_stop) {
-		StopMotors();
-		//TODO:SEND RESPONSE! (TURNSTOP)
+void CancelTurn(int socket_udp) {
+	if (!turn.active) return;
+	turn.active = false;
+	++turnsCancelled;
+	SendTurnAcknowledgement(socket_udp, TURN_CANCELLED, 0);
+}
+
+void SendTurnAcknowledgement(int socket_udp, int16_t status, int16_t overshoot) {
+	static char buffer[CONTROL_PACKET_BYTES];
+	car_drive_packet ack;
+
+	ack.timestamp_us = turn.timestamp_us;
+	ack.command = turn.command;
+	ack.param1 = status;
+	ack.param2 = overshoot;
+
+	EncodeCarDrivePacket(ack, buffer);
+	SendToUDP(socket_udp, turn.sender, buffer, CONTROL_PACKET_BYTES);
+}
+
+void SetDrive(int socket_udp, int16_t command, int duty) {
+	driveCommand = command;
+	driveDuty = duty;
+	ApplyDrive(socket_udp);
+}
+
+// runs the drive with the requested duty cycle limited by the safety envelope
+void ApplyDrive(int socket_udp) {
+	int duty = driveDuty;
+
+	if (safety->Enabled() && duty > 0 && safety->Update(TimestampUs()) != SAFETY_CLEAR) {
+		duty = safety->LimitForward(driveDuty);
+		if (safety->Intervene(TimestampUs())) SendSafetyIntervention(socket_udp, driveDuty, duty);
+	}
+
+	if (duty == 0) {
+		driveCache.Stop();
+		return;
 	}
-	return NULL;
-}*/
+	driveCache.SetDutyCycleSp(duty);
+	driveCache.RunDirect(); //skipped when already running, duty_cycle_sp takes effect immediately
+}
+
+void SendSafetyIntervention(int socket_udp, int requested, int applied) {
+	static char buffer[SAFETY_INTERVENTION_BYTES];
+
+	if (!hasController) return;
+
+	SendToUDP(socket_udp, controller, buffer, safety->EncodeIntervention(buffer, driveCommand, requested, applied));
+}
+
+void SendLatencyTelemetry(int socket_udp) {
+	static char buffer[LATENCY_TELEMETRY_BYTES];
+
+	if (!hasController) return;
+
+	SendToUDP(socket_udp, controller, buffer, latency.EncodeTelemetry(buffer));
+}
 
 void InitMotor(motor *m) {
 	if(!m->connected())
@@ -222,19 +412,96 @@ void InitMotor(motor *m) {
 	m->set_stop_action(m->stop_action_brake);
 }
 
+// uses cached calibration if it passes sanity check, calibrates otherwise
+void InitSteering() {
+	steering_calibration calibration;
+	uint64_t start_us = TimestampUs();
+	bool cached = LoadSteeringCache(STEER_CACHE_PATH, steer.device_index(), &calibration) == 0
+		&& CheckSteeringCalibration(&steer, calibration) == 0;
+
+	if (!cached) {
+		steer.reset(); //zeroes the tacho counter and the attributes
+		InitMotor(&steer);
+		if (CalibrateSteering(&steer, &calibration) == -1) {
+			steer.stop();
+			Die("ev3car-drive: steering calibration failed (end stop not found)");
+		}
+		if (SaveSteeringCache(STEER_CACHE_PATH, steer.device_index(), calibration) == -1)
+			fprintf(stderr, "ev3car-drive: unable to save steering cache\n");
+	}
+
+	steerLeft = calibration.left;
+	steerRight = calibration.right;
+	steerForward = calibration.forward;
+
+	printf("ev3car-drive: steering %s in %d ms, left %d, right %d, forward %d, pos %d\n", cached ? "from cache" : "calibrated",
+		(int)((TimestampUs() - start_us) / 1000), steerLeft, steerRight, steerForward, steer.position());
+}
+
 void StopMotors() {
-	steer.stop();
-	drive.stop();
+	steerCache.Stop();
+	driveCache.Stop();
+	driveDuty = 0;
+}
+
+int ReadDrivePosition() {
+	int position;
+	if (ReadSysfsInt(drivePositionFd, &position) == -1)
+		DieErrno("ev3car-drive: read drive position failed");
+	return position;
 }
 
 
-// returns CONTROL_PACKET_BYTES on success  0 on timeout, -1 on error
-int RecvCarDrivePacket(int socket_udp, car_drive_packet *packet) {
+int InitTimer() {
+	int timer_fd;
+	if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		DieErrno("ev3car-drive: timerfd_create failed");
+	return timer_fd;
+}
+
+// (re)starts the countdown, after expiry it fires every period_ms
+void ArmTimer(int timer_fd, int period_ms) {
+	struct itimerspec its;
+	its.it_value.tv_sec = period_ms / 1000;
+	its.it_value.tv_nsec = (period_ms % 1000) * 1000000L;
+	its.it_interval = its.it_value;
+
+	if (timerfd_settime(timer_fd, 0, &its, NULL) == -1)
+		DieErrno("ev3car-drive: timerfd_settime failed");
+}
+
+void DisarmTimer(int timer_fd) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+
+	if (timerfd_settime(timer_fd, 0, &its, NULL) == -1)
+		DieErrno("ev3car-drive: timerfd_settime failed");
+}
+
+void InitEpoll(int *epoll_fd, const int *fds, int fds_count) {
+	struct epoll_event event;
+
+	if ((*epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		DieErrno("ev3car-drive: epoll_create1 failed");
+
+	for (int i = 0; i < fds_count; ++i) {
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = fds[i];
+		if (epoll_ctl(*epoll_fd, EPOLL_CTL_ADD, fds[i], &event) == -1)
+			DieErrno("ev3car-drive: epoll_ctl failed");
+	}
+}
+
+// returns CONTROL_PACKET_BYTES on success, 0 if there is nothing more to read, -1 on error
+int RecvCarDrivePacket(int socket_udp, car_drive_packet *packet, sockaddr_in *sender) {
 	static char buffer[CONTROL_PACKET_BYTES];	
+	socklen_t sender_len = sizeof(*sender);
 	int recv_len;
 	
-	if((recv_len = recvfrom(socket_udp, buffer, CONTROL_PACKET_BYTES, 0, NULL, NULL)) == -1) {
-		if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINPROGRESS) return 0; //timeout!
+	while ((recv_len = recvfrom(socket_udp, buffer, CONTROL_PACKET_BYTES, MSG_DONTWAIT, (sockaddr*)sender, &sender_len)) == -1) {
+		if (errno==EAGAIN || errno==EWOULDBLOCK) return 0; //drained
+		if (errno==EINTR) continue;
 		perror("ev3car-drive: error while receiving control packet");
 		return -1;
 	}
@@ -254,14 +521,24 @@ void DecodeCarDrivePacket(car_drive_packet *packet, const char *data) {
 	packet->param2=be16toh(*((int16_t*)(data+12)));	
 }
 
+void EncodeCarDrivePacket(const car_drive_packet &packet, char *data) {
+	*((uint64_t*)data) = htobe64(packet.timestamp_us);
+	*((int16_t*)(data+8)) = htobe16(packet.command);
+	*((int16_t*)(data+10)) = htobe16(packet.param1);
+	*((int16_t*)(data+12)) = htobe16(packet.param2);
+}
+
 void Usage() {
-	printf("ev3car-drive udp_port timeout_ms\n\n");
+	printf("ev3car-drive udp_port timeout_ms [stop_mm slow_mm]\n\n");
+	printf("stop_mm, slow_mm - safety envelope, forward drive is stopped at stop_mm\n");
+	printf("and limited below slow_mm from the nearest obstacle ahead (needs ev3laser publishing obstacles)\n\n");
 	printf("examples:\n");
 	printf("./ev3car-drive 8003 500\n");
+	printf("./ev3car-drive 8003 500 300 800\n");
 }
 
-void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms) {
-	if(argc!=3)
+void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms, int *stop_mm, int *slow_mm) {
+	if(argc!=3 && argc!=5)
 	{
 		Usage();
 		exit(EXIT_SUCCESS);		
@@ -286,10 +563,18 @@ void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms) {
 	}
 	
 	*timeout_ms=temp;
+
+	*stop_mm = *slow_mm = 0;
+	if (argc == 5) {
+		*stop_mm = strtol(argv[3], NULL, 0);
+		*slow_mm = strtol(argv[4], NULL, 0);
+		if (*stop_mm <= 0 || *slow_mm < *stop_mm || *slow_mm >= OBSTACLE_NONE) {
+			fprintf(stderr, "ev3car-drive: the arguments have to satisfy 0 < stop_mm <= slow_mm < %d\n", OBSTACLE_NONE);
+			exit(EXIT_SUCCESS);
+		}
+	}
 }
 
 void Finish(int signal) {
 	g_finish_program=1;
-	//g_end_turn = 0;
-	//g_end_turn_stop = 0;
 }
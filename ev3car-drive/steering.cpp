@@ -0,0 +1,124 @@
+/*
+ * ev3car-drive steering calibration implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "steering.h"
+
+#include <stdio.h> //fopen, fscanf, fprintf
+#include <string.h> //strcmp
+#include <stdlib.h> //abs
+
+using namespace ev3dev;
+
+static bool IsStalled(const mode_set &state) {
+	return state.count("stalled") || state.count("overloaded");
+}
+
+// drives the rack with duty_cycle until it stalls, returns 0 on success, -1 on timeout
+static int SweepToEndStop(medium_motor *steer, int duty_cycle) {
+	uint64_t start_us, now_us, slow_since_us = 0;
+
+	steer->set_duty_cycle_sp(duty_cycle);
+	steer->run_direct();
+	start_us = TimestampUs();
+
+	while ((now_us = TimestampUs()) - start_us < (uint64_t)STEER_SWEEP_TIMEOUT_MS * 1000) {
+		SleepUs(STEER_POLL_US);
+
+		if (now_us - start_us < (uint64_t)STEER_SPINUP_MS * 1000) continue;
+
+		if (IsStalled(steer->state())) break;
+
+		if (abs(steer->speed()) >= STEER_STALL_SPEED) {
+			slow_since_us = 0;
+			continue;
+		}
+		if (!slow_since_us) slow_since_us = now_us;
+		else if (now_us - slow_since_us >= (uint64_t)STEER_STALL_MS * 1000) break;
+	}
+	steer->stop();
+
+	return now_us - start_us < (uint64_t)STEER_SWEEP_TIMEOUT_MS * 1000 ? 0 : -1;
+}
+
+int MoveSteering(medium_motor *steer, int position, int timeout_ms) {
+	uint64_t start_us = TimestampUs();
+
+	steer->set_speed_sp(STEER_SPEED);
+	steer->set_position_sp(position);
+	steer->run_to_abs_pos();
+
+	while (TimestampUs() - start_us < (uint64_t)timeout_ms * 1000) {
+		SleepUs(STEER_POLL_US);
+		mode_set state = steer->state();
+		if (IsStalled(state)) return -1;
+		if (!state.count("running") && abs(steer->position() - position) <= STEER_POSITION_TOLERANCE) return 0;
+	}
+	return -1;
+}
+
+int CalibrateSteering(medium_motor *steer, steering_calibration *calibration) {
+	if (SweepToEndStop(steer, -STEER_CALIBRATION_POWER) == -1) return -1;
+	steer->set_position(0);
+	calibration->right = steer->position();
+
+	if (SweepToEndStop(steer, STEER_CALIBRATION_POWER) == -1) return -1;
+	calibration->left = steer->position();
+
+	if (calibration->left - calibration->right < STEER_MIN_SPAN) return -1;
+
+	calibration->forward = (calibration->left + calibration->right) / 2;
+
+	return MoveSteering(steer, calibration->forward, STEER_CENTRE_TIMEOUT_MS);
+}
+
+int CheckSteeringCalibration(medium_motor *steer, const steering_calibration &calibration) {
+	int position = steer->position();
+
+	if (calibration.left - calibration.right < STEER_MIN_SPAN) return -1;
+	//the rack can't be outside the end stops unless the counter was reset
+	if (position < calibration.right - STEER_POSITION_TOLERANCE || position > calibration.left + STEER_POSITION_TOLERANCE) return -1;
+
+	return MoveSteering(steer, calibration.forward, STEER_CENTRE_TIMEOUT_MS);
+}
+
+int LoadSteeringCache(const char *path, unsigned device_index, steering_calibration *calibration) {
+	char boot_id[BOOT_ID_LENGTH];
+	steering_cache cache;
+	FILE *f;
+
+	if (ReadBootId(boot_id, sizeof(boot_id)) == -1) return -1;
+	if ((f = fopen(path, "r")) == NULL) return -1;
+
+	int ok = fscanf(f, "%39s %u %d %d %d", cache.boot_id, &cache.device_index,
+		&cache.calibration.left, &cache.calibration.right, &cache.calibration.forward) == 5;
+	fclose(f);
+
+	//reboot or motor reconnection reset the tacho counter
+	if (!ok || strcmp(boot_id, cache.boot_id) != 0 || device_index != cache.device_index) return -1;
+
+	*calibration = cache.calibration;
+	return 0;
+}
+
+int SaveSteeringCache(const char *path, unsigned device_index, const steering_calibration &calibration) {
+	char boot_id[BOOT_ID_LENGTH];
+	FILE *f;
+
+	if (ReadBootId(boot_id, sizeof(boot_id)) == -1) return -1;
+	if ((f = fopen(path, "w")) == NULL) return -1;
+
+	fprintf(f, "%s %u %d %d %d\n", boot_id, device_index, calibration.left, calibration.right, calibration.forward);
+
+	return fclose(f) == 0 ? 0 : -1;
+}
@@ -0,0 +1,73 @@
+/*
+ * ev3car-drive steering calibration header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * Steering calibration finds the positions of the steering rack end stops.
+ *
+ * Full calibration sweeps the rack to each end stop with constant duty cycle.
+ * The sweep ends as soon as the motor reports stall (state) or its speed stays
+ * near zero for a while, instead of waiting fixed time.
+ *
+ * The calibrated positions are cached together with the kernel boot id
+ * and the motor device index. The tacho counter survives module restarts
+ * (but not motor reconnection or reboot) so the cache lets the next start
+ * skip the sweep after quick sanity check (the rack can be moved to the centre).
+ */
+
+#pragma once
+
+#include "shared/misc.h" //BOOT_ID_LENGTH
+
+#include "ev3dev-lang-cpp/ev3dev.h"
+
+/**
+ * Those constants can be tuned
+ */
+const int STEER_CALIBRATION_POWER = 100; //duty cycle used for the sweep
+const int STEER_SWEEP_TIMEOUT_MS = 3000; //end stop not found in that time means failure
+const int STEER_SPINUP_MS = 150; //stall is not checked until the motor starts moving
+const int STEER_STALL_SPEED = 20; //counts/s, slower than that is stall
+const int STEER_STALL_MS = 60; //for that long
+const int STEER_POLL_US = 10000;
+const int STEER_SPEED = 600; //counts/s for positioning
+const int STEER_POSITION_TOLERANCE = 5; //counts
+const int STEER_MIN_SPAN = 40; //counts between the end stops, less means failed calibration
+const int STEER_CENTRE_TIMEOUT_MS = 1500;
+const char *const STEER_CACHE_PATH = "/tmp/ev3dev-mapping-steering.cache";
+
+struct steering_calibration {
+	int left;
+	int right;
+	int forward;
+};
+
+struct steering_cache {
+	char boot_id[BOOT_ID_LENGTH];
+	unsigned device_index;
+	steering_calibration calibration;
+};
+
+// sweeps to the end stops and centres the rack, returns 0 on success, -1 on failure
+int CalibrateSteering(ev3dev::medium_motor *steer, steering_calibration *calibration);
+
+// checks cached calibration and centres the rack, returns 0 on success, -1 if full calibration is needed
+int CheckSteeringCalibration(ev3dev::medium_motor *steer, const steering_calibration &calibration);
+
+// moves the rack to position, returns 0 when position was reached, -1 on stall or timeout
+int MoveSteering(ev3dev::medium_motor *steer, int position, int timeout_ms);
+
+// returns 0 on success, -1 if there is no cache for this boot and motor
+int LoadSteeringCache(const char *path, unsigned device_index, steering_calibration *calibration);
+// returns 0 on success, -1 on failure (non fatal)
+int SaveSteeringCache(const char *path, unsigned device_index, const steering_calibration &calibration);
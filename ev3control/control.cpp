@@ -13,16 +13,135 @@
  */
 
 #include "control.h"
+#include "zygote.h"
 
 #include "shared/misc.h"
+#include "shared/module_host.h"
 
 #include <sys/wait.h> //wait
-#include <unistd.h> //close
+#include <sys/signalfd.h> //signalfd
+#include <sys/timerfd.h> //timerfd_create, timerfd_settime
+#include <sys/epoll.h> //epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h> //eventfd
+#include <sys/prctl.h> //prctl
+#include <sys/syscall.h> //SYS_gettid
+#include <poll.h> //poll
+#include <dlfcn.h> //dlopen, dlsym, dlclose
+#include <pthread.h> //pthread_sigmask
+#include <unistd.h> //close, execve, environ
 #include <fcntl.h> //O_NONBLOCK
-#include <string.h> //strtok
+#include <signal.h> //sigprocmask
+#include <errno.h> //errno
+#include <stdio.h> //snprintf
+#include <stdlib.h> //EXIT_FAILURE
+#include <string.h> //strtok, strncmp, strlen
+
+#include <thread> //thread
+#include <set> //set
 
 using namespace std;
 
+const int CONTROL_MAX_EVENTS=16;
+
+// hosted module notifications written to the pipe
+const char HOSTED_READY='R';
+const char HOSTED_RETURNED='E';
+
+struct HostedModule
+{
+	module_host host;
+	void *library;
+	ModuleHostEntry entry;
+	std::thread thread;
+	std::string argv_string;
+	std::vector<char *> argv;
+	std::string name;
+	ModuleScheduling scheduling;
+	int notify_fd; //the write end of the pipe
+	pid_t tid; //set by the thread before it runs the module (__atomic builtins), 0 until then
+	int32_t return_value;
+	int rss_start_kb;
+};
+
+void HostedModuleReady(module_host *host)
+{
+	HostedModule *hosted=(HostedModule*)host->data;
+
+	if( write(hosted->notify_fd, &HOSTED_READY, 1) == -1 )
+		perror("Control: hosted module ready write failed");
+}
+
+void RunHostedModule(HostedModule *hosted)
+{
+	__atomic_store_n(&hosted->tid, (pid_t)syscall(SYS_gettid), __ATOMIC_RELEASE);
+	ApplyModuleScheduling(hosted->scheduling, hosted->name, 0);
+	hosted->return_value=hosted->entry(hosted->argv.size()-1, &hosted->argv[0], &hosted->host);
+
+	if( write(hosted->notify_fd, &HOSTED_RETURNED, 1) == -1 )
+		perror("Control: hosted module return write failed");
+}
+
+bool IsHostedCall(const std::string &module_call)
+{
+	string program=module_call.substr(0, module_call.find(' '));
+	return program.size() > 3 && program.compare(program.size()-3, 3, ".so") == 0;
+}
+
+// ev3control environment with the variable (NAME=value) set, valid as long as variable
+vector<char*> PrepareEnvironment(const string &variable)
+{
+	const size_t name_length=variable.find('=')+1;
+	vector<char*> envp;
+
+	for(char **env=environ;*env != NULL;++env)
+		if( strncmp(*env, variable.c_str(), name_length) != 0 )
+			envp.push_back(*env);
+
+	envp.push_back((char*)variable.c_str());
+	envp.push_back(NULL);
+	return envp;
+}
+
+// reports failure in forked child of multithreaded process (async-signal-safe) and exits
+void ChildFailed(const char *message)
+{
+	if( write(STDERR_FILENO, message, strlen(message)) == -1 )
+		; //nothing more can be done
+	_exit(EXIT_FAILURE);
+}
+
+// opens the module resource usage, false on failure or if the hosted module thread doesn't run yet
+bool OpenUsage(Module *module)
+{
+	if(!module->hosted)
+		return OpenModuleUsage(&module->usage, module->pid, 0, 0);
+
+	pid_t tid=__atomic_load_n(&module->hosted->tid, __ATOMIC_ACQUIRE);
+
+	return tid != 0 && OpenModuleUsage(&module->usage, getpid(), tid, module->hosted->rss_start_kb);
+}
+
+// resident set size of the process (pid 0 for ev3control), 0 on failure
+int ResidentKb(pid_t pid)
+{
+	char path[32];
+	long total, resident;
+
+	if(pid)
+		snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/statm");
+
+	FILE *f=fopen(path, "r");
+	if(f == NULL)
+		return 0;
+
+	int ok = fscanf(f, "%ld %ld", &total, &resident) == 2;
+	fclose(f);
+
+	return ok ? resident * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+}
+
 int32_t ModuleReturnValue(int32_t status)
 {
 	if( WIFEXITED(status) )
@@ -30,13 +149,75 @@ int32_t ModuleReturnValue(int32_t status)
 	return -1;
 }
 
-Control::Control()
+bool ModuleRunning(const Module &module)
+{
+	return module.state == MODULE_ENABLED || module.state == MODULE_STARTING || module.state == MODULE_STOPPING;
+}
+
+int ReadinessTimeoutMs(const Module &module)
+{
+	return module.creation_delay_ms > MODULE_READY_TIMEOUT_MS ? module.creation_delay_ms : MODULE_READY_TIMEOUT_MS;
+}
+
+// the time of the next readiness timeout or stop escalation, 0 if none
+uint64_t ModuleDeadlineUs(const Module &module)
+{
+	if(module.state == MODULE_STARTING)
+		return module.start_us + (uint64_t)ReadinessTimeoutMs(module)*1000;
+	if(module.state == MODULE_STOPPING)
+		return module.stop_stage_us + (uint64_t)MODULE_DISABLE_STAGE_MS*1000;
+	return 0;
+}
+
+void WatchFd(int epoll_fd, int fd)
+{
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events=EPOLLIN;
+	event.data.fd=fd;
+
+	if( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1 )
+		DieErrno("Control: epoll_ctl failed");
+}
+
+Control::Control(Zygote *zygote): zygote(zygote)
 {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+
+	//module exits are reported through signalfd instead of polling waitpid
+	if( sigprocmask(SIG_BLOCK, &mask, NULL) == -1 )
+		DieErrno("Control: sigprocmask failed");
+
+	if( (child_fd=signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1 )
+		DieErrno("Control: signalfd failed");
+
+	if( (deadline_fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1 )
+		DieErrno("Control: timerfd_create failed");
+
+	if( (failed_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 )
+		DieErrno("Control: eventfd failed");
+
+	if( (event_fd=epoll_create1(EPOLL_CLOEXEC)) == -1 )
+		DieErrno("Control: epoll_create1 failed");
+
+	WatchFd(event_fd, child_fd);
+	WatchFd(event_fd, deadline_fd);
+	WatchFd(event_fd, failed_fd);
+
+	//the zygote modules are orphaned by the intermediate process, this makes them our children
+	if( zygote && prctl(PR_SET_CHILD_SUBREAPER, 1) == -1 )
+		DieErrno("Control: prctl PR_SET_CHILD_SUBREAPER failed");
 }
 
 Control::~Control()
 {
-	DisableModules();
+	DisableModulesWait();
+	close(event_fd);
+	close(failed_fd);
+	close(deadline_fd);
+	close(child_fd);
 }
 
 bool Control::ContainsModule(const std::string& name, Module* module)
@@ -51,24 +232,58 @@ bool Control::ContainsModule(const std::string& name, Module* module)
 
 void Control::InsertModule(const std::string& name, int creation_delay_ms)
 {
-	Module m={MODULE_DISABLED, creation_delay_ms, 0, 0, 0};
+	Module m={MODULE_DISABLED, creation_delay_ms, -1, -1, 0, 0, 0, 0, 0, MODULE_STOP_STDIN, NULL, 0};
+	InitModuleUsage(&m.usage);
 	modules.insert( pair<string, Module>(name, m ) );
 }
 
-void Control::EnableModule(const std::string& name, const std::string& module_call)
+void Control::EnableModule(const std::string& name, const std::string& module_call, const ModuleScheduling &scheduling)
 {
 	Module module;
 
 	if( !ContainsModule(name, &module) )
 		Die("Control: request to enable module but no such module\n");
 
-	if(module.state == MODULE_ENABLED)
+	if( ModuleRunning(module) )
 		Die("Control: request to enable module but module already enabled\n");
 
+	if( IsHostedCall(module_call) && zygote )
+	{
+		EnableZygoteModule(name, module_call, scheduling, &module);
+		return;
+	}
+
+	if( IsHostedCall(module_call) )
+	{
+		EnableHostedModule(name, module_call, scheduling, &module);
+		return;
+	}
+
 	int pipe_read_write[2];
 	if( pipe2(pipe_read_write, O_NONBLOCK) == -1 )
 		DieErrno("PrepareChild() pipe failed");
 
+	int ready_read_write[2];
+	if( pipe2(ready_read_write, O_NONBLOCK | O_CLOEXEC) == -1 )
+		DieErrno("PrepareChild() ready pipe failed");
+
+	//closed by ev3control when the scheduling is applied, the child waits for EOF before execve
+	int scheduled_read_write[2];
+	if( pipe2(scheduled_read_write, O_CLOEXEC) == -1 )
+		DieErrno("Control: EnableModule scheduling pipe failed");
+
+	//hosted modules run on threads, the child may only use async-signal-safe calls
+	//so everything is prepared before fork
+	string argv_str;
+	vector<char *> argv=PrepareExecvArgumentList(module_call, argv_str);
+	string ready_env=string(READY_FD_ENVIRONMENT) + "=" + to_string(ready_read_write[1]);
+	vector<char *> envp=PrepareEnvironment(ready_env);
+	vector<int> older_fds; //the descriptors for older children
+
+	for(map<string, Module>::iterator it=modules.begin();it!=modules.end();++it)
+		if( ModuleRunning(it->second) && it->second.write_fd != -1 )
+			older_fds.push_back(it->second.write_fd);
+
 	pid_t pid=fork();
 
 	if(pid==-1)
@@ -76,33 +291,341 @@ void Control::EnableModule(const std::string& name, const std::string& module_ca
 	if(pid==0) //child
 	{
 		close(pipe_read_write[1]);
-		if( dup2(pipe_read_write[0], STDIN_FILENO) == -1)
-			DieErrno("Control: EnableModule child dup2 failed\n");
+		close(scheduled_read_write[1]);
 
-		//close the descriptors for older children
+		//the signal mask is inherited through execve
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		if( sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1 )
+			ChildFailed("Control: EnableModule child sigprocmask failed\n");
 
-		map<string, Module>::iterator it;
+		if( dup2(pipe_read_write[0], STDIN_FILENO) == -1)
+			ChildFailed("Control: EnableModule child dup2 failed\n");
 
-		for(it=modules.begin();it!=modules.end();++it)
-			if(it->second.state == MODULE_ENABLED)
-				close(it->second.write_fd);
+		//the ready pipe write end is the only one that survives execve
+		if( fcntl(ready_read_write[1], F_SETFD, 0) == -1 )
+			ChildFailed("Control: EnableModule child ready fd failed\n");
 
-		string argv_str;
-		vector<char *> argv=PrepareExecvArgumentList(module_call, argv_str);
+		for(size_t i=0;i<older_fds.size();++i)
+			close(older_fds[i]);
 
-		if( execv(argv[0], &argv[0]) == -1 )
-			DieErrno("Control: EnableModule execv failed\n");
+		//the scheduling applied to the child is inherited through execve
+		char eof;
+		while( read(scheduled_read_write[0], &eof, 1) == -1 && errno == EINTR )
+			;
+
+		execve(argv[0], &argv[0], &envp[0]);
+		ChildFailed("Control: EnableModule execve failed\n");
 	}
 
 	// parent pid points to child
 	close(pipe_read_write[0]);
+	close(ready_read_write[1]);
+	close(scheduled_read_write[0]);
+
+	ApplyModuleScheduling(scheduling, name, pid);
+	close(scheduled_read_write[1]);
 
-	module.state=MODULE_ENABLED;
+	module.state=MODULE_STARTING;
 	module.pid=pid;
 	module.write_fd=pipe_read_write[1];
+	module.ready_fd=ready_read_write[0];
 	module.return_value=0;
+	module.start_us=TimestampUs();
+	module.hosted=NULL;
 	modules[name]=module;
-	Sleep(module.creation_delay_ms);
+
+	WatchFd(event_fd, module.ready_fd);
+	ArmDeadline();
+}
+
+void Control::EnableHostedModule(const std::string &name, const std::string &module_call, const ModuleScheduling &scheduling, Module *module)
+{
+	int notify_read_write[2];
+	if( pipe2(notify_read_write, O_NONBLOCK | O_CLOEXEC) == -1 )
+		DieErrno("Control: EnableHostedModule pipe failed");
+
+	HostedModule *hosted=new HostedModule;
+	hosted->argv=PrepareExecvArgumentList(module_call, hosted->argv_string);
+	hosted->name=name;
+	hosted->scheduling=scheduling;
+	hosted->library=NULL;
+	hosted->entry=NULL;
+	hosted->notify_fd=notify_read_write[1];
+	hosted->tid=0;
+	hosted->return_value=-1;
+	hosted->rss_start_kb=ResidentKb(0);
+	hosted->host.stop=0;
+	hosted->host.ready=HostedModuleReady;
+	hosted->host.data=hosted;
+
+	//the module notifications come through ready_fd, it is open until the module returns
+	module->state=MODULE_STARTING;
+	module->pid=0;
+	module->write_fd=-1;
+	module->ready_fd=notify_read_write[0];
+	module->return_value=0;
+	module->start_us=TimestampUs();
+	module->hosted=hosted;
+	modules[name]=*module;
+
+	WatchFd(event_fd, module->ready_fd);
+	ArmDeadline();
+
+	if( (hosted->library=dlopen(hosted->argv[0], RTLD_NOW | RTLD_LOCAL)) == NULL || (hosted->entry=(ModuleHostEntry)dlsym(hosted->library, MODULE_HOST_ENTRY)) == NULL )
+	{	//reported like failed execv
+		fprintf(stderr, "Control: unable to host module %s: %s\n", name.c_str(), dlerror());
+		if( write(hosted->notify_fd, &HOSTED_RETURNED, 1) == -1 )
+			DieErrno("Control: EnableHostedModule write failed");
+		return;
+	}
+
+	//ev3control signals should be handled by the main thread
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &previous);
+	hosted->thread=std::thread(RunHostedModule, hosted);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+void Control::EnableZygoteModule(const std::string &name, const std::string &module_call, const ModuleScheduling &scheduling, Module *module)
+{
+	int pipe_read_write[2];
+	if( pipe2(pipe_read_write, O_NONBLOCK) == -1 )
+		DieErrno("Control: EnableZygoteModule pipe failed");
+
+	int ready_read_write[2];
+	if( pipe2(ready_read_write, O_NONBLOCK | O_CLOEXEC) == -1 )
+		DieErrno("Control: EnableZygoteModule ready pipe failed");
+
+	//the zygote has its own copies of the module ends
+	pid_t pid=zygote->Fork(module_call, pipe_read_write[0], ready_read_write[1]);
+	close(pipe_read_write[0]);
+	close(ready_read_write[1]);
+
+	module->state=MODULE_STARTING;
+	module->pid=pid;
+	module->write_fd=pipe_read_write[1];
+	module->ready_fd=ready_read_write[0];
+	module->return_value=0;
+	module->start_us=TimestampUs();
+	module->hosted=NULL;
+
+	if(pid == -1)
+	{	//reported like failed execv, through failed_fd
+		fprintf(stderr, "Control: unable to fork module %s from zygote\n", name.c_str());
+		module->pid=0;
+		list<ModuleEvent> events;
+		ModuleExited(name, module, -1, &events);
+		QueueFailed(&events);
+		return;
+	}
+
+	//the module is already running, applied as soon as possible
+	ApplyModuleScheduling(scheduling, name, pid);
+
+	modules[name]=*module;
+
+	WatchFd(event_fd, module->ready_fd);
+	ArmDeadline();
+}
+
+// the events that didn't come from ProcessEvents, returned by it through failed_fd
+void Control::QueueFailed(std::list<ModuleEvent> *events)
+{
+	if(events->empty())
+		return;
+
+	failed.splice(failed.end(), *events);
+
+	uint64_t one=1;
+	if( write(failed_fd, &one, sizeof(one)) == -1 )
+		DieErrno("Control: eventfd write failed");
+}
+
+void Control::EnableModules(const std::list<ModuleRequest> &requests)
+{
+	list<ModuleEvent> events;
+
+	pending.insert(pending.end(), requests.begin(), requests.end());
+
+	FailCyclicPending(&events);
+	StartPending(&events);
+	QueueFailed(&events);
+}
+
+bool Control::IsPending(const std::string &name) const
+{
+	for(list<ModuleRequest>::const_iterator it=pending.begin();it!=pending.end();++it)
+		if(it->name == name)
+			return true;
+	return false;
+}
+
+bool Control::CancelPending(const std::string &name)
+{
+	list<ModuleEvent> events;
+
+	for(list<ModuleRequest>::iterator it=pending.begin();it!=pending.end();++it)
+		if(it->name == name)
+		{
+			pending.erase(it);
+			//the modules depending on it fail
+			StartPending(&events);
+			QueueFailed(&events);
+			return true;
+		}
+
+	return false;
+}
+
+std::list<std::string> Control::CancelPending()
+{
+	list<string> names;
+
+	for(list<ModuleRequest>::iterator it=pending.begin();it!=pending.end();++it)
+		names.push_back(it->name);
+
+	pending.clear();
+	return names;
+}
+
+// 1 if enabled, 0 if it may still be (starting or queued), -1 if it will not be
+int Control::DependencyState(const std::string &dependency)
+{
+	if( IsPending(dependency) )
+		return 0;
+
+	map<string, Module>::iterator it=modules.find(dependency);
+
+	if(it == modules.end())
+		return -1;
+	if(it->second.state == MODULE_ENABLED)
+		return 1;
+	if(it->second.state == MODULE_STARTING)
+		return 0;
+	return -1;
+}
+
+// the queued modules that can't start because of dependency cycle (directly or through other modules)
+void Control::FailCyclicPending(std::list<ModuleEvent> *events)
+{
+	list<ModuleRequest>::iterator it;
+	set<string> resolvable;
+	bool progress=true;
+
+	//resolvable if all the dependencies are not queued or resolvable themselves
+	while(progress)
+	{
+		progress=false;
+
+		for(it=pending.begin();it!=pending.end();++it)
+		{
+			if( resolvable.count(it->name) )
+				continue;
+
+			size_t i;
+			for(i=0;i<it->dependencies.size();++i)
+				if( IsPending(it->dependencies[i]) && !resolvable.count(it->dependencies[i]) )
+					break;
+
+			if(i == it->dependencies.size())
+			{
+				resolvable.insert(it->name);
+				progress=true;
+			}
+		}
+	}
+
+	for(it=pending.begin();it!=pending.end();)
+	{
+		if( resolvable.count(it->name) )
+		{
+			++it;
+			continue;
+		}
+
+		fprintf(stderr, "Control: module %s is in dependency cycle\n", it->name.c_str());
+		string name=it->name;
+		it=pending.erase(it);
+		PendingFailed(name, events);
+	}
+}
+
+// starts the queued modules with enabled dependencies, fails the ones with dependencies that will not be
+void Control::StartPending(std::list<ModuleEvent> *events)
+{
+	list<ModuleRequest>::iterator it;
+	bool progress=true;
+
+	//the failure may fail the other queued modules
+	while(progress)
+	{
+		progress=false;
+
+		for(it=pending.begin();it!=pending.end();)
+		{
+			int state=1;
+			size_t i;
+
+			for(i=0;i<it->dependencies.size() && state != -1;++i)
+				if( DependencyState(it->dependencies[i]) < state )
+					state=DependencyState(it->dependencies[i]);
+
+			map<string, Module>::iterator instance=modules.find(it->name);
+
+			//waiting for the dependencies or for the stopping instance to exit
+			if(state == 0 || (state == 1 && instance != modules.end() && instance->second.state == MODULE_STOPPING))
+			{
+				++it;
+				continue;
+			}
+
+			ModuleRequest request=*it;
+			it=pending.erase(it);
+			progress=true;
+
+			if(state == -1)
+			{
+				fprintf(stderr, "Control: module %s dependency %s is not enabled\n", request.name.c_str(), request.dependencies[i-1].c_str());
+				PendingFailed(request.name, events);
+				continue;
+			}
+
+			Module module;
+			bool contains_module=ContainsModule(request.name, &module);
+
+			if( contains_module && ModuleRunning(module) )
+				continue; //enabled with ENABLE in the meantime
+
+			if(!contains_module)
+				InsertModule(request.name, request.creation_delay_ms);
+
+			EnableModule(request.name, request.call, request.scheduling);
+
+			printf("Control: starting module: %s (%s)\n", request.name.c_str(), ModuleSchedulingString(request.scheduling).c_str());
+		}
+	}
+}
+
+// the queued module that will not be started
+void Control::PendingFailed(const std::string &name, std::list<ModuleEvent> *events)
+{
+	if( modules.find(name) == modules.end() )
+		InsertModule(name, 0);
+
+	Module &module=modules[name];
+
+	//the stopping instance keeps its state until it exits
+	if( !ModuleRunning(module) )
+	{
+		module.state=MODULE_FAILED;
+		module.return_value=-1;
+	}
+
+	ModuleEvent event={MODULE_EVENT_FAILED, name, -1, false, MODULE_STOP_STDIN, 0, false, 0, 0};
+	events->push_back(event);
 }
 
 vector<char*> Control::PrepareExecvArgumentList(const string& module_call, string &out_argv_string)
@@ -124,156 +647,367 @@ vector<char*> Control::PrepareExecvArgumentList(const string& module_call, strin
 }
 
 
-bool Control::DisableModule(const std::string &name)
+void Control::DisableModule(const std::string &name)
 {
 	Module module;
 
 	if( !ContainsModule(name, &module) )
 		Die("Control: request to disable module but no such module\n");
 
-	if(module.state != MODULE_ENABLED)
+	if(module.state != MODULE_ENABLED && module.state != MODULE_STARTING)
 		Die("Control: request to disable module but module is not enabled\n");
 
+	//the module should exit on EOF (or stop request if hosted), escalation in ExpireDeadlines
+	if(module.hosted)
+		__atomic_store_n(&module.hosted->host.stop, 1, __ATOMIC_RELEASE);
+	else
+		CloseReadyFd(&module);
+
 	if(module.write_fd!=-1)
 	{
 		close(module.write_fd);
 		module.write_fd=-1;
-		modules[name]=module;
 	}
 
-	if(DisableModuleWait(name, &module))
-		return true;
+	module.state=MODULE_STOPPING;
+	module.stop_stage=MODULE_STOP_STDIN;
+	module.stop_us=module.stop_stage_us=TimestampUs();
+	modules[name]=module;
+
+	ArmDeadline();
+}
+
+// closing the descriptor also removes it from event_fd
+void Control::CloseReadyFd(Module *module)
+{
+	if(module->ready_fd == -1)
+		return;
+	close(module->ready_fd);
+	module->ready_fd=-1;
+}
+
+int Control::DisableModules()
+{
+	map<string, Module>::iterator it;
+	int disabling=0;
+
+	for(it=modules.begin();it!=modules.end();++it)
+	{
+		if(it->second.state != MODULE_ENABLED && it->second.state != MODULE_STARTING)
+			continue;
+
+		DisableModule(it->first);
+		++disabling;
+	}
+	return disabling;
+}
+
+std::list<ModuleEvent> Control::DisableModulesWait()
+{
+	list<ModuleEvent> events, processed;
 
-	fprintf(stderr, "Control: DisableModule terminating module %s with SIGINT\n", name.c_str());	
+	//the queued modules are never started
+	CancelPending();
+	DisableModules();
 
-	if(kill(module.pid, SIGINT) == -1)
-		DieErrno("Control: DisableModule kill SIGINT error\n");
+	while( RunningModules() > 0 )
+	{
+		struct pollfd pfd={event_fd, POLLIN, 0};
 
-	if(DisableModuleWait(name, &module))
-		return true;
+		//the deadline timer is also in event_fd so this doesn't wait longer than needed
+		if( poll(&pfd, 1, -1) == -1 && errno != EINTR )
+			DieErrno("Control: DisableModulesWait poll failed");
 
-	fprintf(stderr, "Control: DisableModule terminating module %s with SIGKILL\n", name.c_str());	
+		processed=ProcessEvents();
+		events.splice(events.end(), processed);
+	}
 
-	if(kill(module.pid, SIGKILL) == -1)
-		DieErrno("Control: DisableModule kill SIGKILL error\n");
+	return events;
+}
 
-	if(DisableModuleWait(name, &module))
-		return true;
+int Control::RunningModules() const
+{
+	map<string, Module>::const_iterator it;
+	int running=0;
 
-	fprintf(stderr, "Control: DisableModule unable to terminate module %s with SIGKILL\n", name.c_str());	
+	for(it=modules.begin();it!=modules.end();++it)
+		if( ModuleRunning(it->second) )
+			++running;
 
-	return false;
+	return running;
 }
 
-bool Control::DisableModuleWait(const std::string &name, Module *module)
+void Control::SampleModules()
 {
-	int status;
-	pid_t pid;
+	map<string, Module>::iterator it;
 
-	for(int i=0;i<MODULE_DISABLE_TRIES;++i)
+	//the module may exit before it is reaped, the last sample is kept then
+	for(it=modules.begin();it!=modules.end();++it)
+		if(it->second.state == MODULE_ENABLED)
+		{	//hosted module thread that wasn't running when it was enabled (readiness timeout)
+			if(it->second.hosted && it->second.usage.stat_fd == -1)
+				OpenUsage(&it->second);
+			SampleModuleUsage(&it->second.usage);
+		}
+}
+
+std::list<ModuleEvent> Control::ProcessEvents()
+{
+	struct epoll_event events[CONTROL_MAX_EVENTS];
+	list<ModuleEvent> module_events;
+	uint64_t expirations, count;
+	int n;
+
+	if( (n=epoll_wait(event_fd, events, CONTROL_MAX_EVENTS, 0)) == -1 )
 	{
-		Sleep(MODULE_DISABLE_MS);
-		if( (pid=waitpid(module->pid, &status, WNOHANG)) == -1)
-			DieErrno("Control: DisableModule waitpid error");
-		if (pid == 0)
-			continue;
+		if(errno == EINTR)
+			return module_events;
+		DieErrno("Control: epoll_wait failed");
+	}
 
-		module->pid=0;
-		module->state=MODULE_DISABLED;
-		modules[name]=*module;
+	for(int i=0;i<n;++i)
+	{
+		int fd=events[i].data.fd;
 
-		return true;
+		if(fd == child_fd)
+			ReapModules(&module_events);
+		else if(fd == deadline_fd)
+		{
+			if( read(deadline_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+				DieErrno("Control: timerfd read failed");
+			ExpireDeadlines(&module_events);
+		}
+		else if(fd == failed_fd)
+		{
+			if( read(failed_fd, &count, sizeof(count)) == -1 && errno != EAGAIN )
+				DieErrno("Control: eventfd read failed");
+			module_events.splice(module_events.end(), failed);
+		}
+		else
+			ReadReady(fd, &module_events);
 	}
-	return false;
+
+	//the enabled or failed modules may be the dependencies of the queued ones
+	if( !pending.empty() )
+		StartPending(&module_events);
+
+	return module_events;
 }
 
-std::list<std::string> Control::DisableModules()
+void Control::ReapModules(std::list<ModuleEvent> *events)
 {
-	map<string, Module>::iterator it;
-	list<std::string> disabled;
+	struct signalfd_siginfo info;
+	int status;
+	pid_t pid;
 
-	for(it=modules.begin();it!=modules.end();++it)
+	//SIGCHLD signals coalesce, the siginfo can't be trusted to name every child
+	while( read(child_fd, &info, sizeof(info)) == sizeof(info) )
+		;
+
+	while( (pid=waitpid(-1, &status, WNOHANG)) > 0 )
 	{
-		Module module=it->second;
+		map<string, Module>::iterator it;
+
+		for(it=modules.begin();it!=modules.end();++it)
+			if( ModuleRunning(it->second) && it->second.pid == pid )
+				break;
 
-		if(module.state != MODULE_ENABLED)
+		if(it == modules.end())
 			continue;
 
-		if(DisableModule(it->first))
-			disabled.push_back(it->first);
+		Module module=it->second;
+
+		module.pid=0;
+		ModuleExited(it->first, &module, ModuleReturnValue(status), events);
 	}
-	return disabled;
+
+	if(pid == -1 && errno != ECHILD)
+		DieErrno("Control: ReapModules waitpid error\n");
 }
 
-ModuleState Control::CheckModuleState(const std::string& name)
+void Control::ReadReady(int ready_fd, std::list<ModuleEvent> *events)
 {
-	map<std::string, Module>::iterator it=modules.find(name);
-	if( it == modules.end() )
-		Die("Control: request to check module state but module is not present\n");
+	map<string, Module>::iterator it;
+
+	for(it=modules.begin();it!=modules.end();++it)
+		if(it->second.ready_fd == ready_fd)
+			break;
+
+	if(it == modules.end())
+		return; //already closed in this batch
 
 	Module module=it->second;
 
-	// if not enabled just return state
-	if(module.state != MODULE_ENABLED )
-		return module.state;
+	if(module.hosted)
+	{
+		ReadHosted(it->first, &module, events);
+		return;
+	}
 
-	// otherwise check state and return it
+	char ready;
+	int result=read(ready_fd, &ready, 1);
 
-	int status;
-	int ret=waitpid(module.pid, &status, WNOHANG );
+	if(result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
 
-	if(ret == 0) //still running
-		return MODULE_ENABLED;
+	CloseReadyFd(&module);
+
+	if(result == 1)
+		ModuleEnabled(it->first, &module, true, events);
+	else
+		modules[it->first]=module; //closed without signalling, exit or timeout decides
+}
+
+void Control::ReadHosted(const std::string &name, Module *module, std::list<ModuleEvent> *events)
+{
+	char notification;
 
-	if(ret == module.pid)
+	while( read(module->ready_fd, &notification, 1) == 1 )
 	{
-		close(module.write_fd);
-		module.state=MODULE_FAILED;
-		module.write_fd=0;
-		module.pid=0;
-		module.return_value=ModuleReturnValue(status);
-		modules[name]=module;
-		return MODULE_FAILED;
+		if(notification == HOSTED_READY && module->state == MODULE_STARTING)
+			ModuleEnabled(name, module, true, events);
+		else if(notification == HOSTED_RETURNED)
+		{
+			HostedModule *hosted=module->hosted;
+			int32_t return_value=hosted->return_value;
+
+			if(hosted->thread.joinable())
+				hosted->thread.join();
+			if(hosted->library)
+				dlclose(hosted->library);
+			close(hosted->notify_fd);
+			delete hosted;
+
+			module->hosted=NULL;
+			ModuleExited(name, module, return_value, events);
+			return;
+		}
 	}
-
-	DieErrno("Control: CheckModuleState waitpid failed\n");
-	return module.state;
 }
 
-std::list<FailedModule> Control::CheckModulesStates()
+// the process was reaped or the hosted module returned
+void Control::ModuleExited(const std::string &name, Module *module, int32_t return_value, std::list<ModuleEvent> *events)
 {
-	list<FailedModule> failed;
+	module->return_value=return_value;
+	CloseReadyFd(module);
+	CloseModuleUsage(&module->usage);
+	int cpu_permille=AverageCpuPermille(module->usage);
 
-	int status, ret;
+	if(module->state == MODULE_STOPPING)
+	{
+		module->state=MODULE_DISABLED;
+		modules[name]=*module;
 
+		ModuleEvent event={MODULE_EVENT_DISABLED, name, return_value, false, module->stop_stage, TimestampUs()-module->stop_us, false, 0, cpu_permille};
+		events->push_back(event);
+		return;
+	}
+
+	if(module->write_fd != -1)
+		close(module->write_fd);
+	module->state=MODULE_FAILED;
+	module->write_fd=-1;
+	modules[name]=*module;
+
+	ModuleEvent event={MODULE_EVENT_FAILED, name, return_value, false, MODULE_STOP_STDIN, TimestampUs()-module->start_us, false, 0, cpu_permille};
+	events->push_back(event);
+}
+
+void Control::ExpireDeadlines(std::list<ModuleEvent> *events)
+{
+	static const int STOP_SIGNALS[]={SIGINT, SIGKILL};
+	static const char *STOP_SIGNAL_NAMES[]={"SIGINT", "SIGKILL"};
 	map<string, Module>::iterator it;
+	uint64_t now=TimestampUs();
 
 	for(it=modules.begin();it!=modules.end();++it)
 	{
 		Module module=it->second;
+		uint64_t deadline_us=ModuleDeadlineUs(module);
+
+		if(deadline_us == 0 || now < deadline_us)
+			continue;
 
-		if(module.state != MODULE_ENABLED)
+		if(module.state == MODULE_STARTING)
+		{
+			fprintf(stderr, "Control: module %s didn't signal readiness in %d ms, assuming ready\n", it->first.c_str(), ReadinessTimeoutMs(module));
+			if(!module.hosted)
+				CloseReadyFd(&module);
+			ModuleEnabled(it->first, &module, false, events);
 			continue;
+		}
 
-		ret=waitpid(module.pid, &status, WNOHANG );
+		//MODULE_STOPPING
+		module.stop_stage_us=now;
 
-		if(ret == 0) //still running
+		if(module.hosted && module.stop_stage == MODULE_STOP_SIGKILL)
+		{	//the thread may still use its library, memory and pipe, leave them
+			fprintf(stderr, "Control: abandoning hosted module %s that doesn't stop\n", it->first.c_str());
+			module.hosted->thread.detach();
+			module.hosted=NULL;
+			module.state=MODULE_ENABLED; //reported as failure
+			ModuleExited(it->first, &module, -1, events);
+			continue;
+		}
+
+		if(module.hosted)
+		{	//threads can't be signalled
+			fprintf(stderr, "Control: hosted module %s didn't stop yet\n", it->first.c_str());
+			module.stop_stage=(ModuleStopStage)(module.stop_stage+1);
+			modules[it->first]=module;
 			continue;
-		if(ret == -1)
-			DieErrno("Control: CheckModuleStates waitpid error\n");
-		if(ret == module.pid)
+		}
+
+		if(module.stop_stage == MODULE_STOP_SIGKILL)
 		{
-			close(module.write_fd);
-			module.state=MODULE_FAILED;
-			module.write_fd=0;
-			module.pid=0;
-			module.return_value = ModuleReturnValue(status);
+			fprintf(stderr, "Control: unable to terminate module %s with SIGKILL, still waiting\n", it->first.c_str());
 			modules[it->first]=module;
+			continue;
+		}
 
-			FailedModule fail={it->first, module.return_value};
+		fprintf(stderr, "Control: terminating module %s with %s\n", it->first.c_str(), STOP_SIGNAL_NAMES[module.stop_stage]);
 
-			failed.push_back(fail);
-		}
+		if(kill(module.pid, STOP_SIGNALS[module.stop_stage]) == -1)
+			DieErrno("Control: kill error\n");
+
+		module.stop_stage=(ModuleStopStage)(module.stop_stage+1);
+		modules[it->first]=module;
 	}
-	return failed;
+
+	ArmDeadline();
+}
+
+void Control::ModuleEnabled(const std::string &name, Module *module, bool signalled, std::list<ModuleEvent> *events)
+{
+	module->state=MODULE_ENABLED;
+	module->rss_kb = module->hosted ? ResidentKb(0) - module->hosted->rss_start_kb : ResidentKb(module->pid);
+
+	//the hosted module thread may not run yet (readiness timeout), SampleModules opens it later then
+	if( OpenUsage(module) ? !SampleModuleUsage(&module->usage) : !module->hosted )
+		fprintf(stderr, "Control: unable to sample module %s resource usage\n", name.c_str());
+
+	modules[name]=*module;
+
+	ModuleEvent event={MODULE_EVENT_ENABLED, name, 0, signalled, MODULE_STOP_STDIN, TimestampUs()-module->start_us, module->hosted != NULL, module->rss_kb, 0};
+	events->push_back(event);
+}
+
+// one shot timer at the earliest readiness timeout or stop escalation, disarmed if none
+void Control::ArmDeadline()
+{
+	map<string, Module>::iterator it;
+	uint64_t deadline_us=0, module_deadline_us;
+
+	for(it=modules.begin();it!=modules.end();++it)
+		if( (module_deadline_us=ModuleDeadlineUs(it->second)) != 0 && (deadline_us == 0 || module_deadline_us < deadline_us) )
+			deadline_us=module_deadline_us;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec=deadline_us / 1000000;
+	its.it_value.tv_nsec=(deadline_us % 1000000) * 1000L;
+
+	//zero it_value disarms, absolute time on the TimestampUs clock otherwise
+	if( timerfd_settime(deadline_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1 )
+		DieErrno("Control: timerfd_settime failed");
 }
@@ -18,51 +18,159 @@
  * Those constants can be tuned:
  * https://github.com/bmegli/ev3dev-mapping/issues/28 for explanation
 */
-const int MODULE_DISABLE_TRIES=5;
-const int MODULE_DISABLE_MS=100;
+// time given to module to exit after closing its stdin, then after SIGINT, then after SIGKILL
+const int MODULE_DISABLE_STAGE_MS=500;
+// modules that don't signal readiness are assumed ready after that (or creation_delay_ms if longer)
+const int MODULE_READY_TIMEOUT_MS=5000;
+
+#include "module_usage.h"
+#include "module_scheduling.h"
 
 #include <sys/types.h> //pid_t
+#include <stdint.h> //int32_t, uint64_t
 
 #include <string> //string
 #include <map> //map
 #include <list> //list
 #include <vector> //vector
 
-enum ModuleState {MODULE_DISABLED=0, MODULE_ENABLED=1, MODULE_FAILED=2}; 
+/*
+ * Modules are started in MODULE_STARTING state and become MODULE_ENABLED when they
+ * signal readiness (NotifyReady in shared/misc.h) through inherited pipe.
+ *
+ * Disabled modules are in MODULE_STOPPING state until they exit. Their stdin is closed
+ * (so that they get EOF on read), if that doesn't help they get SIGINT and then SIGKILL.
+ * All the modules are stopped concurrently.
+ *
+ * Modules with call naming shared object (e.g. "./ev3sampler.so 10 1") are hosted in-process
+ * on their own thread instead (see shared/module_host.h). They get stop request instead
+ * of stdin EOF and they can't be signalled. The hosted module that doesn't stop after
+ * all the stages is abandoned (reported as failed).
+ *
+ * With zygote (see zygote.h) the shared object modules are forked from the zygote
+ * instead and run as processes. ev3control is their child subreaper.
+ *
+ * Control doesn't block waiting for any of that. EventFd is readable when some module
+ * signalled readiness, timed out with readiness, exited or has to be signalled.
+ * ProcessEvents returns what happened.
+ *
+ * The resource usage of the enabled modules is sampled on SampleModules (see module_usage.h).
+ *
+ * EnableModules queues the modules with dependencies. Each is started as soon as all its
+ * dependencies are MODULE_ENABLED so the independent ones start concurrently. The module fails
+ * (without starting) if its dependency is unknown, fails, is disabled or depends on it back.
+ * The queued module that is still MODULE_STOPPING starts when it exits.
+ */
+
+enum ModuleState {MODULE_DISABLED=0, MODULE_ENABLED=1, MODULE_FAILED=2, MODULE_STARTING=3, MODULE_STOPPING=4}; 
+enum ModuleStopStage {MODULE_STOP_STDIN=0, MODULE_STOP_SIGINT=1, MODULE_STOP_SIGKILL=2};
+
+struct HostedModule;
+class Zygote;
 
 struct Module
 {
 	ModuleState state;
 	int creation_delay_ms;
 	int write_fd;
+	int ready_fd;
 	pid_t pid;
 	int32_t return_value;
+	uint64_t start_us;
+	uint64_t stop_us;
+	uint64_t stop_stage_us;
+	ModuleStopStage stop_stage;
+	HostedModule *hosted; //NULL for processes
+	int rss_kb; //process RSS or ev3control RSS growth for hosted, measured when ready
+	ModuleUsage usage; //open while the module is running
+};
+
+enum ModuleEventType {MODULE_EVENT_ENABLED, MODULE_EVENT_FAILED, MODULE_EVENT_DISABLED};
+
+struct ModuleEvent
+{
+	ModuleEventType type;
+	std::string name;
+	int32_t status; //return value for MODULE_EVENT_FAILED
+	bool signalled; //readiness was signalled (not timed out) for MODULE_EVENT_ENABLED
+	ModuleStopStage stop_stage; //what made the module exit for MODULE_EVENT_DISABLED
+	uint64_t elapsed_us; //since start or since disable request for MODULE_EVENT_DISABLED
+	bool hosted;
+	int rss_kb; //for MODULE_EVENT_ENABLED
+	int cpu_permille; //average while enabled for MODULE_EVENT_DISABLED and MODULE_EVENT_FAILED
 };
 
-struct FailedModule
+// the module waiting in EnableModules queue
+struct ModuleRequest
 {
 	std::string name;
-	int status;
+	std::string call;
+	int creation_delay_ms;
+	ModuleScheduling scheduling;
+	std::vector<std::string> dependencies; //module names
 };
 
 class Control
 {
 private:
 	std::map<std::string, Module> modules;
+	int child_fd; //SIGCHLD signalfd
+	int deadline_fd; //readiness timeout and stop escalation timerfd
+	int failed_fd; //eventfd, the modules that failed to start are in failed
+	int event_fd; //epoll with the above and modules ready fds
+	std::list<ModuleEvent> failed;
+	std::list<ModuleRequest> pending; //waiting for dependencies
+	Zygote *zygote;
 	
 	std::vector<char *> PrepareExecvArgumentList(const std::string &module_call, std::string &out_argv_string);
-	bool DisableModuleWait(const std::string &name, Module *module);
+	void CloseReadyFd(Module *module);
+	void EnableHostedModule(const std::string &name, const std::string &call, const ModuleScheduling &scheduling, Module *module);
+	void EnableZygoteModule(const std::string &name, const std::string &call, const ModuleScheduling &scheduling, Module *module);
+	void ReadHosted(const std::string &name, Module *module, std::list<ModuleEvent> *events);
+	void ModuleExited(const std::string &name, Module *module, int32_t return_value, std::list<ModuleEvent> *events);
+	int RunningModules() const;
+
+	void ReapModules(std::list<ModuleEvent> *events);
+	void ReadReady(int ready_fd, std::list<ModuleEvent> *events);
+	void ExpireDeadlines(std::list<ModuleEvent> *events);
+	void ArmDeadline();
+	void ModuleEnabled(const std::string &name, Module *module, bool signalled, std::list<ModuleEvent> *events);
+	void QueueFailed(std::list<ModuleEvent> *events);
+
+	int DependencyState(const std::string &dependency);
+	void FailCyclicPending(std::list<ModuleEvent> *events);
+	void StartPending(std::list<ModuleEvent> *events);
+	void PendingFailed(const std::string &name, std::list<ModuleEvent> *events);
 public:
-	Control();
+	// zygote may be NULL, otherwise it has to be started and outlive Control
+	explicit Control(Zygote *zygote=NULL);
 	~Control();
 	
 	bool ContainsModule(const std::string &name, Module *module);
 	void InsertModule(const std::string &name, int creation_delay_ms);
-	void EnableModule(const std::string &name, const std::string &call);
-	bool DisableModule(const std::string &name);
-	std::list<std::string> DisableModules();
+	// the scheduling is applied by the module before execv (see module_scheduling.h)
+	void EnableModule(const std::string &name, const std::string &call, const ModuleScheduling &scheduling);
+	// queues the modules, each starts when its dependencies are enabled (possibly right away)
+	void EnableModules(const std::list<ModuleRequest> &requests);
+	bool IsPending(const std::string &name) const;
+	// removes the module from the queue, false if it is not there
+	bool CancelPending(const std::string &name);
+	// empties the queue, returns the module names
+	std::list<std::string> CancelPending();
+	// starts stopping the module, MODULE_EVENT_DISABLED is returned by ProcessEvents when it exits
+	void DisableModule(const std::string &name);
+	// starts stopping all the enabled modules, returns their number
+	int DisableModules();
+	// stops all the modules and waits until they exit, returns the events
+	std::list<ModuleEvent> DisableModulesWait();
+
+	// samples the resource usage of the enabled modules
+	void SampleModules();
+	const std::map<std::string, Module> &Modules() const { return modules; }
 
-	ModuleState CheckModuleState(const std::string &name);
-	std::list<FailedModule> CheckModulesStates();	
+	// readable (epoll) when there are module events, SIGCHLD is received only through it
+	int EventFd() const { return event_fd; }
+	// readiness and exits of the modules, call when EventFd is readable
+	std::list<ModuleEvent> ProcessEvents();
 };
 
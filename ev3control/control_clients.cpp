@@ -0,0 +1,274 @@
+/*
+ * ev3dev-mapping ev3control ControlClients class implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "control_clients.h"
+#include "net_tcp.h"
+
+#include "shared/misc.h"
+
+#include <sys/epoll.h> //epoll_ctl
+#include <sys/socket.h> //send
+
+#include <unistd.h> //read, close
+#include <errno.h> //errno
+#include <stdio.h> //printf
+#include <string.h> //memmove, memset
+
+using namespace std;
+
+ControlClients::ControlClients(int epoll_fd): epoll_fd(epoll_fd), next_id(0), accepted(0), rejected(0), overflowed(0)
+{
+}
+
+ControlClients::~ControlClients()
+{
+	map<int, ControlClient*>::iterator it;
+
+	//closing the socket also removes it from epoll
+	for(it=clients.begin();it!=clients.end();++it)
+	{
+		close(it->first);
+		delete it->second;
+	}
+}
+
+void ControlClients::Accept(int serv_socket)
+{
+	int client_socket;
+
+	while( AcceptClientTCP(serv_socket, &client_socket) )
+	{
+		if(Count() >= CONTROL_MAX_CLIENTS)
+		{
+			fprintf(stderr, "ev3control: rejecting client, already serving %d clients\n", Count());
+			close(client_socket);
+			++rejected;
+			continue;
+		}
+
+		ControlClient *client=new ControlClient;
+		client->socket=client_socket;
+		client->id=next_id++;
+		client->input_bytes=client->message_bytes=client->discard_bytes=0;
+		client->last_receive_us=TimestampUs();
+		client->closing=false;
+
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events=EPOLLIN;
+		event.data.fd=client_socket;
+
+		if( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1 )
+			DieErrno("ControlClients: epoll_ctl failed");
+
+		clients[client_socket]=client;
+		++accepted;
+
+		printf("ev3control: client %d connected (%d connected)\n", client->id, Count());
+	}
+}
+
+ControlClient *ControlClients::Find(int socket)
+{
+	map<int, ControlClient*>::iterator it=clients.find(socket);
+	return it == clients.end() ? NULL : it->second;
+}
+
+bool ControlClients::Read(ControlClient *client)
+{
+	int result=read(client->socket, client->input+client->input_bytes, CONTROL_BUFFER_BYTES-client->input_bytes);
+
+	if(result == 0)
+		return false;
+
+	if(result == -1)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return true;
+		perror("ev3control: read");
+		return false;
+	}
+
+	client->input_bytes += result;
+	client->last_receive_us=TimestampUs();
+	return true;
+}
+
+const char *ControlClients::NextMessage(ControlClient *client)
+{
+	while(true)
+	{
+		if(client->discard_bytes)
+		{
+			int bytes = client->discard_bytes < client->input_bytes ? client->discard_bytes : client->input_bytes;
+			Drop(client, bytes);
+			client->discard_bytes -= bytes;
+			if(client->discard_bytes)
+				return NULL;
+		}
+
+		if(client->input_bytes < CONTROL_HEADER_BYTES)
+			return NULL;
+
+		int length=CONTROL_HEADER_BYTES + GetControlHeaderPayloadLength(client->input);
+
+		if(length > CONTROL_BUFFER_BYTES)
+		{
+			fprintf(stderr, "ev3control: ignoring message, doesn't fit buffer: payload %d, buffer is %d\n", length-CONTROL_HEADER_BYTES, CONTROL_BUFFER_BYTES-CONTROL_HEADER_BYTES);
+			client->discard_bytes=length;
+			continue;
+		}
+
+		if(client->input_bytes < length)
+			return NULL;
+
+		client->message_bytes=length;
+		return client->input;
+	}
+}
+
+void ControlClients::Consume(ControlClient *client)
+{
+	Drop(client, client->message_bytes);
+	client->message_bytes=0;
+}
+
+void ControlClients::Drop(ControlClient *client, int bytes)
+{
+	client->input_bytes -= bytes;
+	memmove(client->input, client->input+bytes, client->input_bytes);
+}
+
+void ControlClients::Send(ControlClient *client, const char *msg, int msg_len)
+{
+	int sent=0;
+
+	if(client->closing)
+		return;
+
+	if(client->output.empty())
+	{
+		if( (sent=send(client->socket, msg, msg_len, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 )
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				perror("ev3control: socket send failed");
+				Close(client);
+				return;
+			}
+			sent=0;
+		}
+		if(sent == msg_len)
+			return;
+	}
+
+	if( client->output.size() + msg_len - sent > (size_t)CONTROL_CLIENT_OUTPUT_BYTES )
+	{
+		fprintf(stderr, "ev3control: client %d doesn't read replies, disconnecting\n", client->id);
+		++overflowed;
+		Close(client);
+		return;
+	}
+
+	bool was_empty=client->output.empty();
+
+	client->output.append(msg+sent, msg_len-sent);
+
+	if(was_empty)
+		Watch(client, true);
+}
+
+void ControlClients::Broadcast(const char *msg, int msg_len)
+{
+	map<int, ControlClient*>::iterator it;
+
+	for(it=clients.begin();it!=clients.end();++it)
+		Send(it->second, msg, msg_len);
+}
+
+void ControlClients::SendIdle(const char *msg, int msg_len, uint64_t idle_us)
+{
+	map<int, ControlClient*>::iterator it;
+	uint64_t now=TimestampUs();
+
+	for(it=clients.begin();it!=clients.end();++it)
+		if(now - it->second->last_receive_us >= idle_us)
+			Send(it->second, msg, msg_len);
+}
+
+void ControlClients::Flush(ControlClient *client)
+{
+	int sent;
+
+	if(client->closing || client->output.empty())
+		return;
+
+	if( (sent=send(client->socket, client->output.data(), client->output.size(), MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 )
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		perror("ev3control: socket send failed");
+		Close(client);
+		return;
+	}
+
+	client->output.erase(0, sent);
+
+	if(client->output.empty())
+		Watch(client, false);
+}
+
+void ControlClients::Watch(ControlClient *client, bool writable)
+{
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.fd=client->socket;
+
+	if( epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->socket, &event) == -1 )
+		DieErrno("ControlClients: epoll_ctl failed");
+}
+
+void ControlClients::Close(ControlClient *client)
+{
+	client->closing=true;
+}
+
+void ControlClients::Sweep()
+{
+	map<int, ControlClient*>::iterator it=clients.begin();
+
+	while(it != clients.end())
+	{
+		ControlClient *client=it->second;
+
+		if(!client->closing)
+		{
+			++it;
+			continue;
+		}
+
+		//closing the socket also removes it from epoll
+		CloseNetworkTCP(client->socket);
+		clients.erase(it++);
+
+		printf("ev3control: client %d disconnected (%d connected)\n", client->id, Count());
+		delete client;
+	}
+}
+
+void ControlClients::Print() const
+{
+	printf("ev3control: clients - accepted %d, rejected %d, disconnected for not reading %d\n", accepted, rejected, overflowed);
+}
@@ -0,0 +1,91 @@
+/*
+ * ev3dev-mapping ev3control ControlClients class header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * ControlClients keeps the concurrent controller connections (e.g. UI, recorder, monitoring tool).
+ *
+ * All the sockets are non-blocking and registered in the caller's epoll:
+ * -input is accumulated per connection until a complete message is available
+ * -output that the socket doesn't accept immediately is queued and sent on EPOLLOUT
+ * -a client that doesn't read its replies (queue over CONTROL_CLIENT_OUTPUT_BYTES) is disconnected
+ *
+ * Clients are closed lazily (Close marks, Sweep removes) so that they can be
+ * dropped while the caller iterates over epoll events or broadcasts.
+ */
+
+#pragma once
+
+#include "control_protocol.h"
+
+#include <stdint.h> //uint64_t
+#include <string> //string
+#include <map> //map
+
+const int CONTROL_MAX_CLIENTS=8;
+const int CONTROL_CLIENT_OUTPUT_BYTES=16384;
+
+struct ControlClient
+{
+	int socket;
+	int id;
+	char input[CONTROL_BUFFER_BYTES];
+	int input_bytes;
+	int message_bytes; //the message returned by NextMessage
+	int discard_bytes; //the rest of message that doesn't fit the buffer
+	uint64_t last_receive_us;
+	std::string output;
+	bool closing;
+};
+
+class ControlClients
+{
+public:
+	explicit ControlClients(int epoll_fd);
+	~ControlClients();
+
+	// accepts all the pending connections
+	void Accept(int serv_socket);
+	// returns NULL if socket is not a client
+	ControlClient *Find(int socket);
+
+	// reads the available data, false on disconnect or error
+	bool Read(ControlClient *client);
+	// returns the next complete message or NULL, the message is valid until Consume
+	const char *NextMessage(ControlClient *client);
+	void Consume(ControlClient *client);
+
+	// sends or queues the message, closes the client on error or overflow
+	void Send(ControlClient *client, const char *msg, int msg_len);
+	void Broadcast(const char *msg, int msg_len);
+	// sends to the clients that didn't send anything for idle_us
+	void SendIdle(const char *msg, int msg_len, uint64_t idle_us);
+	// the socket is writable, sends the queued output
+	void Flush(ControlClient *client);
+
+	void Close(ControlClient *client);
+	// removes the closed clients
+	void Sweep();
+
+	int Count() const { return clients.size(); }
+	void Print() const;
+private:
+	int epoll_fd;
+	int next_id;
+	std::map<int, ControlClient*> clients;
+
+	int accepted, rejected, overflowed;
+
+	void Watch(ControlClient *client, bool writable);
+	void Drop(ControlClient *client, int bytes);
+};
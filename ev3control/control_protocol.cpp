@@ -21,7 +21,7 @@
 #include "control_protocol.h"
 
 #include <endian.h> //htobe16, htobe32, htobe64, be16toh, be32toh, be64toh
-#include <string.h> //strlen
+#include <string.h> //memcpy, memset
 
 // header
 const int CONTROL_HEADER_TIMESTAMP_OFFSET=0;
@@ -30,7 +30,6 @@ const int CONTROL_HEADER_COMMAND_OFFSET=9;
 const int CONTROL_HEADER_PAYLOAD_LENGTH_OFFSET=10;
 
 //attributes
-const int CONTROL_ATTRIBUTE_HEADER_BYTES=2;
 const int CONTROL_ATTRIBUTE_OFFSET=0;
 const int CONTROL_ATTRIBUTE_LENGTH_OFFSET=1;
 const int CONTROL_ATTRIBUTE_DATA_OFFSET=2;
@@ -68,53 +67,22 @@ int GetControlAttribute(const char *payload, control_attribute *attribute)
 	return attribute->length+CONTROL_ATTRIBUTE_HEADER_BYTES;
 }
 
-bool ParseControlMessage(const control_header &header, const char *message_payload, control_attribute attributes[], int attributes_length,const ControlAttributes expected_attributes[])
+bool NextControlAttribute(const char **payload, const char *message_boundrary, control_attribute *attribute)
 {
-	char *payload=(char*)message_payload;
-	const char *message_boundrary=payload+header.payload_length;
+	//check if attribute header fits message
+	if(*payload + CONTROL_ATTRIBUTE_HEADER_BYTES > message_boundrary)
+		return false;
 	
-	for(int i=0;i< attributes_length;++i)
-	{
-		//check if attribute header fits message
-		if(payload + CONTROL_ATTRIBUTE_HEADER_BYTES > message_boundrary)
-			return false;
-		
-		payload += GetControlAttribute(payload, attributes +i);
-		
-		const control_attribute &a=attributes[i];
-		
-		//check if attribute is as expected
-		if(a.attribute != expected_attributes[i])
-			return false;
-		
-		//check if attribute data fits message
-		if(a.data + a.length > message_boundrary)
-			return false;
-		
-		//check if attribute has data
-		if(a.length == 0)
-			return false;
-		
-		//if attribute is known
-		if(a.attribute >= CONTROL_ATTRIBUTES_FIRST && a.attribute <= CONTROL_ATTRIBUTES_LAST)
-		{
-			//check if attribute size matches known sizes
-			if(CONTROL_ATTRIBUTES_LENGTHS[a.attribute] && a.length != CONTROL_ATTRIBUTES_LENGTHS[a.attribute])
-				return false;
-			
-			//check if zero terminated attribute is terminated
-			if(CONTROL_ATTRIBUTES_ZERO_TERMINATED[a.attribute] && a.data[a.length-1]!='\0')
-				return false;
-		}
-	}
+	*payload += GetControlAttribute(*payload, attribute);
 	
-	return true;
+	//check if attribute data fits message
+	if(attribute->data + attribute->length > message_boundrary)
+		return false;
+	
+	//check if attribute has data
+	return attribute->length != 0;
 }
 
-const char *GetControlAttributeString(const control_attribute &attribute)
-{
-	return attribute.data;
-}
 uint16_t GetControlAttributeU16(const control_attribute &attribute)
 {
 	uint16_t value;
@@ -169,20 +137,32 @@ int PutControlAttribute(char *buffer, int buffer_length, uint8_t attribute, int
 	return CONTROL_HEADER_BYTES + payload_length + CONTROL_ATTRIBUTE_DATA_OFFSET;
 }
 
-bool PutControlAttributeString(char *buffer, int buffer_length, uint8_t attribute, const char *data)
+bool PutControlAttributeBytes(char *buffer, int buffer_length, uint8_t attribute, const char *data, int length)
 {
-	int len= strlen(data) + 1;
-	
-	int attribute_data_offset=PutControlAttribute(buffer, buffer_length, attribute, len);
+	int attribute_data_offset=PutControlAttribute(buffer, buffer_length, attribute, length);
 	
 	if(attribute_data_offset==-1)
 		return false;
 		
-	memcpy(buffer + attribute_data_offset, data, len);
+	memcpy(buffer + attribute_data_offset, data, length);
 		
 	return true;
 }
 
+bool PutControlAttributeU16(char *buffer, int buffer_length, uint8_t attribute, uint16_t data)
+{
+	int len = sizeof(uint16_t);
+
+	int attribute_data_offset=PutControlAttribute(buffer, buffer_length, attribute, len);
+	
+	if(attribute_data_offset==-1)
+		return false;
+	data = htobe16(data);
+	memcpy(buffer + attribute_data_offset, &data, 2);
+	
+	return true;
+}
+
 bool PutControlAttributeI32(char *buffer, int buffer_length, uint8_t attribute, int32_t data)
 {
 	int len = sizeof(int32_t);
@@ -197,7 +177,7 @@ bool PutControlAttributeI32(char *buffer, int buffer_length, uint8_t attribute,
 	return true;
 }
 
-int GetControlMessageLength(char *buffer)
+int GetControlMessageLength(const char *buffer)
 {
 	return CONTROL_HEADER_BYTES + GetControlHeaderPayloadLength(buffer);
 }
\ No newline at end of file
@@ -27,7 +27,7 @@ const int CONTROL_PROTOCOL_VERSION=1;
 const int CONTROL_BUFFER_BYTES=512;
 const int CONTROL_MAX_ATTRIBUTE_DATA_LENGTH=255; //uint8_t attribute length
 
-enum ControlCommands {KEEPALIVE=0, ENABLE=1, DISABLE=2, DISABLE_ALL=3, ENABLED=-1, DISABLED=-2, FAILED=-3 };
+enum ControlCommands {KEEPALIVE=0, ENABLE=1, DISABLE=2, DISABLE_ALL=3, ENABLE_MANY=4, ENABLED=-1, DISABLED=-2, FAILED=-3 };
 
 // header
 const int CONTROL_HEADER_BYTES=12;
@@ -46,9 +46,25 @@ void GetControlHeader(const char *msg, control_header *header);
 
 // attributes
 
-enum ControlAttributes {CONTROL_ATTRIBUTES_FIRST=0, UNIQUE_NAME=0, CALL=1, CREATION_DELAY_MS=2, RETURN_VALUE=3, CONTROL_ATTRIBUTES_LAST=3};
-const int CONTROL_ATTRIBUTES_LENGTHS[] = {0, 0, sizeof(uint16_t), sizeof(int32_t)};
-const bool CONTROL_ATTRIBUTES_ZERO_TERMINATED[] = {true, true, false, false};
+/*
+ * The attributes of each command are declared once in control_schema.h
+ * which also parses and encodes the messages.
+ *
+ * KEEPALIVE sent by ev3control carries the resource usage of enabled modules,
+ * for each module UNIQUE_NAME followed by CPU_PERMILLE ... PAGE_FAULTS (see module_usage.h).
+ * The modules that don't fit the message are skipped.
+ *
+ * ENABLE may be followed by optional SCHED_POLICY ... CPU_QUOTA_PERMILLE
+ * (see module_scheduling.h), the defaults are used for the missing ones.
+ *
+ * ENABLE_MANY carries several modules, each like ENABLE with optional DEPENDS_ON
+ * (space separated module names). ENABLED or FAILED is sent for each module as it happens.
+ */
+enum ControlAttributes {CONTROL_ATTRIBUTES_FIRST=0, UNIQUE_NAME=0, CALL=1, CREATION_DELAY_MS=2, RETURN_VALUE=3,
+	CPU_PERMILLE=4, CPU_TIME_MS=5, RSS_KB=6, VOLUNTARY_SWITCHES=7, INVOLUNTARY_SWITCHES=8, PAGE_FAULTS=9,
+	SCHED_POLICY=10, RT_PRIORITY=11, NICE=12, CPU_AFFINITY=13, CPU_QUOTA_PERMILLE=14, DEPENDS_ON=15, CONTROL_ATTRIBUTES_LAST=15};
+
+const int CONTROL_ATTRIBUTE_HEADER_BYTES=2;
 
 struct control_attribute
 {
@@ -57,11 +73,11 @@ struct control_attribute
 	const char *data;
 };
 
-bool ParseControlMessage(const control_header &header, const char *payload, control_attribute attributes[], int attributes_length,const ControlAttributes expected_attributes[]);
+// reads the attribute at *payload and advances it, false if it doesn't fit the message or has no data
+bool NextControlAttribute(const char **payload, const char *message_boundrary, control_attribute *attribute);
 
 // attributes data
 
-const char *GetControlAttributeString(const control_attribute &attribute);
 uint16_t GetControlAttributeU16(const control_attribute &attribute);
 int32_t GetControlAttributeI32(const control_attribute &attribute);
 
@@ -71,7 +87,11 @@ bool PutControlHeader(char *buffer, int buffer_length, uint64_t timestamp_us, in
 
 //prerequisities:
 // - PutControlHeader called with buffer argument
-bool PutControlAttributeString(char *buffer, int buffer_length, uint8_t attribute, const char *data);
+bool PutControlAttributeBytes(char *buffer, int buffer_length, uint8_t attribute, const char *data, int length);
+
+//prerequisities:
+// - PutControlHeader called with buffer argument
+bool PutControlAttributeU16(char *buffer, int buffer_length, uint8_t attribute, uint16_t data);
 
 //prerequisities:
 // - PutControlHeader called with buffer argument
@@ -80,4 +100,4 @@ bool PutControlAttributeI32(char *buffer, int buffer_length, uint8_t attribute,
 //prerequisities:
 // - PutControlHeader called with buffer argument
 // - optionally PutControlAttributeXY any number of times
-int GetControlMessageLength(char *buffer);
\ No newline at end of file
+int GetControlMessageLength(const char *buffer);
@@ -0,0 +1,340 @@
+/*
+ * ev3dev-mapping ev3control control protocol schema header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Each command declares its attributes once, as ControlSchema of the message struct fields.
+ * The schema parses (ParseControlMessage) and encodes (EncodeControlMessage) the messages:
+ * -attribute lengths follow from the field types
+ * -required attributes have to be present, optional ones may be (present bitmask)
+ * -unknown or repeated attributes make the message invalid
+ * -strings are control_string views into the parsed buffer (zero terminated there)
+ * -messages with repeated groups (ENABLE_MANY) are parsed with ParseGroup
+ *
+ * Nothing is allocated, the schemas are checked at compile time
+ * (attribute ranges, repeated attributes, number of fields).
+ */
+
+#pragma once
+
+#include "control_protocol.h"
+
+#include <string.h> //strlen
+
+// attribute value types
+
+// valid as long as the buffer it points to
+struct control_string
+{
+	const char *data; //zero terminated
+	int length; //with terminating zero
+};
+
+inline control_string ControlString(const char *data)
+{
+	control_string s={data, (int)strlen(data)+1};
+	return s;
+}
+
+template<typename T> struct ControlType;
+
+template<> struct ControlType<control_string>
+{
+	static const int LENGTH=0; //variable
+	static bool Valid(const control_attribute &a) { return a.data[a.length-1] == '\0'; }
+	static control_string Get(const control_attribute &a) { control_string s={a.data, a.length}; return s; }
+	static int Length(const control_string &value) { return value.length; }
+	static bool Put(char *buffer, int buffer_length, uint8_t attribute, const control_string &value)
+	{ return PutControlAttributeBytes(buffer, buffer_length, attribute, value.data, value.length); }
+};
+
+template<> struct ControlType<uint16_t>
+{
+	static const int LENGTH=sizeof(uint16_t);
+	static bool Valid(const control_attribute &a) { return true; }
+	static uint16_t Get(const control_attribute &a) { return GetControlAttributeU16(a); }
+	static int Length(uint16_t value) { return LENGTH; }
+	static bool Put(char *buffer, int buffer_length, uint8_t attribute, uint16_t value)
+	{ return PutControlAttributeU16(buffer, buffer_length, attribute, value); }
+};
+
+template<> struct ControlType<int32_t>
+{
+	static const int LENGTH=sizeof(int32_t);
+	static bool Valid(const control_attribute &a) { return true; }
+	static int32_t Get(const control_attribute &a) { return GetControlAttributeI32(a); }
+	static int Length(int32_t value) { return LENGTH; }
+	static bool Put(char *buffer, int buffer_length, uint8_t attribute, int32_t value)
+	{ return PutControlAttributeI32(buffer, buffer_length, attribute, value); }
+};
+
+// schema fields, use CONTROL_REQUIRED and CONTROL_OPTIONAL
+
+template<typename M, ControlAttributes A, typename T, T M::*Member, bool Required>
+struct ControlField
+{
+	static_assert(A >= CONTROL_ATTRIBUTES_FIRST && A <= CONTROL_ATTRIBUTES_LAST, "unknown control attribute");
+
+	typedef T type;
+	static const int ATTRIBUTE=A;
+	static const bool REQUIRED=Required;
+
+	static T &Value(M *msg) { return msg->*Member; }
+	static const T &Value(const M &msg) { return msg.*Member; }
+};
+
+#define CONTROL_REQUIRED(message, attribute, member) ControlField<message, attribute, decltype(message::member), &message::member, true>
+#define CONTROL_OPTIONAL(message, attribute, member) ControlField<message, attribute, decltype(message::member), &message::member, false>
+
+// the field list, index is the field position (bit in present bitmask)
+
+template<typename M, typename... Fields> struct ControlFields;
+
+template<typename M> struct ControlFields<M>
+{
+	static constexpr bool Contains(int attribute) { return false; }
+	static constexpr bool Unique() { return true; }
+	static constexpr uint32_t Required(int index) { return 0; }
+	static constexpr int Index(int attribute, int index) { return -1; }
+
+	static bool Get(int index, const control_attribute &a, M *msg) { return false; }
+	static int Length(const M &msg, uint32_t present, int index) { return 0; }
+	static bool Put(char *buffer, int buffer_length, const M &msg, uint32_t present, int index) { return true; }
+};
+
+template<typename M, typename F, typename... Rest> struct ControlFields<M, F, Rest...>
+{
+	typedef ControlFields<M, Rest...> Next;
+	typedef ControlType<typename F::type> Type;
+
+	static constexpr bool Contains(int attribute) { return F::ATTRIBUTE == attribute || Next::Contains(attribute); }
+	static constexpr bool Unique() { return !Next::Contains(F::ATTRIBUTE) && Next::Unique(); }
+	static constexpr uint32_t Required(int index) { return (F::REQUIRED ? 1U << index : 0) | Next::Required(index+1); }
+	static constexpr int Index(int attribute, int index) { return F::ATTRIBUTE == attribute ? index : Next::Index(attribute, index+1); }
+
+	static bool Get(int index, const control_attribute &a, M *msg)
+	{
+		if(index)
+			return Next::Get(index-1, a, msg);
+
+		if( (Type::LENGTH && a.length != Type::LENGTH) || !Type::Valid(a) )
+			return false;
+
+		F::Value(msg)=Type::Get(a);
+		return true;
+	}
+
+	static int Length(const M &msg, uint32_t present, int index)
+	{
+		int length = present & (1U << index) ? CONTROL_ATTRIBUTE_HEADER_BYTES + Type::Length(F::Value(msg)) : 0;
+		return length + Next::Length(msg, present, index+1);
+	}
+
+	static bool Put(char *buffer, int buffer_length, const M &msg, uint32_t present, int index)
+	{
+		if( (present & (1U << index)) && !Type::Put(buffer, buffer_length, F::ATTRIBUTE, F::Value(msg)) )
+			return false;
+		return Next::Put(buffer, buffer_length, msg, present, index+1);
+	}
+};
+
+template<typename M, typename... Fields>
+struct ControlSchema
+{
+	typedef M message;
+	typedef ControlFields<M, Fields...> List;
+
+	static const int FIELDS=sizeof...(Fields);
+	static const uint32_t ALL = FIELDS == 32 ? 0xFFFFFFFF : (1U << FIELDS) - 1;
+
+	static_assert(sizeof...(Fields) <= 32, "control schema with more than 32 fields");
+	static_assert(List::Unique(), "control schema with repeated attribute");
+
+	// the bit of attribute in present bitmask, compile error in constant expression if not in schema
+	static constexpr uint32_t Bit(ControlAttributes attribute) { return 1U << List::Index(attribute, 0); }
+
+	// parses the attributes, the strings point into payload, false if invalid
+	static bool Parse(const control_header &header, const char *payload, M *msg, uint32_t *present=NULL)
+	{
+		const char *message_boundrary=payload+header.payload_length;
+		return ParseGroup(&payload, message_boundrary, msg, present) && payload == message_boundrary;
+	}
+
+	// parses one of the repeated groups (starting with the first schema attribute) and advances payload
+	// to the next group or message_boundrary, false if invalid
+	static bool ParseGroup(const char **payload, const char *message_boundrary, M *msg, uint32_t *present=NULL)
+	{
+		const char *next=*payload;
+		control_attribute a;
+		uint32_t seen=0;
+		int index;
+
+		while(next < message_boundrary)
+		{
+			if( !NextControlAttribute(&next, message_boundrary, &a) )
+				return false;
+
+			index=List::Index(a.attribute, 0);
+
+			//the next group
+			if(index == 0 && seen)
+				break;
+
+			//unknown for this command or repeated
+			if( index == -1 || (seen & (1U << index)) )
+				return false;
+
+			if( !List::Get(index, a, msg) )
+				return false;
+
+			seen |= 1U << index;
+			*payload=next;
+		}
+
+		if( (seen & List::Required(0)) != List::Required(0) )
+			return false;
+
+		if(present)
+			*present=seen;
+		return true;
+	}
+
+	// the attributes length, only optional attributes in present are counted
+	static int Length(const M &msg, uint32_t present=ALL)
+	{
+		return List::Length(msg, present | List::Required(0), 0);
+	}
+
+	// appends the attributes to the message (PutControlHeader called), false if they don't fit
+	// nothing is appended then
+	static bool Put(char *buffer, int buffer_length, const M &msg, uint32_t present=ALL)
+	{
+		if( GetControlMessageLength(buffer) + Length(msg, present) > buffer_length )
+			return false;
+		return List::Put(buffer, buffer_length, msg, present | List::Required(0), 0);
+	}
+};
+
+// messages
+
+struct control_empty {};
+typedef ControlSchema<control_empty> ControlEmptySchema;
+
+struct control_module
+{
+	control_string unique_name;
+};
+typedef ControlSchema<control_module,
+	CONTROL_REQUIRED(control_module, UNIQUE_NAME, unique_name)> ControlModuleSchema;
+
+struct control_enable
+{
+	control_string unique_name;
+	control_string call;
+	uint16_t creation_delay_ms;
+	uint16_t sched_policy;
+	uint16_t rt_priority;
+	int32_t nice;
+	int32_t cpu_affinity;
+	uint16_t cpu_quota_permille;
+};
+typedef ControlSchema<control_enable,
+	CONTROL_REQUIRED(control_enable, UNIQUE_NAME, unique_name),
+	CONTROL_REQUIRED(control_enable, CALL, call),
+	CONTROL_REQUIRED(control_enable, CREATION_DELAY_MS, creation_delay_ms),
+	CONTROL_OPTIONAL(control_enable, SCHED_POLICY, sched_policy),
+	CONTROL_OPTIONAL(control_enable, RT_PRIORITY, rt_priority),
+	CONTROL_OPTIONAL(control_enable, NICE, nice),
+	CONTROL_OPTIONAL(control_enable, CPU_AFFINITY, cpu_affinity),
+	CONTROL_OPTIONAL(control_enable, CPU_QUOTA_PERMILLE, cpu_quota_permille)> ControlEnableSchema;
+
+// repeated in ENABLE_MANY, depends_on is space separated list of module names
+struct control_enable_many
+{
+	control_string unique_name;
+	control_string call;
+	uint16_t creation_delay_ms;
+	uint16_t sched_policy;
+	uint16_t rt_priority;
+	int32_t nice;
+	int32_t cpu_affinity;
+	uint16_t cpu_quota_permille;
+	control_string depends_on;
+};
+typedef ControlSchema<control_enable_many,
+	CONTROL_REQUIRED(control_enable_many, UNIQUE_NAME, unique_name),
+	CONTROL_REQUIRED(control_enable_many, CALL, call),
+	CONTROL_REQUIRED(control_enable_many, CREATION_DELAY_MS, creation_delay_ms),
+	CONTROL_OPTIONAL(control_enable_many, SCHED_POLICY, sched_policy),
+	CONTROL_OPTIONAL(control_enable_many, RT_PRIORITY, rt_priority),
+	CONTROL_OPTIONAL(control_enable_many, NICE, nice),
+	CONTROL_OPTIONAL(control_enable_many, CPU_AFFINITY, cpu_affinity),
+	CONTROL_OPTIONAL(control_enable_many, CPU_QUOTA_PERMILLE, cpu_quota_permille),
+	CONTROL_OPTIONAL(control_enable_many, DEPENDS_ON, depends_on)> ControlEnableManySchema;
+
+struct control_failed
+{
+	control_string unique_name;
+	int32_t return_value;
+};
+typedef ControlSchema<control_failed,
+	CONTROL_REQUIRED(control_failed, UNIQUE_NAME, unique_name),
+	CONTROL_REQUIRED(control_failed, RETURN_VALUE, return_value)> ControlFailedSchema;
+
+// repeated in KEEPALIVE sent by ev3control
+struct control_module_usage
+{
+	control_string unique_name;
+	uint16_t cpu_permille;
+	int32_t cpu_time_ms;
+	int32_t rss_kb;
+	int32_t voluntary_switches;
+	int32_t involuntary_switches;
+	int32_t page_faults;
+};
+typedef ControlSchema<control_module_usage,
+	CONTROL_REQUIRED(control_module_usage, UNIQUE_NAME, unique_name),
+	CONTROL_REQUIRED(control_module_usage, CPU_PERMILLE, cpu_permille),
+	CONTROL_REQUIRED(control_module_usage, CPU_TIME_MS, cpu_time_ms),
+	CONTROL_REQUIRED(control_module_usage, RSS_KB, rss_kb),
+	CONTROL_REQUIRED(control_module_usage, VOLUNTARY_SWITCHES, voluntary_switches),
+	CONTROL_REQUIRED(control_module_usage, INVOLUNTARY_SWITCHES, involuntary_switches),
+	CONTROL_REQUIRED(control_module_usage, PAGE_FAULTS, page_faults)> ControlModuleUsageSchema;
+
+// the schema of each command
+
+template<int Command> struct ControlCommandSchema;
+template<> struct ControlCommandSchema<KEEPALIVE> { typedef ControlEmptySchema type; };
+template<> struct ControlCommandSchema<ENABLE> { typedef ControlEnableSchema type; };
+template<> struct ControlCommandSchema<DISABLE> { typedef ControlModuleSchema type; };
+template<> struct ControlCommandSchema<DISABLE_ALL> { typedef ControlEmptySchema type; };
+template<> struct ControlCommandSchema<ENABLE_MANY> { typedef ControlEnableManySchema type; }; //one group
+template<> struct ControlCommandSchema<ENABLED> { typedef ControlModuleSchema type; };
+template<> struct ControlCommandSchema<DISABLED> { typedef ControlModuleSchema type; };
+template<> struct ControlCommandSchema<FAILED> { typedef ControlFailedSchema type; };
+
+// parses the message payload of the command, see ControlSchema::Parse
+template<int Command>
+bool ParseControlMessage(const control_header &header, const char *payload, typename ControlCommandSchema<Command>::type::message *msg, uint32_t *present=NULL)
+{
+	return ControlCommandSchema<Command>::type::Parse(header, payload, msg, present);
+}
+
+// encodes the whole message of the command, returns its length or -1 if it doesn't fit
+template<int Command>
+int EncodeControlMessage(char *buffer, int buffer_length, uint64_t timestamp_us, const typename ControlCommandSchema<Command>::type::message &msg, uint32_t present=ControlCommandSchema<Command>::type::ALL)
+{
+	if( !PutControlHeader(buffer, buffer_length, timestamp_us, Command) || !ControlCommandSchema<Command>::type::Put(buffer, buffer_length, msg, present) )
+		return -1;
+	return GetControlMessageLength(buffer);
+}
@@ -16,12 +16,12 @@
   * This program was created for EV3 with ev3dev OS
   *  
   * ev3control:
-  * -starts TCP/IP server and waits for client
+  * -starts TCP/IP server and serves several clients at once (e.g. UI, recorder, monitoring tool)
   * -reads messages
   * -starts modules on request
   * -disables modules on request (by closing their stdin so that they get EOF on read)
   * -monitors modules state
-  * -informs peer on module state changes
+  * -informs all the peers on module state changes
   *
   * See Usage() function for syntax details (or run the program without arguments)
   * 
@@ -33,22 +33,28 @@
   */
 
 #include "control.h"
+#include "control_clients.h"
 #include "control_protocol.h"
+#include "control_schema.h"
 #include "net_tcp.h"
+#include "zygote.h"
 
 #include "shared/misc.h"
 
-#include <sys/socket.h> //send
+#include <sys/epoll.h> //epoll_create1, epoll_ctl, epoll_wait
+#include <sys/timerfd.h> //timerfd_create, timerfd_settime
 
-#include <unistd.h> //read
+#include <unistd.h> //read, close
 #include <signal.h> //sigaction, sig_atomic_t
 #include <stdio.h> //printf, etc
 #include <errno.h> // errno
 #include <stdlib.h> //EXIT_FAILURE
+#include <string.h> //memset
 
 
 #include <list> //list
 #include <string> //string
+#include <vector> //vector
 
 using namespace std;
 
@@ -56,49 +62,70 @@ using namespace std;
 volatile sig_atomic_t g_finish_program=0;
 
 void ServerLoop(int serv_socket, int timeout_ms, Control *control);
-void MainClientLoop(int client_socket, Control *control);
 
-bool ReceiveMessage(int client_socket, Control *control);
-bool ProcessMessage(int client_socket, const char *msg, char *response, Control *control);
+void ReceiveMessages(ControlClients *clients, ControlClient *client, Control *control);
+void ProcessMessage(ControlClients *clients, ControlClient *client, const char *msg, char *response, Control *control);
 void CheckProtocolVersion(const control_header &header);
 bool CheckCommandSupport(const control_header &header);
 
-bool ProcessMessageKEEPALIVE(int client_socket, const char *payload, const control_header &header, char *response, Control *control);
-bool ProcessMessageENABLE(int client_socket, const char *payload, const control_header &header, char *response, Control *control);
-bool ProcessMessageDISABLE(int client_socket, const char *payload, const control_header &header, char *response, Control *control);
-bool ProcessMessageDISABLE_ALL(int client_socket, const char *payload, const control_header &header, char *response, Control *control);
+void ProcessMessageKEEPALIVE(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control);
+void ProcessMessageENABLE(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control);
+void ProcessMessageDISABLE(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control);
+void ProcessMessageDISABLE_ALL(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control);
+void ProcessMessageENABLE_MANY(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control);
 
-bool CheckModulesStates(int client_socket, char *response, Control *control);
+bool ModuleHasToStart(ControlClients *clients, ControlClient *client, const std::string &unique_name, char *response, Control *control);
+template<typename Schema> bool GetModuleScheduling(const typename Schema::message &msg, uint32_t present, ModuleScheduling *scheduling);
+vector<string> SplitModuleNames(const char *names);
+void BroadcastModuleEvents(ControlClients *clients, char *response, Control *control);
+void PrintModuleEvent(const ModuleEvent &event);
 
-bool SendMessage(int sock, char *msg, int msg_len);
+int InitTimer();
+void ArmTimer(int timer_fd, int period_ms);
+void InitEpoll(int *epoll_fd, const int *fds, int fds_count);
 
-int EncodeModuleMessage(char *buffer, int buffer_length, ControlCommands command, const std::string &module_name);
+template<int Command> int EncodeModuleMessage(char *buffer, int buffer_length, const std::string &module_name);
 int EncodeFailedMessage(char *buffer, int buffer_length, const std::string &module_name, int32_t status);
-int EncodeKeepaliveMessage(char *buffer, int buffer_length);
+int EncodeKeepaliveMessage(char *buffer, int buffer_length, Control *control);
+bool PutModuleUsage(char *buffer, int buffer_length, const std::string &module_name, const ModuleUsage &usage);
 
 void Usage();
-void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms);
+void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms, bool *use_zygote, vector<string> *preload);
 void Finish(int signal);
 void IgnoreSIGPIPE();
 
 int main(int argc, char **argv)
 {			
 	int serv_socket, port, timeout_ms;
-	Control control;
+	uint64_t stop_us;
+	bool use_zygote;
+	vector<string> preload;
+	Zygote zygote;
 	
-	ProcessArguments(argc, argv, &port, &timeout_ms);
+	ProcessArguments(argc, argv, &port, &timeout_ms, &use_zygote, &preload);
+
+	//the zygote is forked before anything else so that it doesn't inherit ev3control state
+	if(use_zygote)
+		zygote.Start(preload);
+
+	Control control(use_zygote ? &zygote : NULL);
 	
 	//init
 	RegisterSignals(Finish);
 	IgnoreSIGPIPE();
-	InitNetworkTCP(&serv_socket, port);
+	InitNetworkTCP(&serv_socket, port, CONTROL_MAX_CLIENTS);
 
 	
 	//work
 	ServerLoop(serv_socket, timeout_ms, &control);
 	
 	//cleanup
-	control.DisableModules();
+	stop_us=TimestampUs();
+	list<ModuleEvent> events=control.DisableModulesWait();
+	for(list<ModuleEvent>::iterator it=events.begin();it!=events.end();++it)
+		PrintModuleEvent(*it);
+	printf("ev3control: modules stopped in %llu ms\n", (unsigned long long)(TimestampUs()-stop_us)/1000);
+
 	CloseNetworkTCP(serv_socket);
 		
 	printf("ev3control: bye\n");	
@@ -107,92 +134,101 @@ int main(int argc, char **argv)
 
 void ServerLoop(int serv_socket, int timeout_ms, Control *control)
 {
-	int client_socket;
-	
-	while(!g_finish_program)
-	{
-		if( WaitForClientTCP(serv_socket, timeout_ms, &client_socket) == 0) //timeout
-			continue; //check g_finish_program
-		
-		printf("ev3control: client connected\n");
-		MainClientLoop(client_socket, control);
-		printf("ev3control: client disconnected\n");
-		
-		CloseNetworkTCP(client_socket);
-	}
-	
-}
+	static char response[CONTROL_BUFFER_BYTES];
+	const int MAX_EVENTS=CONTROL_MAX_CLIENTS+3;
+	struct epoll_event events[MAX_EVENTS];
+	int epoll_fd, keepalive_fd, n;
+	uint64_t expirations;
+
+	keepalive_fd=InitTimer();
+
+	int fds[]={serv_socket, keepalive_fd, control->EventFd()};
+	InitEpoll(&epoll_fd, fds, sizeof(fds)/sizeof(fds[0]));
+	ArmTimer(keepalive_fd, timeout_ms);
+
+	ControlClients clients(epoll_fd);
 
-void MainClientLoop(int client_socket, Control *control)
-{
 	while(!g_finish_program)
 	{
-		if(!ReceiveMessage(client_socket, control))
-			break;
-	}
-}
+		if( (n=epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) == -1 )
+		{
+			if(errno == EINTR)
+				continue; //check g_finish_program
+			DieErrno("ev3control: epoll_wait failed");
+		}
 
-// false on disconnect, true otherwise 
-bool ReceiveMessage(int client_socket, Control *control)
-{
-	static char buffer[CONTROL_BUFFER_BYTES];	
-	static char response_buffer[CONTROL_BUFFER_BYTES];		
-	
-	char *data=buffer;
-	
-	int received=0, bytes=CONTROL_HEADER_BYTES, result;
-	
-	while(received<bytes)
-	{
-		if( (result=read(client_socket, data+received, bytes-received)) == -1)
+		for(int i=0;i<n;++i)
 		{
-			if(errno==EAGAIN || errno==EWOULDBLOCK) //timeout
-			{
-				if( !CheckModulesStates(client_socket, response_buffer, control))
-				{
-					printf("Check modules failed\n");
-					return false;
-				}
-				continue;
-			}
-			else //maybe handle EINTR separately
+			int fd=events[i].data.fd;
+
+			if(fd == serv_socket)
+				clients.Accept(serv_socket);
+			else if(fd == keepalive_fd)
 			{
-				perror("ev3control: read\n");
-				return false; //connection closed
+				if( read(keepalive_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+					DieErrno("ev3control: timerfd read failed");
+
+				control->SampleModules();
+
+				//keepalive for the clients that were silent for the whole period
+				int response_length=EncodeKeepaliveMessage(response, CONTROL_BUFFER_BYTES, control);
+				clients.SendIdle(response, response_length, (uint64_t)timeout_ms*1000);
 			}
-		}
-		else if(result == 0)
-			return false;
-			
-		received += result;
-		
-		if(data == buffer && received==CONTROL_HEADER_BYTES)
-		{ //we have received complete header, now get payload
-			data=buffer+CONTROL_HEADER_BYTES;
-			bytes = GetControlHeaderPayloadLength(buffer);
-			received=0;
-			if(bytes > CONTROL_BUFFER_BYTES-CONTROL_HEADER_BYTES)
+			else if(fd == control->EventFd())
+				BroadcastModuleEvents(&clients, response, control);
+			else
 			{
-				fprintf(stderr, "ev3control: ignoring message, doesn't fit buffer: payload %d, buffer is %d\n", bytes, CONTROL_BUFFER_BYTES-CONTROL_HEADER_BYTES);
-				return true;
+				ControlClient *client=clients.Find(fd);
+
+				if(client == NULL || client->closing)
+					continue;
+				if(events[i].events & EPOLLOUT)
+					clients.Flush(client);
+				if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					ReceiveMessages(&clients, client, control);
 			}
 		}
-	}		
-	return ProcessMessage(client_socket, buffer, response_buffer, control);
+
+		clients.Sweep();
+	}
+
+	clients.Print();
+
+	close(keepalive_fd);
+	close(epoll_fd);
+}
+
+// reads the available data and processes all the complete messages
+void ReceiveMessages(ControlClients *clients, ControlClient *client, Control *control)
+{
+	static char response[CONTROL_BUFFER_BYTES];
+	const char *msg;
+
+	if(!clients->Read(client))
+	{
+		clients->Close(client);
+		return;
+	}
+
+	while( !client->closing && (msg=clients->NextMessage(client)) != NULL )
+	{
+		ProcessMessage(clients, client, msg, response, control);
+		clients->Consume(client);
+	}
 }
 
-bool ProcessMessage(int client_socket, const char *msg, char *response, Control *control)
+void ProcessMessage(ControlClients *clients, ControlClient *client, const char *msg, char *response, Control *control)
 {
-	static bool (*handlers[])(int, const char *, const control_header &,char *,Control *)={ProcessMessageKEEPALIVE, ProcessMessageENABLE, ProcessMessageDISABLE, ProcessMessageDISABLE_ALL};
+	static void (*handlers[])(ControlClients *, ControlClient *, const char *, const control_header &,char *,Control *)={ProcessMessageKEEPALIVE, ProcessMessageENABLE, ProcessMessageDISABLE, ProcessMessageDISABLE_ALL, ProcessMessageENABLE_MANY};
 	static control_header header;
 	
 	GetControlHeader(msg, &header);
 	
 	CheckProtocolVersion(header);
 	if( !CheckCommandSupport(header) )
-		return true;
+		return;
 		
-	return handlers[header.command](client_socket, msg+CONTROL_HEADER_BYTES, header,response, control);
+	handlers[header.command](clients, client, msg+CONTROL_HEADER_BYTES, header,response, control);
 }
 
 
@@ -209,188 +245,419 @@ void CheckProtocolVersion(const control_header &header)
 
 bool CheckCommandSupport(const control_header &header)
 {
-	if(header.command >= KEEPALIVE && header.command <= DISABLE_ALL)
+	if(header.command >= KEEPALIVE && header.command <= ENABLE_MANY)
 		return true;
 	fprintf(stderr, "ev3control: ignoring message with unsupported command %d\n", header.command);
 	return false;
 }
 
 
-bool ProcessMessageKEEPALIVE(int client_socket, const char *payload, const control_header &header, char *response, Control *control)
+// state changes are broadcast, the replies that don't change anything go to the requester only
+
+void ProcessMessageKEEPALIVE(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control)
 {
-	return CheckModulesStates(client_socket, response, control);
+	//module failures are broadcast as soon as they happen, usage is from the last keepalive period
+	int response_length=EncodeKeepaliveMessage(response, CONTROL_BUFFER_BYTES, control);
+	clients->Send(client, response, response_length);
 }
 
-bool ProcessMessageENABLE(int client_socket, const char *payload, const control_header &header, char *response, Control *control)
+void ProcessMessageENABLE(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control)
 {
-	static control_attribute attributes[3];
-	const static ControlAttributes expected[]={UNIQUE_NAME, CALL, CREATION_DELAY_MS};
+	control_enable msg;
+	uint32_t present;
+	ModuleScheduling scheduling;
 	
-	if(!ParseControlMessage(header, payload, attributes, 3, expected))
+	if(!ParseControlMessage<ENABLE>(header, payload, &msg, &present))
 	{
 		fprintf(stderr, "ev3control: ignoring invalid command %d\n", header.command);
-		return true;
+		return;
 	}
 
-	string unique_name(GetControlAttributeString(attributes[0]));
-	string call(GetControlAttributeString(attributes[1]));
-	uint16_t creation_delay_ms = GetControlAttributeU16(attributes[2]);
+	if( !GetModuleScheduling<ControlEnableSchema>(msg, present, &scheduling) )
+	{
+		fprintf(stderr, "ev3control: ignoring enable %s with invalid scheduling\n", msg.unique_name.data);
+		return;
+	}
+
+	string unique_name(msg.unique_name.data);
+	string call(msg.call.data);
+	uint16_t creation_delay_ms = msg.creation_delay_ms;
 	
 	printf("ev3control: request to enable %s\n", unique_name.c_str());
 	
+	if( !ModuleHasToStart(clients, client, unique_name, response, control) )
+		return;
+
+	Module module;
+	if( !control->ContainsModule(unique_name, &module) )
+		control->InsertModule(unique_name, creation_delay_ms);
+	
+	//ENABLED is broadcast when the module signals readiness (BroadcastModuleEvents)
+	control->EnableModule(unique_name, call, scheduling);
+
+	printf("ev3control: starting module: %s (%s)\n", unique_name.c_str(), ModuleSchedulingString(scheduling).c_str());
+}
+
+// false if the module is enabled (reply sent), starting, stopping or queued
+bool ModuleHasToStart(ControlClients *clients, ControlClient *client, const std::string &unique_name, char *response, Control *control)
+{
 	Module module;
 	bool contains_module=control->ContainsModule(unique_name, &module);
+
+	if( control->IsPending(unique_name) )
+	{	//ENABLED or FAILED will be broadcast when its dependencies are
+		fprintf(stderr, "ev3control: request to enable %s but it is waiting for dependencies\n", unique_name.c_str());
+		return false;
+	}
 	
-	if( contains_module && module.state == MODULE_ENABLED && control->CheckModuleState(unique_name) == MODULE_ENABLED )
+	if( contains_module && module.state == MODULE_ENABLED )
 	{
 		fprintf(stderr, "ev3control: request to enable %s but it is enabled\n", unique_name.c_str());
 		
-		int response_length=EncodeModuleMessage(response, CONTROL_BUFFER_BYTES, ENABLED, unique_name);
-		return SendMessage(client_socket, response, response_length);
+		int response_length=EncodeModuleMessage<ENABLED>(response, CONTROL_BUFFER_BYTES, unique_name);
+		clients->Send(client, response, response_length);
+		return false;
 	}
-	
-	if(!contains_module)
-		control->InsertModule(unique_name, creation_delay_ms);
-	
-	control->EnableModule(unique_name, call);
 
-	printf("ev3control: enabled module: %s\n", unique_name.c_str());
-	
-	int response_length=EncodeModuleMessage(response, CONTROL_BUFFER_BYTES, ENABLED, unique_name);
-	
-	return SendMessage(client_socket, response, response_length);
+	if( contains_module && module.state == MODULE_STOPPING )
+	{	//the client may retry after DISABLED is broadcast
+		fprintf(stderr, "ev3control: request to enable %s but it is stopping, ignoring\n", unique_name.c_str());
+		return false;
+	}
+
+	if( contains_module && module.state == MODULE_STARTING )
+	{	//ENABLED will be broadcast when it is ready
+		fprintf(stderr, "ev3control: request to enable %s but it is starting\n", unique_name.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// the defaults for the call overridden by the present optional attributes, false if invalid
+template<typename Schema>
+bool GetModuleScheduling(const typename Schema::message &msg, uint32_t present, ModuleScheduling *scheduling)
+{
+	*scheduling=DefaultModuleScheduling(msg.call.data);
+
+	if(present & Schema::Bit(SCHED_POLICY))
+		scheduling->policy=msg.sched_policy;
+	if(present & Schema::Bit(RT_PRIORITY))
+		scheduling->rt_priority=msg.rt_priority;
+	if(present & Schema::Bit(NICE))
+		scheduling->nice=msg.nice;
+	if(present & Schema::Bit(CPU_AFFINITY))
+		scheduling->cpu_affinity=msg.cpu_affinity;
+	if(present & Schema::Bit(CPU_QUOTA_PERMILLE))
+		scheduling->cpu_quota_permille=msg.cpu_quota_permille;
+
+	return ValidModuleScheduling(*scheduling);
+}
+
+// e.g. "drive odometry" to "drive", "odometry"
+vector<string> SplitModuleNames(const char *names)
+{
+	string all(names);
+	vector<string> result;
+	size_t start=0, end;
+
+	while( (start=all.find_first_not_of(' ', start)) != string::npos )
+	{
+		end=all.find(' ', start);
+		result.push_back(all.substr(start, end-start));
+		start=end;
+	}
+
+	return result;
 }
-bool ProcessMessageDISABLE(int client_socket, const char *payload, const control_header &header, char *response, Control *control)
+
+void ProcessMessageDISABLE(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control)
 {
-	static control_attribute attributes[1];
-	const static ControlAttributes expected[]={UNIQUE_NAME};
+	control_module msg;
 
-	if(!ParseControlMessage(header, payload, attributes, 1, expected))
+	if(!ParseControlMessage<DISABLE>(header, payload, &msg))
 	{
 		fprintf(stderr, "ev3control: ignoring invalid command %d\n", header.command);
-		return true;
+		return;
 	}
 	
-	string unique_name(GetControlAttributeString(attributes[0]));	
+	string unique_name(msg.unique_name.data);
 		
 	printf("ev3control: request to disable %s\n", unique_name.c_str());
 				
 	Module module;
 	bool contains_module=control->ContainsModule(unique_name, &module);
 	
+	if( control->CancelPending(unique_name) )
+	{	//never started, the modules waiting for it fail
+		printf("ev3control: module %s removed from the queue\n", unique_name.c_str());
+
+		//the stopping instance is reported DISABLED when it exits
+		if( contains_module && module.state == MODULE_STOPPING )
+			return;
+
+		int response_length=EncodeModuleMessage<DISABLED>(response, CONTROL_BUFFER_BYTES, unique_name);
+		clients->Broadcast(response, response_length);
+		return;
+	}
+
 	if( !contains_module)
 	{
 		fprintf(stderr, "ev3control: request to disable %s but no such module\n", unique_name.c_str());
-		return true;
+		return;
 	}
 	
-	if(module.state != MODULE_ENABLED)
+	if(module.state == MODULE_STOPPING)
+	{	//DISABLED will be broadcast when it exits
+		fprintf(stderr, "ev3control: request to disable %s but it is stopping\n", unique_name.c_str());
+		return;
+	}
+
+	if(module.state != MODULE_ENABLED && module.state != MODULE_STARTING)
 	{
 		fprintf(stderr, "ev3control: request to disable %s module but is not enabled\n", unique_name.c_str());
 		
 		int response_length;
 		if(module.state==MODULE_DISABLED)
-			response_length=EncodeModuleMessage(response, CONTROL_BUFFER_BYTES, DISABLED, unique_name);
+			response_length=EncodeModuleMessage<DISABLED>(response, CONTROL_BUFFER_BYTES, unique_name);
 		else //if(module.state==MODULE_FAILED)
 			response_length=EncodeFailedMessage(response, CONTROL_BUFFER_BYTES, unique_name, module.return_value);
 		
-		return SendMessage(client_socket, response, response_length);
+		clients->Send(client, response, response_length);
+		return;
 	}
 	
-	if(!control->DisableModule(unique_name))
-	{
-		fprintf(stderr, "ev3control: unable to disable module: %s\n", unique_name.c_str());
-		return true;
-	}
+	//DISABLED is broadcast when the module exits (BroadcastModuleEvents)
+	control->DisableModule(unique_name);
 
-	printf("ev3control: disabled module: %s\n", unique_name.c_str());
-	int response_length=EncodeModuleMessage(response, CONTROL_BUFFER_BYTES, DISABLED, unique_name);
-	return SendMessage(client_socket, response, response_length);
+	printf("ev3control: stopping module: %s\n", unique_name.c_str());
 }
-bool ProcessMessageDISABLE_ALL(int client_socket, const char *payload, const control_header &header, char *response, Control *control)
+void ProcessMessageDISABLE_ALL(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control)
 {
 	printf("ev3control: request to disable all modules\n");
 
-	list<string> disabled=control->DisableModules();
-	
-	for(list<string>::iterator it=disabled.begin();it!=disabled.end();++it)
+	//the queued modules were never started
+	list<string> cancelled=control->CancelPending();
+
+	for(list<string>::iterator it=cancelled.begin();it!=cancelled.end();++it)
 	{
-		printf("ev3control: disabled module: %s\n", it->c_str());
-		int response_length=EncodeModuleMessage(response, CONTROL_BUFFER_BYTES, DISABLED, *it);
-		if(!SendMessage(client_socket, response, response_length))
-			return false;
+		int response_length=EncodeModuleMessage<DISABLED>(response, CONTROL_BUFFER_BYTES, *it);
+		clients->Broadcast(response, response_length);
 	}
-	return true;
+
+	//all at once, DISABLED is broadcast for each module when it exits
+	int stopping=control->DisableModules();
+
+	printf("ev3control: stopping %d modules, %d removed from the queue\n", stopping, (int)cancelled.size());
 }
 
-bool CheckModulesStates(int client_socket, char *response, Control *control)
+void ProcessMessageENABLE_MANY(ControlClients *clients, ControlClient *client, const char *payload, const control_header &header, char *response, Control *control)
 {
-	list<FailedModule> failed=control->CheckModulesStates();
-	
-	for(list<FailedModule>::iterator it=failed.begin();it!=failed.end();++it)
-	{
-		printf("ev3control: %s failed with status %d\n", it->name.c_str(), it->status);
-		int response_length=EncodeFailedMessage(response, CONTROL_BUFFER_BYTES, it->name, it->status);
-		if(!SendMessage(client_socket, response, response_length))
-			return false;
-	}	
-	if(failed.size() == 0)
+	const char *message_boundrary=payload+header.payload_length;
+	list<ModuleRequest> requests;
+	list<ModuleRequest>::iterator it;
+	control_enable_many msg;
+	uint32_t present;
+
+	//all the modules are validated before any is started
+	while(payload < message_boundrary)
 	{
-		int response_length=EncodeKeepaliveMessage(response, CONTROL_BUFFER_BYTES);
-		return SendMessage(client_socket, response, response_length);
+		ModuleRequest request;
+
+		if( !ControlEnableManySchema::ParseGroup(&payload, message_boundrary, &msg, &present) )
+		{
+			fprintf(stderr, "ev3control: ignoring invalid command %d\n", header.command);
+			return;
+		}
+
+		if( !GetModuleScheduling<ControlEnableManySchema>(msg, present, &request.scheduling) )
+		{
+			fprintf(stderr, "ev3control: ignoring enable many with invalid scheduling of %s\n", msg.unique_name.data);
+			return;
+		}
+
+		request.name=msg.unique_name.data;
+		request.call=msg.call.data;
+		request.creation_delay_ms=msg.creation_delay_ms;
+
+		if(present & ControlEnableManySchema::Bit(DEPENDS_ON))
+			request.dependencies=SplitModuleNames(msg.depends_on.data);
+
+		for(it=requests.begin();it!=requests.end();++it)
+			if(it->name == request.name)
+			{
+				fprintf(stderr, "ev3control: ignoring enable many with repeated module %s\n", request.name.c_str());
+				return;
+			}
+
+		requests.push_back(request);
 	}
-	return true;
-}
 
-bool SendMessage(int sock, char *msg, int msg_len)
-{
-	int data_sent=0;
-	int data_written=0;
-	while(data_sent<msg_len)
+	printf("ev3control: request to enable %d modules\n", (int)requests.size());
+
+	//the modules that are already there are served like ENABLE, they still satisfy the dependencies
+	//(the queued ones keep their request, ENABLED or FAILED is broadcast for them as it happens),
+	//unlike ENABLE the stopping modules are queued and started again when they exit
+	for(it=requests.begin();it!=requests.end();)
 	{
-		if( ( data_written=send(sock , msg+data_sent , msg_len-data_sent, 0) ) == -1 )
+		Module module;
+
+		if( !control->IsPending(it->name) && control->ContainsModule(it->name, &module) && module.state == MODULE_STOPPING )
 		{
-			perror("ev3control: socket send failed");
-			return false;
+			printf("ev3control: module %s is stopping, queued until it exits\n", it->name.c_str());
+			++it;
 		}
-		data_sent+=data_written;
+		else if( ModuleHasToStart(clients, client, it->name, response, control) )
+			++it;
+		else
+			it=requests.erase(it);
 	}
-	return true;
+
+	//the independent modules are started right away, the others when their dependencies are enabled
+	//ENABLED or FAILED is broadcast for each module (BroadcastModuleEvents)
+	control->EnableModules(requests);
+}
+
+void BroadcastModuleEvents(ControlClients *clients, char *response, Control *control)
+{
+	list<ModuleEvent> events=control->ProcessEvents();
+	int response_length;
+	
+	for(list<ModuleEvent>::iterator it=events.begin();it!=events.end();++it)
+	{
+		PrintModuleEvent(*it);
+
+		if(it->type == MODULE_EVENT_ENABLED)
+			response_length=EncodeModuleMessage<ENABLED>(response, CONTROL_BUFFER_BYTES, it->name);
+		else if(it->type == MODULE_EVENT_DISABLED)
+			response_length=EncodeModuleMessage<DISABLED>(response, CONTROL_BUFFER_BYTES, it->name);
+		else //MODULE_EVENT_FAILED
+			response_length=EncodeFailedMessage(response, CONTROL_BUFFER_BYTES, it->name, it->status);
+
+		clients->Broadcast(response, response_length);
+	}	
 }
 
-int EncodeModuleMessage(char *buffer, int buffer_length, ControlCommands command, const std::string &module_name)
+void PrintModuleEvent(const ModuleEvent &event)
 {
-	if( !PutControlHeader(buffer, buffer_length, TimestampUs(), command) 
-	|| !PutControlAttributeString(buffer, buffer_length, UNIQUE_NAME, module_name.c_str()) )
+	static const char *STOP_STAGES[]={"stdin EOF or stop request", "SIGINT", "SIGKILL"};
+
+	if(event.type == MODULE_EVENT_ENABLED)
+		printf("ev3control: enabled module: %s (%s after %llu ms, %s RSS %d kB)\n", event.name.c_str(), event.signalled ? "ready" : "timeout",
+		(unsigned long long)event.elapsed_us/1000, event.hosted ? "hosted, ev3control" : "process", event.rss_kb);
+	else if(event.type == MODULE_EVENT_DISABLED)
+		printf("ev3control: disabled module: %s (exited after %llu ms, %s, average CPU %d.%d%%)\n", event.name.c_str(), (unsigned long long)event.elapsed_us/1000,
+		STOP_STAGES[event.stop_stage], event.cpu_permille/10, event.cpu_permille%10);
+	else //MODULE_EVENT_FAILED
+		printf("ev3control: %s failed with status %d (average CPU %d.%d%%)\n", event.name.c_str(), event.status, event.cpu_permille/10, event.cpu_permille%10);
+}
+
+template<int Command>
+int EncodeModuleMessage(char *buffer, int buffer_length, const std::string &module_name)
+{
+	control_module msg={ControlString(module_name.c_str())};
+	int length=EncodeControlMessage<Command>(buffer, buffer_length, TimestampUs(), msg);
+
+	if(length == -1)
 		Die("ev3control: unable to encode module message\n");
 	
-	return GetControlMessageLength(buffer);
+	return length;
 }
 int EncodeFailedMessage(char *buffer, int buffer_length, const std::string &module_name, int32_t status)
 {
-	if(!EncodeModuleMessage(buffer, buffer_length, FAILED, module_name) 
-	|| !PutControlAttributeI32(buffer, buffer_length, RETURN_VALUE, status))
+	control_failed msg={ControlString(module_name.c_str()), status};
+	int length=EncodeControlMessage<FAILED>(buffer, buffer_length, TimestampUs(), msg);
+
+	if(length == -1)
 		Die("ev3control: unable to encode module failed message\n");
 
-	return GetControlMessageLength(buffer);
+	return length;
 }
 
-int EncodeKeepaliveMessage(char *buffer, int buffer_length)
+int EncodeKeepaliveMessage(char *buffer, int buffer_length, Control *control)
 {
-	if( !PutControlHeader(buffer, buffer_length, TimestampUs(), KEEPALIVE) )
+	static bool not_yet_warned=true;
+	const std::map<std::string, Module> &modules=control->Modules();
+	std::map<std::string, Module>::const_iterator it;
+
+	if( EncodeControlMessage<KEEPALIVE>(buffer, buffer_length, TimestampUs(), control_empty()) == -1 )
 		Die("ev3control: unable to encode keepalive message\n");
+
+	for(it=modules.begin();it!=modules.end();++it)
+	{
+		if(it->second.state != MODULE_ENABLED || it->second.usage.first_sample_us == 0)
+			continue;
+
+		if( !PutModuleUsage(buffer, buffer_length, it->first, it->second.usage) )
+		{
+			if(not_yet_warned)
+				fprintf(stderr, "ev3control: module usage doesn't fit keepalive message, skipping some modules\n");
+			not_yet_warned=false;
+			break;
+		}
+	}
+
 	return GetControlMessageLength(buffer);
 }
 
+// puts all the module usage attributes or nothing if they don't fit
+bool PutModuleUsage(char *buffer, int buffer_length, const std::string &module_name, const ModuleUsage &usage)
+{
+	control_module_usage msg={ControlString(module_name.c_str()), (uint16_t)usage.cpu_permille, usage.cpu_time_ms, usage.rss_kb,
+		usage.voluntary_switches, usage.involuntary_switches, usage.page_faults};
+
+	return ControlModuleUsageSchema::Put(buffer, buffer_length, msg);
+}
+
+int InitTimer()
+{
+	int timer_fd;
+	if( (timer_fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1 )
+		DieErrno("ev3control: timerfd_create failed");
+	return timer_fd;
+}
+
+// (re)starts the countdown, after expiry it fires every period_ms
+void ArmTimer(int timer_fd, int period_ms)
+{
+	struct itimerspec its;
+	its.it_value.tv_sec=period_ms / 1000;
+	its.it_value.tv_nsec=(period_ms % 1000) * 1000000L;
+	its.it_interval=its.it_value;
+
+	if( timerfd_settime(timer_fd, 0, &its, NULL) == -1 )
+		DieErrno("ev3control: timerfd_settime failed");
+}
+
+void InitEpoll(int *epoll_fd, const int *fds, int fds_count)
+{
+	struct epoll_event event;
+
+	if( (*epoll_fd=epoll_create1(EPOLL_CLOEXEC)) == -1 )
+		DieErrno("ev3control: epoll_create1 failed");
+
+	for(int i=0;i<fds_count;++i)
+	{
+		memset(&event, 0, sizeof(event));
+		event.events=EPOLLIN;
+		event.data.fd=fds[i];
+		if( epoll_ctl(*epoll_fd, EPOLL_CTL_ADD, fds[i], &event) == -1 )
+			DieErrno("ev3control: epoll_ctl failed");
+	}
+}
+
 void Usage()
 {
-	printf("ev3control tcp_port timeout_ms\n\n");
+	printf("ev3control tcp_port timeout_ms [zygote [module.so]...]\n\n");
+	printf("zygote - fork shared object modules from preforked process instead of hosting them\n");
+	printf("module.so - shared object modules loaded by the zygote at start\n\n");
 	printf("examples:\n");
 	printf("./ev3control 8004 500\n");
+	printf("./ev3control 8004 500 zygote ./ev3sampler.so\n");
 }
-void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms)
+void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms, bool *use_zygote, vector<string> *preload)
 {
-	if(argc!=3)
+	if(argc<3 || (argc>3 && strcmp(argv[3], "zygote") != 0) )
 	{
 		Usage();
 		exit(EXIT_SUCCESS);		
@@ -403,6 +670,11 @@ void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms)
 	
 	temp=strtol(argv[2], NULL, 0);
 	*timeout_ms=temp;
+
+	*use_zygote = argc>3;
+
+	for(int i=4;i<argc;++i)
+		preload->push_back(argv[i]);
 }
 void Finish(int signal)
 {
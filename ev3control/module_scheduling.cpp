@@ -0,0 +1,200 @@
+/*
+ * ev3dev-mapping ev3control module scheduling implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "module_scheduling.h"
+
+#include <sys/resource.h> //setpriority
+#include <sys/stat.h> //mkdir
+#include <sys/syscall.h> //SYS_gettid
+#include <sched.h> //sched_setscheduler, sched_setaffinity
+#include <unistd.h> //syscall, write, close
+#include <fcntl.h> //open
+#include <errno.h> //errno
+#include <stdio.h> //fprintf, snprintf
+#include <string.h> //strerror
+
+using namespace std;
+
+const int DRIVE_RT_PRIORITY=20;
+const int POSE_NICE=-10;
+const int TELEMETRY_NICE=10;
+const int MIN_CPU_QUOTA_PERMILLE=10; //cgroup minimum quota is 1 ms
+
+struct DefaultScheduling
+{
+	const char *program;
+	int policy;
+	int rt_priority;
+	int nice;
+};
+
+const DefaultScheduling DEFAULT_SCHEDULING[]={
+	{"ev3drive", SCHED_FIFO, DRIVE_RT_PRIORITY, 0},
+	{"ev3car-drive", SCHED_FIFO, DRIVE_RT_PRIORITY, 0},
+	{"ev3sampler", SCHED_OTHER, 0, POSE_NICE},
+	{"ev3odometry", SCHED_OTHER, 0, POSE_NICE},
+	{"ev3dead-reconning", SCHED_OTHER, 0, POSE_NICE},
+	{"ev3car-reconning", SCHED_OTHER, 0, POSE_NICE},
+	{"ev3laser", SCHED_OTHER, 0, TELEMETRY_NICE},
+	{"ev3wifi", SCHED_OTHER, 0, TELEMETRY_NICE}
+};
+
+bool RealTimePolicy(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+// e.g. "ev3drive" for "./ev3drive 8003 500" or "../ev3sampler/ev3sampler.so 10 1"
+string ModuleProgram(const string &module_call)
+{
+	string program=module_call.substr(0, module_call.find(' '));
+	size_t slash=program.rfind('/');
+
+	if(slash != string::npos)
+		program.erase(0, slash+1);
+	if(program.size() > 3 && program.compare(program.size()-3, 3, ".so") == 0)
+		program.erase(program.size()-3);
+
+	return program;
+}
+
+ModuleScheduling DefaultModuleScheduling(const std::string &module_call)
+{
+	ModuleScheduling scheduling={SCHED_OTHER, 0, 0, 0, 0};
+	string program=ModuleProgram(module_call);
+
+	for(size_t i=0;i<sizeof(DEFAULT_SCHEDULING)/sizeof(DEFAULT_SCHEDULING[0]);++i)
+		if(program == DEFAULT_SCHEDULING[i].program)
+		{
+			scheduling.policy=DEFAULT_SCHEDULING[i].policy;
+			scheduling.rt_priority=DEFAULT_SCHEDULING[i].rt_priority;
+			scheduling.nice=DEFAULT_SCHEDULING[i].nice;
+		}
+
+	return scheduling;
+}
+
+bool ValidModuleScheduling(const ModuleScheduling &scheduling)
+{
+	if(scheduling.policy != SCHED_OTHER && scheduling.policy != SCHED_BATCH && scheduling.policy != SCHED_IDLE && !RealTimePolicy(scheduling.policy))
+		return false;
+	if( RealTimePolicy(scheduling.policy) && (scheduling.rt_priority < sched_get_priority_min(scheduling.policy) || scheduling.rt_priority > sched_get_priority_max(scheduling.policy)) )
+		return false;
+	if(scheduling.nice < -20 || scheduling.nice > 19)
+		return false;
+	if(scheduling.cpu_quota_permille != 0 && scheduling.cpu_quota_permille < MIN_CPU_QUOTA_PERMILLE)
+		return false;
+	return true;
+}
+
+bool WriteCgroupFile(const string &path, long value)
+{
+	char data[32];
+	int fd, length=snprintf(data, sizeof(data), "%ld", value);
+
+	if( (fd=open(path.c_str(), O_WRONLY | O_CLOEXEC)) == -1 )
+		return false;
+
+	bool ok = write(fd, data, length) == length;
+	close(fd);
+	return ok;
+}
+
+bool JoinCpuQuotaCgroup(const ModuleScheduling &scheduling, const string &module_name, pid_t tid)
+{
+	if(module_name.empty() || module_name.find('/') != string::npos || module_name[0] == '.')
+	{
+		fprintf(stderr, "ev3control: module name %s can't be used as cgroup name\n", module_name.c_str());
+		return false;
+	}
+
+	string group=string(CGROUP_CPU_DIRECTORY) + "/" + module_name;
+
+	if( (mkdir(group.c_str(), 0755) == -1 && errno != EEXIST)
+	|| !WriteCgroupFile(group + "/cpu.cfs_period_us", CGROUP_CPU_PERIOD_US)
+	|| !WriteCgroupFile(group + "/cpu.cfs_quota_us", (long)scheduling.cpu_quota_permille * CGROUP_CPU_PERIOD_US / 1000)
+	|| !WriteCgroupFile(group + "/tasks", tid) )
+	{
+		fprintf(stderr, "ev3control: unable to set CPU quota for %s in %s: %s\n", module_name.c_str(), group.c_str(), strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+bool ApplyModuleScheduling(const ModuleScheduling &scheduling, const std::string &module_name, pid_t tid)
+{
+	const char *name=module_name.c_str();
+	struct sched_param param;
+	bool ok=true;
+
+	//scheduling calls work on threads, for single threaded process that's the process
+	if(tid == 0)
+		tid=syscall(SYS_gettid);
+
+	param.sched_priority = RealTimePolicy(scheduling.policy) ? scheduling.rt_priority : 0;
+
+	if( sched_setscheduler(tid, scheduling.policy, &param) == -1 )
+	{
+		fprintf(stderr, "ev3control: unable to set scheduling policy %d for %s: %s\n", scheduling.policy, name, strerror(errno));
+		ok=false;
+	}
+
+	if( !RealTimePolicy(scheduling.policy) && setpriority(PRIO_PROCESS, tid, scheduling.nice) == -1 )
+	{
+		fprintf(stderr, "ev3control: unable to set nice %d for %s: %s\n", scheduling.nice, name, strerror(errno));
+		ok=false;
+	}
+
+	if(scheduling.cpu_affinity)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+
+		for(int cpu=0;cpu<32;++cpu)
+			if(scheduling.cpu_affinity & (1U << cpu))
+				CPU_SET(cpu, &set);
+
+		if( sched_setaffinity(tid, sizeof(set), &set) == -1 )
+		{
+			fprintf(stderr, "ev3control: unable to set CPU affinity 0x%x for %s: %s\n", scheduling.cpu_affinity, name, strerror(errno));
+			ok=false;
+		}
+	}
+
+	if(scheduling.cpu_quota_permille && !JoinCpuQuotaCgroup(scheduling, module_name, tid))
+		ok=false;
+
+	return ok;
+}
+
+std::string ModuleSchedulingString(const ModuleScheduling &scheduling)
+{
+	static const char *POLICIES[]={"SCHED_OTHER", "SCHED_FIFO", "SCHED_RR", "SCHED_BATCH", "", "SCHED_IDLE"};
+	char text[128];
+	int length;
+
+	if( RealTimePolicy(scheduling.policy) )
+		length=snprintf(text, sizeof(text), "%s %d", POLICIES[scheduling.policy], scheduling.rt_priority);
+	else
+		length=snprintf(text, sizeof(text), "%s nice %d", POLICIES[scheduling.policy], scheduling.nice);
+
+	if(scheduling.cpu_affinity)
+		length+=snprintf(text+length, sizeof(text)-length, ", affinity 0x%x", scheduling.cpu_affinity);
+
+	if(scheduling.cpu_quota_permille)
+		snprintf(text+length, sizeof(text)-length, ", quota %d.%d%%", scheduling.cpu_quota_permille/10, scheduling.cpu_quota_permille%10);
+
+	return text;
+}
@@ -0,0 +1,59 @@
+/*
+ * ev3dev-mapping ev3control module scheduling header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The scheduling of the module (policy, priority, nice, CPU affinity and cgroup CPU quota).
+ *
+ * Defaults depend on the module program so that the drive and pose modules
+ * are not delayed by telemetry (e.g. lidar burst or ev3wifi netlink work):
+ * -drive modules (ev3drive, ev3car-drive) run SCHED_FIFO
+ * -pose modules (ev3sampler, ev3odometry, ev3dead-reconning, ev3car-reconning) run with negative nice
+ * -telemetry modules (ev3laser, ev3wifi) run with positive nice
+ * -other programs run SCHED_OTHER with nice 0
+ * ENABLE attributes override the defaults.
+ *
+ * The scheduling is applied by the module itself (the child before execv, the hosted module thread)
+ * or to the module pid (zygote modules). It is best effort, RT policies and negative nice
+ * need privileges (CAP_SYS_NICE or RLIMIT_RTPRIO/RLIMIT_NICE), failures are only reported.
+ *
+ * The CPU quota uses cgroup v1 cpu controller, the module gets its own cgroup
+ * under CGROUP_CPU_DIRECTORY (which has to exist and be writable for ev3control).
+ */
+
+#pragma once
+
+#include <sys/types.h> //pid_t
+#include <stdint.h> //uint32_t
+
+#include <string> //string
+
+const char *const CGROUP_CPU_DIRECTORY="/sys/fs/cgroup/cpu/ev3control";
+const int CGROUP_CPU_PERIOD_US=100000;
+
+struct ModuleScheduling
+{
+	int policy; //SCHED_OTHER, SCHED_FIFO, SCHED_RR, SCHED_BATCH, SCHED_IDLE
+	int rt_priority; //1-99 for SCHED_FIFO and SCHED_RR
+	int nice; //-20-19 for the other policies
+	uint32_t cpu_affinity; //CPU bitmask, 0 for inherited
+	int cpu_quota_permille; //of single CPU, 0 for none
+};
+
+ModuleScheduling DefaultModuleScheduling(const std::string &module_call);
+// false if the values are out of range
+bool ValidModuleScheduling(const ModuleScheduling &scheduling);
+// tid 0 for the calling thread, returns false if anything failed (reported on stderr)
+bool ApplyModuleScheduling(const ModuleScheduling &scheduling, const std::string &module_name, pid_t tid);
+// e.g. "SCHED_FIFO 20, nice 0, affinity inherited, no quota"
+std::string ModuleSchedulingString(const ModuleScheduling &scheduling);
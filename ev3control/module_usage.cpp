@@ -0,0 +1,157 @@
+/*
+ * ev3dev-mapping ev3control module resource usage implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "module_usage.h"
+
+#include "shared/misc.h"
+
+#include <unistd.h> //pread, close, sysconf
+#include <fcntl.h> //open
+#include <stdio.h> //snprintf, sscanf
+#include <string.h> //strrchr, strstr
+
+const int MODULE_USAGE_STAT_BYTES=512;
+const int MODULE_USAGE_STATUS_BYTES=4096;
+
+int OpenProc(const char *directory, const char *file)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "%s/%s", directory, file);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// reads the whole procfs file (from the start), zero terminated, false on failure
+bool ReadProc(int fd, char *buffer, int buffer_length)
+{
+	int result=pread(fd, buffer, buffer_length-1, 0);
+
+	if(result <= 0)
+		return false;
+
+	buffer[result]='\0';
+	return true;
+}
+
+void InitModuleUsage(ModuleUsage *usage)
+{
+	memset(usage, 0, sizeof(*usage));
+	usage->stat_fd=usage->statm_fd=usage->status_fd=-1;
+}
+
+bool OpenModuleUsage(ModuleUsage *usage, pid_t pid, pid_t tid, int rss_base_kb)
+{
+	char directory[48];
+
+	CloseModuleUsage(usage);
+	InitModuleUsage(usage);
+
+	if(tid)
+		snprintf(directory, sizeof(directory), "/proc/%d/task/%d", pid, tid);
+	else
+		snprintf(directory, sizeof(directory), "/proc/%d", pid);
+
+	usage->stat_fd=OpenProc(directory, "stat");
+	usage->status_fd=OpenProc(directory, "status");
+	usage->rss_base_kb=rss_base_kb;
+
+	//the thread statm is the process statm anyway
+	snprintf(directory, sizeof(directory), "/proc/%d", pid);
+	usage->statm_fd=OpenProc(directory, "statm");
+
+	if(usage->stat_fd == -1 || usage->status_fd == -1 || usage->statm_fd == -1)
+	{
+		CloseModuleUsage(usage);
+		return false;
+	}
+
+	return true;
+}
+
+bool SampleModuleUsage(ModuleUsage *usage)
+{
+	static const long TICKS_PER_SECOND=sysconf(_SC_CLK_TCK);
+	static const long PAGE_KB=sysconf(_SC_PAGESIZE)/1024;
+	char stat[MODULE_USAGE_STAT_BYTES], statm[64], status[MODULE_USAGE_STATUS_BYTES];
+	unsigned long minflt, majflt, utime, stime, voluntary=0, involuntary=0;
+	long total, resident;
+	const char *field;
+
+	if(usage->stat_fd == -1)
+		return false;
+
+	uint64_t now=TimestampUs();
+
+	if( !ReadProc(usage->stat_fd, stat, sizeof(stat)) || !ReadProc(usage->statm_fd, statm, sizeof(statm)) || !ReadProc(usage->status_fd, status, sizeof(status)) )
+		return false;
+
+	//the command name may contain spaces and parentheses, fields are counted from the last ')'
+	if( (field=strrchr(stat, ')')) == NULL )
+		return false;
+
+	//state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime
+	if( sscanf(field+1, " %*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu", &minflt, &majflt, &utime, &stime) != 4 )
+		return false;
+
+	if( sscanf(statm, "%ld %ld", &total, &resident) != 2 )
+		return false;
+
+	if( (field=strstr(status, "voluntary_ctxt_switches:")) != NULL )
+		sscanf(field, "voluntary_ctxt_switches: %lu", &voluntary);
+	if( (field=strstr(status, "nonvoluntary_ctxt_switches:")) != NULL )
+		sscanf(field, "nonvoluntary_ctxt_switches: %lu", &involuntary);
+
+	uint64_t cpu_ticks=utime+stime;
+
+	if(usage->first_sample_us == 0)
+	{
+		usage->first_sample_us=usage->sample_us=now;
+		usage->first_cpu_ticks=usage->cpu_ticks=cpu_ticks;
+	}
+
+	if(now > usage->sample_us)
+		usage->cpu_permille=(cpu_ticks - usage->cpu_ticks) * 1000000000ULL / TICKS_PER_SECOND / (now - usage->sample_us);
+
+	usage->sample_us=now;
+	usage->cpu_ticks=cpu_ticks;
+
+	usage->cpu_time_ms=cpu_ticks * 1000 / TICKS_PER_SECOND;
+	usage->rss_kb=resident*PAGE_KB - usage->rss_base_kb;
+	usage->voluntary_switches=voluntary;
+	usage->involuntary_switches=involuntary;
+	usage->page_faults=minflt+majflt;
+
+	return true;
+}
+
+int AverageCpuPermille(const ModuleUsage &usage)
+{
+	static const long TICKS_PER_SECOND=sysconf(_SC_CLK_TCK);
+
+	if(usage.sample_us <= usage.first_sample_us)
+		return 0;
+
+	return (usage.cpu_ticks - usage.first_cpu_ticks) * 1000000000ULL / TICKS_PER_SECOND / (usage.sample_us - usage.first_sample_us);
+}
+
+void CloseModuleUsage(ModuleUsage *usage)
+{
+	if(usage->stat_fd != -1)
+		close(usage->stat_fd);
+	if(usage->statm_fd != -1)
+		close(usage->statm_fd);
+	if(usage->status_fd != -1)
+		close(usage->status_fd);
+
+	usage->stat_fd=usage->statm_fd=usage->status_fd=-1;
+}
@@ -0,0 +1,63 @@
+/*
+ * ev3dev-mapping ev3control module resource usage header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The module resource usage is sampled from procfs:
+ * -/proc/<pid>/stat for CPU time and page faults
+ * -/proc/<pid>/statm for RSS
+ * -/proc/<pid>/status for context switches
+ *
+ * The files are opened once (when the module is enabled) and re-read with pread
+ * so that sampling costs 3 syscalls per module.
+ *
+ * Hosted modules are sampled from their thread (/proc/self/task/<tid>),
+ * their RSS is ev3control RSS growth since the module was started.
+ *
+ * CPU time has the kernel tick resolution (usually 10 ms).
+ */
+
+#pragma once
+
+#include <sys/types.h> //pid_t
+#include <stdint.h> //uint64_t
+
+struct ModuleUsage
+{
+	int stat_fd;
+	int statm_fd;
+	int status_fd;
+	int rss_base_kb; //subtracted from RSS (hosted modules)
+
+	uint64_t first_sample_us;
+	uint64_t first_cpu_ticks;
+	uint64_t sample_us;
+	uint64_t cpu_ticks;
+
+	// the last sample
+	int cpu_permille; //since the previous sample
+	int cpu_time_ms; //since the module start
+	int rss_kb;
+	int voluntary_switches;
+	int involuntary_switches;
+	int page_faults; //minor and major
+};
+
+void InitModuleUsage(ModuleUsage *usage);
+// tid is the hosted module thread or 0 for process, false on failure
+bool OpenModuleUsage(ModuleUsage *usage, pid_t pid, pid_t tid, int rss_base_kb);
+// false if not open or on failure (e.g. the module already exited)
+bool SampleModuleUsage(ModuleUsage *usage);
+// CPU usage between the first and the last sample
+int AverageCpuPermille(const ModuleUsage &usage);
+void CloseModuleUsage(ModuleUsage *usage);
@@ -17,9 +17,9 @@
 #include "shared/misc.h"
 
 #include <netinet/in.h> //socaddr_in
+#include <netinet/tcp.h> //TCP_NODELAY
 #include <sys/types.h>  //for historical portabilty
 #include <sys/socket.h> //socket
-#include <sys/select.h> //select
 
 #include <errno.h> //errno
 #include <string.h> //memset
@@ -29,7 +29,7 @@
 // Note - all the sockets are created with O_CLOEXEC (or SOCK_CLOEXEC) flags
 // so that they are not inherited by child processes
 
-void InitNetworkTCP(int *sock, short port)
+void InitNetworkTCP(int *sock, short port, int backlog)
 {
 	struct sockaddr_in servaddr;
 	int flags;
@@ -52,53 +52,28 @@ void InitNetworkTCP(int *sock, short port)
 	if ( bind(*sock, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0 ) 
               DieErrno("InitNetworkTCP bind");  
 			  
-	if ( listen(*sock,1) == -1 )
+	if ( listen(*sock, backlog) == -1 )
 		DieErrno("InitNetworkTCP listen");
 }
 
-bool WaitForClientTCP(int serv_sock, int timeout_ms, int *client_sock)
+bool AcceptClientTCP(int serv_sock, int *client_sock)
 {
-	struct timeval tv;
 	struct sockaddr_in clientaddr;
-
 	socklen_t clientaddr_length=sizeof(clientaddr);
-	fd_set rfds;
-
-    int ret;
-
-    FD_ZERO(&rfds);
-    FD_SET(serv_sock, &rfds);
 
-	tv.tv_sec = timeout_ms / 1000;
-	tv.tv_usec = (timeout_ms-(timeout_ms/1000)*1000) * 1000;		
-				
-    ret = select(serv_sock+1, &rfds, NULL, NULL, &tv);
-
-	if(ret == -1)
-	{
-		if(errno == EINTR)
-			return false;
-		DieErrno("WaitForClientTCP select");
-	}
-	else if(ret==0)
-		return false;
-		
-	//otherwise select returned postive value
-   
-	*client_sock = accept4(serv_sock, (struct sockaddr *) &clientaddr, &clientaddr_length, SOCK_CLOEXEC);
+	*client_sock = accept4(serv_sock, (struct sockaddr *) &clientaddr, &clientaddr_length, SOCK_CLOEXEC | SOCK_NONBLOCK);
 	
 	if(*client_sock == -1)
-	{   //the peer gave up connection between select and accept, just return timetout
-		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	{   //no more pending connections or the peer gave up
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
 			return false;
-		DieErrno("WaitForClientTCP accept4");
+		DieErrno("AcceptClientTCP accept4");
 	}
-	
-	tv.tv_sec = timeout_ms / 1000;
-	tv.tv_usec = (timeout_ms-(timeout_ms/1000)*1000) * 1000;		
-				
-	if (setsockopt(*client_sock, SOL_SOCKET, SO_RCVTIMEO,&tv,sizeof(tv)) == -1)
-		DieErrno("WaitForClientTCP setsockopt");				
+
+	//the messages are small and latency matters (e.g. FAILED after ENABLED would wait for delayed ACK)
+	int nodelay=1;
+	if( setsockopt(*client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1 )
+		DieErrno("AcceptClientTCP setsockopt TCP_NODELAY");
 	
 	return true;
 }
@@ -16,18 +16,17 @@
 
 // all created sockets have O_CLOEXEC flag set
 
-void InitNetworkTCP(int *serv_sock, short port);
+// backlog - the number of pending connections
+void InitNetworkTCP(int *serv_sock, short port, int backlog);
 
 // prerequisities:
 // - InitNetworkTCP called with serv_sock as argument
 //
-// timeout:
-// - waiting for client timeouts after timetout_ms
-// - the returned client socket has timeout_ms set for receiving
+// the returned client socket is non-blocking with TCP_NODELAY
 //
 // returns:
-// - false on timeout
+// - false if there are no pending connections
 // - true if client was accepted, then client_sock is its socket
-bool WaitForClientTCP(int serv_sock, int timeout_ms, int *client_sock);
+bool AcceptClientTCP(int serv_sock, int *client_sock);
 
 void CloseNetworkTCP(int serv_sock);
\ No newline at end of file
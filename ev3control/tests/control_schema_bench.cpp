@@ -0,0 +1,107 @@
+/*
+ * ev3dev-mapping ev3control control schema benchmark
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Measures parsing and encoding of the messages with control_schema.h
+ * (CPU time per message):
+ * -ENABLE with all the optional attributes
+ * -ENABLE_MANY with 4 modules (ParseGroup)
+ * -KEEPALIVE with the usage of 8 modules
+ */
+
+#include "../control_protocol.h"
+#include "../control_schema.h"
+
+#include "shared/misc.h"
+
+#include <stdio.h> //printf
+#include <stdlib.h> //EXIT_SUCCESS
+
+const int BENCH_MESSAGES=1000000;
+const int BENCH_ENABLE_MANY_MODULES=4;
+const int BENCH_KEEPALIVE_MODULES=8;
+
+volatile int g_sink; //keeps the work from being optimized out
+
+void PrintResult(const char *what, int bytes, uint64_t start_us)
+{
+	printf("%-32s %3d bytes %6.1f ns\n", what, bytes, (ThreadCpuTimeUs()-start_us)*1000.0/BENCH_MESSAGES);
+}
+
+int main(int argc, char **argv)
+{
+	char message[CONTROL_BUFFER_BYTES];
+	control_header header;
+	uint64_t start_us;
+	int length;
+
+	printf("control_schema_bench: %d messages each, per message:\n", BENCH_MESSAGES);
+
+	//ENABLE
+
+	control_enable enable={ControlString("ev3drive"), ControlString("./ev3drive 8003 500"), 100, 1, 10, -5, 3, 500};
+	control_enable parsed_enable=control_enable();
+	length=EncodeControlMessage<ENABLE>(message, sizeof(message), 0, enable);
+
+	start_us=ThreadCpuTimeUs();
+	for(int i=0;i<BENCH_MESSAGES;++i)
+		g_sink=EncodeControlMessage<ENABLE>(message, sizeof(message), i, enable);
+	PrintResult("encode ENABLE", length, start_us);
+
+	start_us=ThreadCpuTimeUs();
+	for(int i=0;i<BENCH_MESSAGES;++i)
+	{
+		GetControlHeader(message, &header);
+		g_sink=ParseControlMessage<ENABLE>(header, message+CONTROL_HEADER_BYTES, &parsed_enable) + parsed_enable.nice;
+	}
+	PrintResult("parse ENABLE", length, start_us);
+
+	//ENABLE_MANY
+
+	control_enable_many module={ControlString("ev3drive"), ControlString("./ev3drive 8003 500"), 0, 0, 0, 0, 0, 0, ControlString("ev3sampler")};
+	control_enable_many parsed_module=control_enable_many();
+	PutControlHeader(message, sizeof(message), 0, ENABLE_MANY);
+	for(int i=0;i<BENCH_ENABLE_MANY_MODULES;++i)
+		ControlEnableManySchema::Put(message, sizeof(message), module, ControlEnableManySchema::Bit(DEPENDS_ON));
+	length=GetControlMessageLength(message);
+
+	start_us=ThreadCpuTimeUs();
+	for(int i=0;i<BENCH_MESSAGES;++i)
+	{
+		GetControlHeader(message, &header);
+
+		const char *payload=message+CONTROL_HEADER_BYTES, *message_boundrary=payload+header.payload_length;
+		uint32_t present;
+
+		while(payload < message_boundrary && ControlEnableManySchema::ParseGroup(&payload, message_boundrary, &parsed_module, &present))
+			g_sink=present;
+	}
+	PrintResult("parse ENABLE_MANY (4 modules)", length, start_us);
+
+	//KEEPALIVE
+
+	control_module_usage usage={ControlString("ev3dead-reconning"), 120, 5000, 2048, 100, 3, 0};
+
+	start_us=ThreadCpuTimeUs();
+	for(int i=0;i<BENCH_MESSAGES;++i)
+	{
+		PutControlHeader(message, sizeof(message), i, KEEPALIVE);
+		for(int m=0;m<BENCH_KEEPALIVE_MODULES;++m)
+			ControlModuleUsageSchema::Put(message, sizeof(message), usage);
+		g_sink=GetControlMessageLength(message);
+	}
+	PrintResult("encode KEEPALIVE (8 modules)", GetControlMessageLength(message), start_us);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,322 @@
+/*
+ * ev3dev-mapping ev3control control schema fuzz driver
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Feeds random and mutated messages to the schemas of control_schema.h
+ * (built with AddressSanitizer and UndefinedBehaviorSanitizer by make fuzz).
+ *
+ * The input is the command byte followed by the payload. The payload is parsed
+ * like ev3control does (ParseControlMessage or ParseGroup for repeated groups)
+ * and each accepted message has to round trip:
+ * -encoding it gives the payload of the same length (all the attributes are encoded back)
+ * -parsing and encoding that again gives the same bytes
+ *
+ * FuzzOne is also exposed as LLVMFuzzerTestOneInput, build with -DCONTROL_FUZZ_LIBFUZZER
+ * and clang -fsanitize=fuzzer to use libFuzzer instead of the built-in mutator.
+ *
+ * See Usage() function for syntax details
+ */
+
+#include "../control_protocol.h"
+#include "../control_schema.h"
+
+#include "shared/misc.h"
+
+#include <stdio.h> //printf
+#include <stdlib.h> //strtol, malloc
+#include <string.h> //memcpy, memcmp
+
+const int FUZZ_PAYLOAD_BYTES=CONTROL_BUFFER_BYTES-CONTROL_HEADER_BYTES;
+const int FUZZ_COMMANDS=8;
+const int8_t FUZZ_COMMAND_LIST[FUZZ_COMMANDS]={KEEPALIVE, ENABLE, DISABLE, DISABLE_ALL, ENABLE_MANY, ENABLED, DISABLED, FAILED};
+
+int g_accepted[FUZZ_COMMANDS];
+
+int Accepted()
+{
+	int accepted=0;
+	for(int i=0;i<FUZZ_COMMANDS;++i)
+		accepted+=g_accepted[i];
+	return accepted;
+}
+
+// parses the payload and encodes it back into encoded (with header),
+// returns encoded payload length or -1 if the payload is invalid
+template<typename Schema>
+int Reencode(const char *payload, int length, bool groups, char *encoded, int encoded_length)
+{
+	typename Schema::message msg;
+	uint32_t present;
+
+	PutControlHeader(encoded, encoded_length, 0, 0);
+
+	if(!groups)
+	{
+		control_header header;
+		header.payload_length=length;
+
+		if( !Schema::Parse(header, payload, &msg, &present) )
+			return -1;
+		if( !Schema::Put(encoded, encoded_length, msg, present) )
+			Die("control_schema_fuzz: accepted message doesn't encode");
+		return GetControlMessageLength(encoded)-CONTROL_HEADER_BYTES;
+	}
+
+	const char *next=payload, *message_boundrary=payload+length;
+
+	while(next < message_boundrary)
+	{
+		if( !Schema::ParseGroup(&next, message_boundrary, &msg, &present) )
+			return -1;
+		if( !Schema::Put(encoded, encoded_length, msg, present) )
+			Die("control_schema_fuzz: accepted group doesn't encode");
+	}
+
+	return GetControlMessageLength(encoded)-CONTROL_HEADER_BYTES;
+}
+
+// true if the payload is accepted, dies if it doesn't round trip
+template<typename Schema>
+bool RoundTrip(const char *payload, int length, bool groups)
+{
+	char first[CONTROL_BUFFER_BYTES], second[CONTROL_BUFFER_BYTES];
+	int first_length, second_length;
+
+	if( (first_length=Reencode<Schema>(payload, length, groups, first, sizeof(first))) == -1 )
+		return false;
+
+	if(first_length != length)
+		Die("control_schema_fuzz: encoded length differs from the accepted payload");
+
+	second_length=Reencode<Schema>(first+CONTROL_HEADER_BYTES, first_length, groups, second, sizeof(second));
+
+	if( second_length != first_length || memcmp(first, second, CONTROL_HEADER_BYTES+first_length) != 0 )
+		Die("control_schema_fuzz: encoded message doesn't round trip");
+
+	return true;
+}
+
+int FuzzOne(const uint8_t *data, size_t size)
+{
+	if(size < 1 || size-1 > (size_t)FUZZ_PAYLOAD_BYTES)
+		return 0;
+
+	int8_t command=data[0];
+	int length=size-1;
+	//exact size so that the sanitizer catches reads past the payload
+	char *payload=(char*)malloc(length ? length : 1);
+	bool accepted=false;
+
+	memcpy(payload, data+1, length);
+
+	switch(command)
+	{
+		case KEEPALIVE: //empty from the clients, module usage groups from ev3control
+			accepted=RoundTrip<ControlEmptySchema>(payload, length, false);
+			accepted=RoundTrip<ControlModuleUsageSchema>(payload, length, true) || accepted;
+			break;
+		case ENABLE:
+			accepted=RoundTrip<ControlEnableSchema>(payload, length, false);
+			break;
+		case DISABLE:
+		case ENABLED:
+		case DISABLED:
+			accepted=RoundTrip<ControlModuleSchema>(payload, length, false);
+			break;
+		case DISABLE_ALL:
+			accepted=RoundTrip<ControlEmptySchema>(payload, length, false);
+			break;
+		case ENABLE_MANY:
+			accepted=RoundTrip<ControlEnableManySchema>(payload, length, true);
+			break;
+		case FAILED:
+			accepted=RoundTrip<ControlFailedSchema>(payload, length, false);
+			break;
+	}
+
+	for(int i=0;accepted && i<FUZZ_COMMANDS;++i)
+		if(FUZZ_COMMAND_LIST[i] == command)
+			++g_accepted[i];
+
+	free(payload);
+	return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	return FuzzOne(data, size);
+}
+
+#ifndef CONTROL_FUZZ_LIBFUZZER
+
+// the built-in mutator
+
+struct fuzz_input
+{
+	uint8_t data[CONTROL_BUFFER_BYTES];
+	int size;
+};
+
+uint64_t g_random_state;
+
+uint32_t Random(uint32_t range)
+{	//xorshift64*
+	g_random_state ^= g_random_state >> 12;
+	g_random_state ^= g_random_state << 25;
+	g_random_state ^= g_random_state >> 27;
+	return (uint32_t)((g_random_state * 2685821657736338717ULL) >> 32) % range;
+}
+
+void AddSeed(fuzz_input *seeds, int *count, int8_t command, const char *message)
+{
+	fuzz_input *seed=&seeds[(*count)++];
+	int payload_length=GetControlMessageLength(message)-CONTROL_HEADER_BYTES;
+
+	seed->data[0]=command;
+	memcpy(seed->data+1, message+CONTROL_HEADER_BYTES, payload_length);
+	seed->size=payload_length+1;
+}
+
+// valid messages of each command
+int CreateSeeds(fuzz_input *seeds)
+{
+	char message[CONTROL_BUFFER_BYTES];
+	int count=0;
+
+	control_enable enable={ControlString("ev3drive"), ControlString("./ev3drive 8003 500"), 100, 1, 10, -5, 3, 500};
+	EncodeControlMessage<ENABLE>(message, sizeof(message), 0, enable);
+	AddSeed(seeds, &count, ENABLE, message);
+
+	control_module module={ControlString("ev3laser")};
+	EncodeControlMessage<DISABLE>(message, sizeof(message), 0, module);
+	AddSeed(seeds, &count, DISABLE, message);
+	AddSeed(seeds, &count, ENABLED, message);
+
+	control_failed failed={ControlString("ev3wifi"), -11};
+	EncodeControlMessage<FAILED>(message, sizeof(message), 0, failed);
+	AddSeed(seeds, &count, FAILED, message);
+
+	control_enable_many drive={ControlString("drive"), ControlString("./ev3drive 8003 500"), 0, 0, 0, 0, 0, 0, ControlString("")};
+	control_enable_many reckoning={ControlString("reckoning"), ControlString("./ev3dead-reconning 8005 10"), 0, 0, 0, 0, 0, 0, ControlString("drive sampler")};
+	PutControlHeader(message, sizeof(message), 0, ENABLE_MANY);
+	ControlEnableManySchema::Put(message, sizeof(message), drive, ControlEnableManySchema::Bit(NICE));
+	ControlEnableManySchema::Put(message, sizeof(message), reckoning);
+	AddSeed(seeds, &count, ENABLE_MANY, message);
+
+	control_module_usage usage={ControlString("ev3sampler"), 120, 5000, 2048, 100, 3, 0};
+	PutControlHeader(message, sizeof(message), 0, KEEPALIVE);
+	ControlModuleUsageSchema::Put(message, sizeof(message), usage);
+	ControlModuleUsageSchema::Put(message, sizeof(message), usage);
+	AddSeed(seeds, &count, KEEPALIVE, message);
+
+	return count;
+}
+
+void Mutate(const fuzz_input *seeds, int seeds_count, fuzz_input *input)
+{
+	const fuzz_input &seed=seeds[Random(seeds_count)];
+	int max_size=FUZZ_PAYLOAD_BYTES+1;
+
+	*input=seed;
+
+	switch( Random(5) )
+	{
+		case 0: //random bytes
+			input->size=1+Random(64);
+			input->data[0]=FUZZ_COMMAND_LIST[Random(FUZZ_COMMANDS)];
+			for(int i=1;i<input->size;++i)
+				input->data[i]=Random(256);
+			break;
+		case 1: //flipped bytes
+			for(int i=0, flips=1+Random(4);i<flips && input->size > 1;++i)
+				input->data[1+Random(input->size-1)] ^= 1 << Random(8);
+			break;
+		case 2: //truncated or extended
+			if( Random(2) )
+				input->size=1+Random(input->size);
+			else
+				for(int i=0, extra=Random(16);i<extra && input->size < max_size;++i)
+					input->data[input->size++]=Random(256);
+			break;
+		case 3: //attribute inserted at random offset
+		{
+			uint8_t attribute[CONTROL_ATTRIBUTE_HEADER_BYTES+8];
+			int length=Random(8), offset=1+Random(input->size);
+
+			attribute[0]=Random(CONTROL_ATTRIBUTES_LAST+4);
+			attribute[1]=Random(4) ? length : Random(256);
+			for(int i=0;i<length;++i)
+				attribute[CONTROL_ATTRIBUTE_HEADER_BYTES+i] = i == length-1 && Random(2) ? 0 : Random(256);
+
+			int bytes=CONTROL_ATTRIBUTE_HEADER_BYTES+length;
+			if(input->size+bytes > max_size)
+				break;
+			memmove(input->data+offset+bytes, input->data+offset, input->size-offset);
+			memcpy(input->data+offset, attribute, bytes);
+			input->size+=bytes;
+			break;
+		}
+		case 4: //the payload under other command
+			input->data[0]=FUZZ_COMMAND_LIST[Random(FUZZ_COMMANDS)];
+			break;
+	}
+}
+
+void Usage()
+{
+	printf("Usage:\n");
+	printf("control_schema_fuzz iterations [seed]\n\n");
+	printf("examples:\n");
+	printf("./control_schema_fuzz 2000000\n");
+	printf("./control_schema_fuzz 2000000 7\n");
+}
+
+int main(int argc, char **argv)
+{
+	fuzz_input seeds[16], input;
+	int seeds_count, iterations;
+
+	if(argc < 2 || argc > 3 || (iterations=strtol(argv[1], NULL, 0)) <= 0)
+	{
+		Usage();
+		return EXIT_FAILURE;
+	}
+
+	g_random_state = argc == 3 ? strtoull(argv[2], NULL, 0) : 1;
+	g_random_state = g_random_state ? g_random_state : 1;
+
+	seeds_count=CreateSeeds(seeds);
+
+	for(int i=0;i<seeds_count;++i)
+	{
+		FuzzOne(seeds[i].data, seeds[i].size);
+		if(Accepted() != i+1)
+			Die("control_schema_fuzz: valid seed message rejected");
+	}
+
+	for(int i=0;i<iterations;++i)
+	{
+		Mutate(seeds, seeds_count, &input);
+		FuzzOne(input.data, input.size);
+	}
+
+	printf("control_schema_fuzz: %d inputs, accepted and round tripped:", iterations);
+	for(int i=0;i<FUZZ_COMMANDS;++i)
+		printf(" %d", g_accepted[i]);
+	printf(" (KEEPALIVE ENABLE DISABLE DISABLE_ALL ENABLE_MANY ENABLED DISABLED FAILED)\n");
+
+	return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * ev3dev-mapping ev3control crash to FAILED latency harness
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Measures the time from module crash to FAILED received by the client:
+ * -starts ev3control on the port
+ * -enables this program as the module (called with "module" argument it writes its pid and waits)
+ * -after ENABLED kills the module with SIGKILL and waits for FAILED
+ * -repeats that and prints min/average/max latency
+ *
+ * See Usage() function for syntax details (or run the program without arguments)
+ */
+
+#include "../control_protocol.h"
+#include "../control_schema.h"
+
+#include "shared/misc.h"
+
+#include <sys/socket.h> //socket, connect, recv, send
+#include <sys/wait.h> //waitpid
+#include <netinet/in.h> //sockaddr_in
+#include <arpa/inet.h> //htons, htonl
+#include <unistd.h> //fork, execv, readlink, pause
+#include <fcntl.h> //open
+#include <signal.h> //kill
+#include <limits.h> //PATH_MAX
+#include <stdio.h> //printf
+#include <stdlib.h> //strtol, exit
+#include <string.h> //strcmp
+
+#include <string> //string
+
+using namespace std;
+
+const char *MODULE_NAME="crash";
+const char *PID_FILE="/tmp/ev3control_crash_latency.pid";
+const int RECEIVE_TIMEOUT_S=10;
+
+pid_t StartControl(const char *control_path, int port);
+int ConnectControl(int port);
+void EnableModule(int control_socket, const string &call);
+int8_t ReceiveModuleMessage(int control_socket, char *payload);
+pid_t ReadModulePid();
+int RunModule();
+
+void Usage();
+int ProcessArguments(int argc, char **argv, int *port, int *iterations);
+
+int main(int argc, char **argv)
+{
+	int port, iterations;
+	char self[PATH_MAX], payload[CONTROL_BUFFER_BYTES];
+	ssize_t self_length;
+
+	if(argc == 2 && strcmp(argv[1], "module") == 0)
+		return RunModule();
+
+	if( ProcessArguments(argc, argv, &port, &iterations) )
+	{
+		Usage();
+		return EXIT_FAILURE;
+	}
+
+	if( (self_length=readlink("/proc/self/exe", self, sizeof(self)-1)) == -1 )
+		DieErrno("crash_latency: readlink failed");
+	self[self_length]='\0';
+
+	pid_t control_pid=StartControl(argv[1], port);
+	int control_socket=ConnectControl(port);
+	uint64_t min_us=UINT64_MAX, max_us=0, sum_us=0;
+
+	for(int i=0;i<iterations;++i)
+	{
+		unlink(PID_FILE);
+		EnableModule(control_socket, string(self) + " module");
+
+		if( ReceiveModuleMessage(control_socket, payload) != ENABLED )
+			Die("crash_latency: module not enabled");
+
+		pid_t module_pid=ReadModulePid();
+		uint64_t kill_us=TimestampUs();
+
+		if( kill(module_pid, SIGKILL) == -1 )
+			DieErrno("crash_latency: kill failed");
+
+		if( ReceiveModuleMessage(control_socket, payload) != FAILED )
+			Die("crash_latency: FAILED not received after the crash");
+
+		uint64_t latency_us=TimestampUs()-kill_us;
+
+		min_us = latency_us < min_us ? latency_us : min_us;
+		max_us = latency_us > max_us ? latency_us : max_us;
+		sum_us += latency_us;
+	}
+
+	printf("crash_latency: %d crashes, latency min %llu us, average %llu us, max %llu us\n",
+		iterations, (unsigned long long)min_us, (unsigned long long)(sum_us/iterations), (unsigned long long)max_us);
+
+	close(control_socket);
+	unlink(PID_FILE);
+	kill(control_pid, SIGINT);
+	waitpid(control_pid, NULL, 0);
+	return EXIT_SUCCESS;
+}
+
+pid_t StartControl(const char *control_path, int port)
+{
+	char port_string[16];
+	pid_t pid;
+
+	snprintf(port_string, sizeof(port_string), "%d", port);
+	fflush(NULL);
+
+	if( (pid=fork()) == -1 )
+		DieErrno("crash_latency: fork failed");
+
+	if(pid == 0)
+	{	//only ev3control errors are printed
+		int null_fd=open("/dev/null", O_WRONLY);
+		if(null_fd != -1)
+			dup2(null_fd, STDOUT_FILENO);
+
+		char *control_argv[]={(char*)control_path, port_string, (char*)"1000", NULL};
+		execv(control_path, control_argv);
+		perror("crash_latency: execv ev3control failed");
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+// ev3control may be still starting, retries for a second
+int ConnectControl(int port)
+{
+	struct sockaddr_in address;
+	struct timeval timeout={RECEIVE_TIMEOUT_S, 0};
+	int control_socket;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family=AF_INET;
+	address.sin_port=htons(port);
+	address.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+
+	for(int i=0;i<100;++i)
+	{
+		if( (control_socket=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 )
+			DieErrno("crash_latency: socket failed");
+
+		if( connect(control_socket, (struct sockaddr*)&address, sizeof(address)) == 0 )
+		{
+			if( setsockopt(control_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 )
+				DieErrno("crash_latency: setsockopt failed");
+			return control_socket;
+		}
+
+		close(control_socket);
+		SleepUs(10000);
+	}
+
+	DieErrno("crash_latency: unable to connect to ev3control");
+	return -1;
+}
+
+void EnableModule(int control_socket, const string &call)
+{
+	char buffer[CONTROL_BUFFER_BYTES];
+	control_enable msg;
+	int length;
+
+	msg.unique_name=ControlString(MODULE_NAME);
+	msg.call=ControlString(call.c_str());
+	msg.creation_delay_ms=0;
+
+	if( (length=EncodeControlMessage<ENABLE>(buffer, sizeof(buffer), TimestampUs(), msg, 0)) == -1 )
+		Die("crash_latency: module call too long");
+
+	if( send(control_socket, buffer, length, MSG_NOSIGNAL) != length )
+		DieErrno("crash_latency: send failed");
+}
+
+bool ReceiveAll(int control_socket, char *buffer, int length)
+{
+	for(int received=0, result;received < length;received+=result)
+		if( (result=recv(control_socket, buffer+received, length-received, 0)) <= 0 )
+			return false;
+	return true;
+}
+
+// returns the command of the next message other than KEEPALIVE, the payload is in payload
+int8_t ReceiveModuleMessage(int control_socket, char *payload)
+{
+	char header_buffer[CONTROL_HEADER_BYTES];
+	control_header header;
+
+	do
+	{
+		if( !ReceiveAll(control_socket, header_buffer, CONTROL_HEADER_BYTES) )
+			DieErrno("crash_latency: no message from ev3control");
+
+		GetControlHeader(header_buffer, &header);
+
+		if( header.payload_length > CONTROL_BUFFER_BYTES - CONTROL_HEADER_BYTES || !ReceiveAll(control_socket, payload, header.payload_length) )
+			Die("crash_latency: invalid message from ev3control");
+	}
+	while(header.command == KEEPALIVE);
+
+	return header.command;
+}
+
+// the module writes the pid after signalling readiness, ENABLED may come first
+pid_t ReadModulePid()
+{
+	for(int i=0;i<1000;++i)
+	{
+		FILE *file=fopen(PID_FILE, "r");
+		int pid;
+
+		if(file != NULL)
+		{
+			int result=fscanf(file, "%d", &pid);
+			fclose(file);
+			if(result == 1)
+				return pid;
+		}
+		SleepUs(1000);
+	}
+
+	Die("crash_latency: no module pid");
+	return -1;
+}
+
+// the module, waits until killed
+int RunModule()
+{
+	char temp_file[PATH_MAX];
+
+	NotifyReady();
+
+	//written whole with rename so that the partial pid is never read
+	snprintf(temp_file, sizeof(temp_file), "%s.%d", PID_FILE, (int)getpid());
+	FILE *file=fopen(temp_file, "w");
+	if(file == NULL || fprintf(file, "%d\n", (int)getpid()) < 0 || fclose(file) != 0 || rename(temp_file, PID_FILE) == -1)
+		DieErrno("crash_latency: unable to write module pid");
+
+	while(true)
+		pause();
+}
+
+void Usage()
+{
+	printf("Usage:\n");
+	printf("crash_latency ev3control_path port iterations\n\n");
+	printf("examples:\n");
+	printf("./crash_latency ../ev3control 8100 100\n");
+}
+
+int ProcessArguments(int argc, char **argv, int *port, int *iterations)
+{
+	if(argc != 4)
+		return -1;
+
+	*port=strtol(argv[2], NULL, 0);
+	*iterations=strtol(argv[3], NULL, 0);
+
+	if(*port <= 0 || *port > 65535 || *iterations <= 0)
+	{
+		fprintf(stderr, "crash_latency: port has to be in range <1, 65535>, iterations positive\n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * ev3dev-mapping ev3control Zygote class implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "zygote.h"
+
+#include "shared/misc.h"
+#include "shared/module_host.h"
+
+#include <sys/socket.h> //socketpair, sendmsg, recvmsg
+#include <sys/wait.h> //waitpid
+#include <dlfcn.h> //dlopen, dlsym
+#include <unistd.h> //fork, close, dup2, pipe2
+#include <fcntl.h> //O_CLOEXEC
+#include <signal.h> //signal
+#include <errno.h> //errno
+#include <stdio.h> //printf
+#include <stdlib.h> //setenv, exit
+#include <string.h> //strtok, memset, memcpy
+
+#include <map> //map
+
+using namespace std;
+
+// the descriptors passed with the request: module stdin and ready pipe write end
+const int ZYGOTE_REQUEST_FDS=2;
+
+void ZygoteLoop(int socket_fd, const vector<string> &preload);
+ModuleHostEntry ZygoteEntry(map<string, ModuleHostEntry> *entries, const string &path);
+bool ZygoteReceive(int socket_fd, char *call, int *fds);
+pid_t ZygoteForkModule(int socket_fd, char *call, const int *fds, ModuleHostEntry entry);
+void ZygoteRunModule(int socket_fd, char *call, const int *fds, ModuleHostEntry entry);
+void ZygoteReply(int socket_fd, pid_t module_pid);
+
+Zygote::Zygote(): socket_fd(-1), pid(0)
+{
+}
+
+Zygote::~Zygote()
+{
+	if(socket_fd == -1)
+		return;
+
+	//the zygote exits on EOF, it may be already reaped by Control
+	close(socket_fd);
+	waitpid(pid, NULL, 0);
+}
+
+void Zygote::Start(const std::vector<std::string> &preload)
+{
+	int sockets[2];
+
+	if( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1 )
+		DieErrno("Zygote: socketpair failed");
+
+	fflush(NULL); //don't duplicate the buffered output
+
+	if( (pid=fork()) == -1 )
+		DieErrno("Zygote: fork failed");
+
+	if(pid == 0)
+	{
+		close(sockets[0]);
+		ZygoteLoop(sockets[1], preload);
+	}
+
+	close(sockets[1]);
+	socket_fd=sockets[0];
+}
+
+pid_t Zygote::Fork(const std::string &module_call, int stdin_fd, int ready_fd)
+{
+	char control[CMSG_SPACE(sizeof(int)*ZYGOTE_REQUEST_FDS)];
+	struct iovec iov={(void*)module_call.c_str(), module_call.size()+1};
+	struct msghdr msg;
+	pid_t module_pid;
+
+	if(module_call.size()+1 > (size_t)ZYGOTE_CALL_BYTES)
+	{
+		fprintf(stderr, "Zygote: module call too long\n");
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=control;
+	msg.msg_controllen=sizeof(control);
+
+	struct cmsghdr *cmsg=CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level=SOL_SOCKET;
+	cmsg->cmsg_type=SCM_RIGHTS;
+	cmsg->cmsg_len=CMSG_LEN(sizeof(int)*ZYGOTE_REQUEST_FDS);
+	int fds[ZYGOTE_REQUEST_FDS]={stdin_fd, ready_fd};
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if( sendmsg(socket_fd, &msg, MSG_NOSIGNAL) == -1 )
+	{
+		perror("Zygote: sendmsg failed");
+		return -1;
+	}
+
+	//the zygote replies when the module is already our child (reparented), waitpid on it works
+	int result=recv(socket_fd, &module_pid, sizeof(module_pid), 0);
+
+	if(result != sizeof(module_pid))
+	{
+		if(result == -1)
+			perror("Zygote: recv failed");
+		else
+			fprintf(stderr, "Zygote: zygote exited\n");
+		return -1;
+	}
+
+	return module_pid;
+}
+
+// the zygote process, never returns
+void ZygoteLoop(int socket_fd, const vector<string> &preload)
+{
+	map<string, ModuleHostEntry> entries;
+	char call[ZYGOTE_CALL_BYTES];
+	int fds[ZYGOTE_REQUEST_FDS];
+
+	//ev3control handles termination, the zygote exits when ev3control closes the socket
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	for(size_t i=0;i<preload.size();++i)
+		ZygoteEntry(&entries, preload[i]);
+
+	printf("ev3control: zygote ready with %d modules preloaded\n", (int)entries.size());
+
+	while( ZygoteReceive(socket_fd, call, fds) )
+	{
+		string program(call, strcspn(call, " "));
+		ModuleHostEntry entry=ZygoteEntry(&entries, program);
+
+		ZygoteReply(socket_fd, entry ? ZygoteForkModule(socket_fd, call, fds, entry) : -1);
+
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+// forks the module through the intermediate child that exits so that the module is reparented
+// to ev3control (the subreaper), the pid is returned after the intermediate is reaped
+// (so the module is already ev3control child then), -1 on failure
+pid_t ZygoteForkModule(int socket_fd, char *call, const int *fds, ModuleHostEntry entry)
+{
+	int pid_read_write[2];
+	pid_t child, module_pid=-1;
+
+	if( pipe2(pid_read_write, O_CLOEXEC) == -1 )
+	{
+		perror("ev3control: zygote pipe failed");
+		return -1;
+	}
+
+	fflush(NULL);
+
+	if( (child=fork()) == 0 )
+	{
+		close(pid_read_write[0]);
+
+		if( (module_pid=fork()) == 0 )
+		{
+			close(pid_read_write[1]);
+			ZygoteRunModule(socket_fd, call, fds, entry);
+		}
+
+		//-1 if the fork failed
+		if( write(pid_read_write[1], &module_pid, sizeof(module_pid)) != sizeof(module_pid) )
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(pid_read_write[1]);
+
+	if(child == -1)
+		perror("ev3control: zygote fork failed");
+	else
+	{
+		waitpid(child, NULL, 0);
+		if( read(pid_read_write[0], &module_pid, sizeof(module_pid)) != sizeof(module_pid) )
+			module_pid=-1;
+	}
+
+	close(pid_read_write[0]);
+	return module_pid;
+}
+
+// loads the shared object on first use and keeps it loaded, NULL on failure
+ModuleHostEntry ZygoteEntry(map<string, ModuleHostEntry> *entries, const string &path)
+{
+	map<string, ModuleHostEntry>::iterator it=entries->find(path);
+
+	if(it != entries->end())
+		return it->second;
+
+	void *library;
+	ModuleHostEntry entry;
+
+	if( (library=dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL)) == NULL || (entry=(ModuleHostEntry)dlsym(library, MODULE_HOST_ENTRY)) == NULL )
+	{
+		fprintf(stderr, "ev3control: zygote unable to load %s: %s\n", path.c_str(), dlerror());
+		return NULL;
+	}
+
+	(*entries)[path]=entry;
+	return entry;
+}
+
+// receives the request, false on EOF (ev3control exited) or error
+bool ZygoteReceive(int socket_fd, char *call, int *fds)
+{
+	char control[CMSG_SPACE(sizeof(int)*ZYGOTE_REQUEST_FDS)];
+	struct iovec iov={call, ZYGOTE_CALL_BYTES};
+	struct msghdr msg;
+	int result;
+
+	while(true)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov=&iov;
+		msg.msg_iovlen=1;
+		msg.msg_control=control;
+		msg.msg_controllen=sizeof(control);
+
+		if( (result=recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR )
+			continue;
+
+		if(result <= 0)
+			return false;
+
+		struct cmsghdr *cmsg=CMSG_FIRSTHDR(&msg);
+
+		if(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)*ZYGOTE_REQUEST_FDS))
+		{
+			fprintf(stderr, "ev3control: zygote ignoring request without descriptors\n");
+			ZygoteReply(socket_fd, -1);
+			continue;
+		}
+
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int)*ZYGOTE_REQUEST_FDS);
+		call[ZYGOTE_CALL_BYTES-1]='\0';
+		return true;
+	}
+}
+
+// the module process, like ev3control child after execv
+void ZygoteRunModule(int socket_fd, char *call, const int *fds, ModuleHostEntry entry)
+{
+	close(socket_fd);
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	//like exec'd modules which inherit it from ev3control (e.g. NotifyReady after ev3control closed the pipe)
+	signal(SIGPIPE, SIG_IGN);
+
+	if( dup2(fds[0], STDIN_FILENO) == -1 )
+		DieErrno("ev3control: zygote module dup2 failed");
+	close(fds[0]);
+
+	char ready_fd[16];
+	snprintf(ready_fd, sizeof(ready_fd), "%d", fds[1]);
+	if( setenv(READY_FD_ENVIRONMENT, ready_fd, 1) == -1 )
+		DieErrno("ev3control: zygote module setenv failed");
+
+	vector<char *> argv;
+	for(char *token=strtok(call, " "); token != NULL; token=strtok(NULL, " "))
+		argv.push_back(token);
+	argv.push_back(NULL);
+
+	//flushes stdio and runs the module static destructors like process exit
+	exit( entry(argv.size()-1, &argv[0], NULL) );
+}
+
+void ZygoteReply(int socket_fd, pid_t module_pid)
+{
+	if( send(socket_fd, &module_pid, sizeof(module_pid), MSG_NOSIGNAL) == -1 )
+		perror("ev3control: zygote send failed");
+}
@@ -0,0 +1,53 @@
+/*
+ * ev3dev-mapping ev3control Zygote class header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Zygote is a process forked from ev3control at start (before anything else).
+ * It keeps the module shared objects loaded (see shared/module_host.h) and forks
+ * the modules from itself so that they skip execv, dynamic linking and library
+ * initialization. The modules still run as separate processes (with host=NULL).
+ *
+ * The module is double forked so that it is reparented to ev3control (child subreaper).
+ * ev3control reaps and signals it like any other module.
+ *
+ * Requests (module call with stdin and ready pipe descriptors) and replies (module pid)
+ * go through SOCK_SEQPACKET socket pair.
+ */
+
+#pragma once
+
+#include <sys/types.h> //pid_t
+
+#include <string> //string
+#include <vector> //vector
+
+const int ZYGOTE_CALL_BYTES=512;
+
+class Zygote
+{
+public:
+	Zygote();
+	~Zygote();
+
+	// forks the zygote which loads the preload shared objects, dies on failure
+	void Start(const std::vector<std::string> &preload);
+	bool Started() const { return socket_fd != -1; }
+
+	// forks the module with stdin_fd as stdin and ready_fd as readiness pipe (see NotifyReady)
+	// returns the module pid (ev3control child) or -1 on failure
+	pid_t Fork(const std::string &module_call, int stdin_fd, int ready_fd);
+private:
+	int socket_fd;
+	pid_t pid;
+};
@@ -17,23 +17,47 @@
   * 
   * ev3drive:
   * -initializes 2 motors
-  * -reads UDP messages
+  * -reads UDP messages (all the queued datagrams at once)
+  * -applies only the newest command (by timestamp), older and reordered commands are discarded
+  *  (keepalives only re-arm the timeout and are answered, they never replace the command)
+  * -or holds commands stamped with execution time until then (see schedule.h)
+  * -executes sequenced commands once and acknowledges them (see sequence_window.h)
+  * -answers keepalives with time sync echo
+  * -optionally echoes applied setpoints with measured motor state (ACTUATOR_ECHO)
   * -sets motor speeds accordingly
   * -or sets motor positions and speeds accordingly
+  * -or queues trajectory segments and executes them on local control tick
+  * -reports trajectory progress and queue depth back to the controller
+  * -measures command latency and reports it back periodically (see shared/latency.h)
+  * -limits forward speed near obstacles published by ev3laser and reports interventions (see shared/safety_envelope.h)
   * -stops motors on timeout
   *
   * See Usage() function for syntax details (or run the program without arguments)
   */
 
 
+#include "trajectory.h"
+#include "schedule.h"
+#include "sequence_window.h"
+
 #include "shared/misc.h"
 #include "shared/net_udp.h"
+#include "shared/sysfs.h"
+#include "shared/motor_cache.h"
+#include "shared/latency.h"
+#include "shared/safety_envelope.h"
 
 #include "ev3dev-lang-cpp/ev3dev.h"
 
+#include <sys/epoll.h> //epoll_create1, epoll_ctl, epoll_wait
+#include <sys/timerfd.h> //timerfd_create, timerfd_settime
+#include <sys/socket.h> //recvmmsg
+#include <fcntl.h> //O_RDONLY
 #include <signal.h> //sigaction, sig_atomic_t
 #include <endian.h> //htobe16, htobe32, htobe64
 #include <stdio.h> //printf, etc
+#include <string.h> //memset
+#include <unistd.h> //read, close
 
 using namespace ev3dev;
 
@@ -49,33 +73,235 @@ struct drive_packet
 	int16_t param2;	
 	int16_t param3;
 	int16_t param4;	
+	uint64_t execute_at_us; //sender clock, 0 - execute on arrival
+	uint32_t sequence; //0 - not sequenced
 };
 
 const int CONTROL_PACKET_BYTES = 18; //8 + 5*2 = 18 bytes
-enum Commands {KEEPALIVE=0, SET_SPEED=1, TO_POSITION_WITH_SPEED=2};
+const int SCHEDULED_PACKET_BYTES = 26; //control packet + 8 bytes execute_at_us
+const int SEQUENCED_PACKET_BYTES = 30; //scheduled packet + 4 bytes sequence
+/*
+ * Scheduled commands:
+ * -SET_SPEED, TO_POSITION_WITH_SPEED and TRAJECTORY_CLEAR in SCHEDULED_PACKET_BYTES datagram
+ *  with non zero execute_at_us are executed at that time (sender clock), not coalesced
+ * -commands late by more than SCHEDULE_LATE_TOLERANCE_MS are dropped
+ * -other commands ignore execute_at_us
+ */
+/*
+ * Sequenced commands (SEQUENCED_PACKET_BYTES datagram with non zero sequence):
+ * -are meant for discrete moves (TO_POSITION_WITH_SPEED), continuous speed stream stays unsequenced
+ * -are executed at most once, retransmissions are not executed but acknowledged again
+ * -are not subject to timestamp ordering and coalescing (retransmission is older than the keepalives)
+ * -are acknowledged with command_ack, the controller retransmits until acknowledged
+ * -the sequence numbers are forgotten on timeout (and sender restart)
+ */
+enum AckStatus {ACK_EXECUTED=0, ACK_SCHEDULED=1, ACK_DUPLICATE=2, ACK_DROPPED=3};
+
+struct command_ack
+{
+	uint64_t timestamp_us; //of the acknowledged command
+	uint32_t sequence;
+	int16_t command;
+	int16_t status; //AckStatus
+};
+
+const int COMMAND_ACK_BYTES = 16; //8 + 4 + 2*2 = 16 bytes
+/*
+ * Trajectory commands (see trajectory.h):
+ * -TRAJECTORY_CLEAR - stops trajectory, empties the queue, the next expected index is 0
+ * -TRAJECTORY_ADD_VELOCITY - index, left speed, right speed, duration_ms
+ * -TRAJECTORY_ADD_WAYPOINT - index, left position delta, right position delta, speed
+ * SET_SPEED and TO_POSITION_WITH_SPEED override (clear) the trajectory
+ *
+ * ACTUATOR_ECHO - period_ms of actuator echo, 0 disables (the default)
+ */
+enum Commands {KEEPALIVE=0, SET_SPEED=1, TO_POSITION_WITH_SPEED=2, TRAJECTORY_CLEAR=3, TRAJECTORY_ADD_VELOCITY=4, TRAJECTORY_ADD_WAYPOINT=5, ACTUATOR_ECHO=6};
+
+// trajectory report sent back to the controller
+struct trajectory_report
+{
+	uint64_t timestamp_us;
+	int16_t executing_index;
+	int16_t next_index;
+	int16_t depth;
+	int16_t progress_permille;
+	int32_t position[2];
+};
+
+const int TRAJECTORY_REPORT_BYTES = 24; //8 + 4*2 + 2*4 = 24 bytes
+
+/*
+ * Time sync echo is the answer to KEEPALIVE:
+ * -timestamp_us - of the keepalive (sender clock)
+ * -received_us, sent_us - local clock, the controller subtracts the difference from round trip time
+ * -offset_us - local - sender clock estimate used for scheduling (includes minimum transit time)
+ */
+struct time_sync_echo
+{
+	uint64_t timestamp_us;
+	uint64_t received_us;
+	uint64_t sent_us;
+	int64_t offset_us;
+};
 
-void MainLoop(int socket_udp, large_motor *left, large_motor *right);
-void ProcessMessage(const drive_packet &packet,large_motor *left, large_motor *right);
+const int TIME_SYNC_BYTES = 32; //4*8 = 32 bytes
+
+/*
+ * Actuator echo is sampled in the loop iteration that applied the commands
+ * (after packets, trajectory tick, scheduled command) or on its own timer when idle:
+ * -command - the last applied command (trajectory ticks count as TRAJECTORY_ADD_*)
+ * -setpoints - as written to the motor (after safety limits)
+ * -speed, position, duty_cycle, state (MotorStateFlags) - measured at the same time
+ */
+struct motor_echo
+{
+	int32_t speed_sp;
+	int32_t position_sp;
+	int16_t duty_cycle_sp;
+	int16_t state;
+	int32_t speed;
+	int32_t position;
+	int16_t duty_cycle;
+};
+
+struct actuator_echo
+{
+	uint64_t timestamp_us;
+	int16_t command;
+	motor_echo motor[2];
+};
+
+const int ACTUATOR_ECHO_BYTES = 54; //8 + 2 + 2*(4+4+2+2+4+4+2) = 54 bytes
+const int ACTUATOR_ECHO_MIN_MS = 10;
+const int ACTUATOR_ECHO_MAX_MS = 1000;
+const int ACTUATOR_ECHO_SLACK_US = 1000; //timer wakes up may come a bit early
+
+const int DRIVE_RECV_BATCH=16; //datagrams per recvmmsg call
+
+struct drive_receiver
+{
+	uint64_t last_timestamp_us; //of the newest applied command
+	bool has_last;
+	uint64_t session_window_us; //older timestamps by more than that mean sender restart
+	sockaddr_in controller; //where the last command came from, reports go there
+	bool has_controller;
+	int received;
+	int coalesced; //superseded by newer command from the same batch
+	int late; //older than already applied command
+	int incomplete;
+	int rejected; //trajectory segments out of order or over the queue capacity
+	int scheduled;
+	int scheduled_late; //dropped, arrived after execution time
+	int scheduled_rejected; //too far ahead or the schedule full
+	uint64_t received_us; //of the last batch
+	CommandLatency *latency;
+	bool sync_pending; //keepalive waiting for time sync echo
+	uint64_t sync_timestamp_us; //of that keepalive
+	SequenceWindow *sequences;
+	command_ack acks[DRIVE_RECV_BATCH]; //waiting to be sent
+	int acks_pending;
+	int sequenced;
+	int duplicates;
+};
+
+// the last limit applied by the safety envelope, waiting to be reported
+struct safety_intervention
+{
+	bool pending;
+	int16_t command;
+	int requested;
+	int applied;
+};
+
+struct drive_motors
+{
+	MotorCommandCache *left;
+	MotorCommandCache *right;
+	int position_fd[2];
+	int speed_fd[2];
+	int duty_cycle_fd[2];
+	int state_fd[2];
+	int16_t last_command; //applied, for actuator echo
+	int echo_ms; //actuator echo period, 0 - disabled
+	uint64_t echo_us; //of the last actuator echo
+	bool trajectory_running; //motors are in run-forever mode driven by trajectory
+	SafetyEnvelope *safety;
+	safety_intervention intervention;
+	int32_t speed[2]; //requested by SET_SPEED, limited again on safety tick
+	bool speed_running; //motors are in run-forever mode driven by SET_SPEED
+	int32_t position_target[2]; //of TO_POSITION_WITH_SPEED
+	bool position_forward; //motors may be driving forward to position_target
+};
+
+void MainLoop(int socket_udp, int timeout_ms, drive_motors *motors);
+void ProcessPackets(const drive_packet *packets, int count, drive_receiver *receiver, drive_motors *motors, Trajectory *trajectory, CommandSchedule *schedule);
+void ProcessMessage(const drive_packet &packet, drive_receiver *receiver, drive_motors *motors, Trajectory *trajectory);
+bool IsImmediateCommand(int16_t command);
+bool IsTrajectoryCommand(int16_t command);
+bool IsActuatingCommand(int16_t command);
+bool IsScheduledCommand(const drive_packet &packet);
+void SendLatencyTelemetry(int socket_udp, const drive_receiver &receiver);
+
+SchedulePushResult ScheduleCommand(const drive_packet &packet, drive_receiver *receiver, CommandSchedule *schedule);
+void QueueAck(drive_receiver *receiver, const drive_packet &packet, AckStatus status);
+void SendAcks(int socket_udp, drive_receiver *receiver);
+void RunScheduledCommands(CommandSchedule *schedule, drive_receiver *receiver, drive_motors *motors, Trajectory *trajectory, LatencyHistogram *jitter);
+void SendTimeSyncEcho(int socket_udp, drive_receiver *receiver);
+
+bool IsActuatorEchoDue(const drive_motors &motors);
+void SendActuatorEcho(int socket_udp, const drive_receiver &receiver, drive_motors *motors);
+
+void TrajectoryTick(drive_motors *motors, Trajectory *trajectory, bool *finished);
+void StopTrajectory(drive_motors *motors, Trajectory *trajectory);
+void SendTrajectoryReport(int socket_udp, const drive_receiver &receiver, const drive_motors &motors, const Trajectory &trajectory);
+
+void ApplySpeed(drive_motors *motors);
+void SafetyTick(drive_motors *motors);
+bool LimitForward(drive_motors *motors, int16_t command, int32_t speed[2]);
+void RecordIntervention(drive_motors *motors, int16_t command, int requested, int applied);
+void SendSafetyIntervention(int socket_udp, const drive_receiver &receiver, drive_motors *motors);
 
 void InitMotor(large_motor *m);
-void StopMotors(large_motor *left, large_motor *right);
+void InitMotorAttributes(drive_motors *motors);
+void CloseMotorAttributes(drive_motors *motors);
+void ReadMotorPositions(const drive_motors &motors, int32_t position[2]);
+void StopMotors(MotorCommandCache *left, MotorCommandCache *right);
 
-int RecvDrivePacket(int socket_udp, drive_packet *packet);
-void DecodeDrivePacket(drive_packet *packet, const char *data);
+int InitTimer();
+void ArmTimer(int timer_fd, int period_ms);
+void ArmTimerAt(int timer_fd, uint64_t timestamp_us);
+void DisarmTimer(int timer_fd);
+void InitEpoll(int *epoll_fd, const int *fds, int fds_count);
+
+int RecvDrivePackets(int socket_udp, drive_receiver *receiver, drive_packet *packets, bool *more);
+void DecodeDrivePacket(drive_packet *packet, const char *data, int length);
+int EncodeTrajectoryReport(const trajectory_report &report, char *buffer);
+int EncodeTimeSyncEcho(const time_sync_echo &echo, char *buffer);
+int EncodeCommandAck(const command_ack &ack, char *buffer);
+int EncodeActuatorEcho(const actuator_echo &echo, char *buffer);
 
 void Usage();
-void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms);
+void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms, int *stop_mm, int *slow_mm);
 void Finish(int signal);
 
 
 int main(int argc, char **argv)
 {			
-	int socket_udp, port, timeout_ms;
+	int socket_udp, port, timeout_ms, stop_mm, slow_mm;
 	sockaddr_in destination_udp;
 	large_motor motor_left(OUTPUT_A);
 	large_motor motor_right(OUTPUT_D);
+	MotorCommandCache cache_left(&motor_left), cache_right(&motor_right);
+	drive_motors motors;
+	uint64_t start_us;
 	
-	ProcessArguments(argc, argv, &port, &timeout_ms);
+	ProcessArguments(argc, argv, &port, &timeout_ms, &stop_mm, &slow_mm);
+
+	SafetyEnvelope safety(stop_mm, slow_mm);
+	memset(&motors, 0, sizeof(motors));
+	motors.left=&cache_left;
+	motors.right=&cache_right;
+	motors.safety=&safety;
 	SetStandardInputNonBlocking();
 	
 	//init
@@ -83,75 +309,654 @@ int main(int argc, char **argv)
 
 	InitMotor(&motor_left);
 	InitMotor(&motor_right);
+	InitMotorAttributes(&motors);
 		
-	InitNetworkUDP(&socket_udp, &destination_udp, NULL, port, timeout_ms);
+	//the timeout is handled by timerfd in MainLoop
+	InitNetworkUDP(&socket_udp, &destination_udp, NULL, port, 0);
+	NotifyReady();
 
 	//work
-	MainLoop(socket_udp, &motor_left, &motor_right);
+	start_us=TimestampUs();
+	MainLoop(socket_udp, timeout_ms, &motors);
 	
 	//cleanup
-	StopMotors(&motor_left, &motor_right);
+	cache_left.Invalidate(); //stop for real, whatever the cache thinks
+	cache_right.Invalidate();
+	StopMotors(&cache_left, &cache_right);
+	CloseMotorAttributes(&motors);
 	CloseNetworkUDP(socket_udp);
+
+	const MotorCommandCache *caches[]={&cache_left, &cache_right};
+	PrintMotorCacheSummary("ev3drive", caches, 2, start_us);
+	safety.Print("ev3drive");
 		
 	printf("ev3drive: bye\n");
 		
 	return 0;
 }
 
-void MainLoop(int socket_udp, large_motor *left, large_motor *right)
+void MainLoop(int socket_udp, int timeout_ms, drive_motors *motors)
 {
-	int status;
-	drive_packet packet;
-	
+	const int MAX_EVENTS=8;
+	const int REPORT_TICKS=TRAJECTORY_REPORT_MS / TRAJECTORY_TICK_MS;
+	struct epoll_event events[MAX_EVENTS];
+	int status, timer_fd, tick_fd, telemetry_fd, safety_fd, schedule_fd, echo_fd, epoll_fd, n, ticks=0, echo_armed_ms=0;
+	uint64_t expirations, schedule_armed_us=0;
+	bool more, finished, tick_armed=false;
+	drive_packet packets[DRIVE_RECV_BATCH];
+	drive_receiver receiver;
+	Trajectory trajectory;
+	CommandSchedule schedule;
+	SequenceWindow sequences;
+	CommandLatency latency;
+	LatencyHistogram jitter; //scheduled command execution after its time
+
+	memset(&receiver, 0, sizeof(receiver));
+	receiver.session_window_us=(uint64_t)timeout_ms*1000;
+	receiver.latency=&latency;
+	receiver.sequences=&sequences;
+
+	timer_fd=InitTimer();
+	tick_fd=InitTimer();
+	telemetry_fd=InitTimer();
+	safety_fd=InitTimer();
+	schedule_fd=InitTimer();
+	echo_fd=InitTimer();
+	const int fds[]={socket_udp, timer_fd, tick_fd, telemetry_fd, safety_fd, schedule_fd, echo_fd, STDIN_FILENO};
+	InitEpoll(&epoll_fd, fds, sizeof(fds)/sizeof(fds[0]));
+	ArmTimer(timer_fd, timeout_ms);
+	ArmTimer(telemetry_fd, LATENCY_TELEMETRY_MS);
+	if(motors->safety->Enabled())
+		ArmTimer(safety_fd, SAFETY_CHECK_MS);
+
 	while(!g_finish_program)
 	{
-		status=RecvDrivePacket(socket_udp, &packet);
-		if(status < 0)
-			break;
-		if(status == 0) //timeout
+		if( (n=epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) == -1 )
 		{
-			StopMotors(left, right);
-			fprintf(stderr, "ev3drive: waiting for drive controller...\n");
+			if(errno == EINTR)
+				continue; //check g_finish_program
+			DieErrno("ev3drive: epoll_wait failed");
 		}
-		else
-			ProcessMessage(packet, left, right);
 
-		if(IsStandardInputEOF()) //the parent process has closed it's pipe end
-			break;
+		for(int i=0;i<n;++i)
+		{
+			int fd=events[i].data.fd;
+
+			if(fd == timer_fd)
+			{
+				if( read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+					DieErrno("ev3drive: timerfd read failed");
+				StopTrajectory(motors, &trajectory);
+				StopMotors(motors->left, motors->right);
+				motors->speed_running=motors->position_forward=false;
+				schedule.Clear();
+				receiver.has_last=false; //the next controller may have different clock
+				sequences.Reset();
+				latency.ResetOffset();
+				fprintf(stderr, "ev3drive: waiting for drive controller...\n");
+			}
+			else if(fd == socket_udp)
+			{
+				do
+				{
+					status=RecvDrivePackets(socket_udp, &receiver, packets, &more);
+					if(status < 0)
+						goto finish;
+					if(status == 0)
+						continue;
+
+					ArmTimer(timer_fd, timeout_ms);
+					ProcessPackets(packets, status, &receiver, motors, &trajectory, &schedule);
+
+					if(receiver.sync_pending)
+						SendTimeSyncEcho(socket_udp, &receiver);
+					if(receiver.acks_pending)
+						SendAcks(socket_udp, &receiver);
+
+					for(int p=0;p<status;++p)
+						if(IsTrajectoryCommand(packets[p].command))
+						{ //acknowledge the upload with the queue state
+							SendTrajectoryReport(socket_udp, receiver, *motors, trajectory);
+							break;
+						}
+				} while(more);
+			}
+			else if(fd == tick_fd)
+			{
+				if( read(tick_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+					DieErrno("ev3drive: timerfd read failed");
+				if(!tick_armed)
+					continue; //stale expiration
+				TrajectoryTick(motors, &trajectory, &finished);
+				if(finished || ++ticks >= REPORT_TICKS)
+				{
+					SendTrajectoryReport(socket_udp, receiver, *motors, trajectory);
+					ticks=0;
+				}
+			}
+			else if(fd == telemetry_fd)
+			{
+				if( read(telemetry_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+					DieErrno("ev3drive: timerfd read failed");
+				SendLatencyTelemetry(socket_udp, receiver);
+			}
+			else if(fd == safety_fd)
+			{
+				if( read(safety_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+					DieErrno("ev3drive: timerfd read failed");
+				SafetyTick(motors);
+			}
+			else if(fd == schedule_fd)
+			{
+				if( read(schedule_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+					DieErrno("ev3drive: timerfd read failed");
+				RunScheduledCommands(&schedule, &receiver, motors, &trajectory, &jitter);
+				schedule_armed_us=0;
+			}
+			else if(fd == echo_fd)
+			{ //only wakes up the loop, the echo is sent below
+				if( read(echo_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+					DieErrno("ev3drive: timerfd read failed");
+			}
+			else if(fd == STDIN_FILENO)
+			{
+				if(IsStandardInputEOF()) //the parent process has closed it's pipe end
+					goto finish;
+			}
+		}
+
+		if(motors->intervention.pending)
+			SendSafetyIntervention(socket_udp, receiver, motors);
+
+		if(IsActuatorEchoDue(*motors))
+			SendActuatorEcho(socket_udp, receiver, motors);
+
+		if(motors->echo_ms != echo_armed_ms)
+		{
+			motors->echo_ms ? ArmTimer(echo_fd, motors->echo_ms) : DisarmTimer(echo_fd);
+			echo_armed_ms=motors->echo_ms;
+		}
+
+		//one shot timer at the earliest scheduled command
+		if(!schedule.Empty() && schedule.NextUs() != schedule_armed_us)
+		{
+			schedule_armed_us=schedule.NextUs();
+			ArmTimerAt(schedule_fd, schedule_armed_us);
+		}
+
+		//control tick runs only while there is something to execute
+		if(trajectory.Active() && !tick_armed)
+		{
+			ArmTimer(tick_fd, TRAJECTORY_TICK_MS);
+			tick_armed=true;
+			ticks=0;
+		}
+		else if(!trajectory.Active() && tick_armed)
+		{
+			DisarmTimer(tick_fd);
+			tick_armed=false;
+		}
 	}
+finish:
+	close(epoll_fd);
+	close(echo_fd);
+	close(schedule_fd);
+	close(safety_fd);
+	close(telemetry_fd);
+	close(tick_fd);
+	close(timer_fd);
+
+	printf("ev3drive: received %d, coalesced %d, late %d, incomplete %d, rejected segments %d\n", receiver.received, receiver.coalesced, receiver.late, receiver.incomplete, receiver.rejected);
+	printf("ev3drive: scheduled %d, late %d, rejected %d, pending %d\n", receiver.scheduled, receiver.scheduled_late, receiver.scheduled_rejected, schedule.Depth());
+	printf("ev3drive: sequenced %d, duplicates %d\n", receiver.sequenced, receiver.duplicates);
+	latency.Print("ev3drive");
+	jitter.Print("ev3drive", "schedule");
 }
 
-void ProcessMessage(const drive_packet &packet,large_motor *left, large_motor *right)
+// packets are in arrival order, the trajectory and sequenced commands are all applied in order,
+// the scheduled commands are queued and of the other immediate commands only the last one is applied,
+// keepalives are always processed (time sync) and don't count as immediate commands
+void ProcessPackets(const drive_packet *packets, int count, drive_receiver *receiver, drive_motors *motors, Trajectory *trajectory, CommandSchedule *schedule)
+{
+	int last_immediate=-1;
+
+	for(int i=0;i<count;++i)
+		if(IsImmediateCommand(packets[i].command) && !IsScheduledCommand(packets[i]) && !packets[i].sequence)
+			last_immediate=i;
+
+	for(int i=0;i<count;++i)
+	{
+		const drive_packet &packet=packets[i];
+
+		if(packet.sequence)
+		{
+			if(receiver->sequences->Seen(packet.sequence))
+			{
+				++receiver->duplicates;
+				QueueAck(receiver, packet, ACK_DUPLICATE);
+				continue;
+			}
+			++receiver->sequenced;
+		}
+
+		if(IsScheduledCommand(packet))
+		{
+			SchedulePushResult result=ScheduleCommand(packet, receiver, schedule);
+
+			if(packet.sequence && result == SCHEDULE_ACCEPTED)
+				receiver->sequences->Mark(packet.sequence);
+			if(packet.sequence) //dropped may be retransmitted with new execution time
+				QueueAck(receiver, packet, result == SCHEDULE_ACCEPTED ? ACK_SCHEDULED : ACK_DROPPED);
+			continue;
+		}
+		if(IsImmediateCommand(packet.command) && i != last_immediate && !packet.sequence)
+		{
+			++receiver->coalesced;
+			continue;
+		}
+		ProcessMessage(packet, receiver, motors, trajectory);
+
+		if(packet.sequence)
+		{
+			receiver->sequences->Mark(packet.sequence);
+			QueueAck(receiver, packet, ACK_EXECUTED);
+		}
+
+		if(IsActuatingCommand(packet.command))
+			receiver->latency->Actuated(packet.timestamp_us, receiver->received_us, TimestampUs());
+	}
+}
+
+void ProcessMessage(const drive_packet &packet, drive_receiver *receiver, drive_motors *motors, Trajectory *trajectory)
 {	
+	MotorCommandCache *left=motors->left, *right=motors->right;
+
 	if(packet.command == KEEPALIVE)
+	{
+		receiver->sync_pending=true;
+		receiver->sync_timestamp_us=packet.timestamp_us;
 		return;
+	}
+
+	if(packet.command == ACTUATOR_ECHO)
+	{
+		motors->echo_ms=packet.param1 <= 0 ? 0 : packet.param1 < ACTUATOR_ECHO_MIN_MS ? ACTUATOR_ECHO_MIN_MS :
+			packet.param1 > ACTUATOR_ECHO_MAX_MS ? ACTUATOR_ECHO_MAX_MS : packet.param1;
+		return;
+	}
+
+	if(IsActuatingCommand(packet.command))
+		motors->last_command=packet.command;
 		
 	if(packet.command == SET_SPEED)
 	{		
-		int16_t l=packet.param1, r=packet.param2;
-		left->set_speed_sp(l); 
-		right->set_speed_sp(r); 
-		
-		(l!=0) ? left->run_forever() : left->stop(); 
-		(r!=0) ? right->run_forever() : right->stop(); 
+		StopTrajectory(motors, trajectory);
+
+		motors->speed[0]=packet.param1;
+		motors->speed[1]=packet.param2;
+		motors->speed_running=motors->speed[0] != 0 || motors->speed[1] != 0;
+		motors->position_forward=false;
+		ApplySpeed(motors);
 	}
 	else if(packet.command == TO_POSITION_WITH_SPEED)
 	{
-		left->stop();
-		right->stop();
+		StopTrajectory(motors, trajectory);
+
+		left->Stop();
+		right->Stop();
+		motors->speed_running=false;
 		
-		int16_t lspeed=packet.param1, rspeed=packet.param2;
+		int32_t speed[2]={abs(packet.param1), abs(packet.param2)}; //run-to-*-pos ignores the sign
 		int16_t lpos=packet.param3, rpos=packet.param4;
-		left->set_speed_sp(lspeed); 
-		right->set_speed_sp(rspeed); 
-		left->set_position_sp(lpos);
-		right->set_position_sp(rpos);
+
+		//the direction comes from the positions, limit the speed when going forward
+		motors->position_forward=lpos + rpos > 0;
+		if(motors->position_forward && motors->safety->Enabled() && motors->safety->Update(TimestampUs()) != SAFETY_CLEAR)
+		{
+			int requested=(speed[0]+speed[1])/2;
+			int limited=motors->safety->LimitForward(requested);
+
+			if(limited != requested)
+			{
+				RecordIntervention(motors, TO_POSITION_WITH_SPEED, requested, limited);
+				if(limited == 0)
+				{
+					motors->position_forward=false;
+					return;
+				}
+				speed[0]=speed[0]*limited/requested;
+				speed[1]=speed[1]*limited/requested;
+			}
+		}
+
+		if(motors->position_forward)
+		{
+			ReadMotorPositions(*motors, motors->position_target);
+			motors->position_target[0] += lpos;
+			motors->position_target[1] += rpos;
+		}
+
+		left->SetSpeedSp(speed[0]); 
+		right->SetSpeedSp(speed[1]); 
+		left->SetPositionSp(lpos);
+		right->SetPositionSp(rpos);
 	
-		left->run_to_rel_pos();
-		right->run_to_rel_pos();
+		left->RunToRelPos();
+		right->RunToRelPos();
+	}
+	else if(packet.command == TRAJECTORY_CLEAR)
+	{
+		StopTrajectory(motors, trajectory);
+		StopMotors(left, right);
+		motors->speed_running=motors->position_forward=false;
+	}
+	else if(packet.command == TRAJECTORY_ADD_VELOCITY || packet.command == TRAJECTORY_ADD_WAYPOINT)
+	{
+		trajectory_segment segment;
+		segment.index=packet.param1;
+		segment.type= packet.command == TRAJECTORY_ADD_VELOCITY ? TRAJECTORY_VELOCITY : TRAJECTORY_WAYPOINT;
+		segment.left=packet.param2;
+		segment.right=packet.param3;
+		segment.param=packet.param4;
+
+		if(trajectory->Push(segment) == TRAJECTORY_REJECTED)
+			++receiver->rejected;
+	}
+}
+
+// the commands superseded by newer one from the same batch, KEEPALIVE is not one of them
+bool IsImmediateCommand(int16_t command)
+{
+	return command == SET_SPEED || command == TO_POSITION_WITH_SPEED;
+}
+
+bool IsTrajectoryCommand(int16_t command)
+{
+	return command == TRAJECTORY_CLEAR || command == TRAJECTORY_ADD_VELOCITY || command == TRAJECTORY_ADD_WAYPOINT;
+}
+
+bool IsActuatingCommand(int16_t command)
+{
+	return command == SET_SPEED || command == TO_POSITION_WITH_SPEED || command == TRAJECTORY_CLEAR;
+}
+
+bool IsScheduledCommand(const drive_packet &packet)
+{
+	return packet.execute_at_us != 0 && IsActuatingCommand(packet.command);
+}
+
+SchedulePushResult ScheduleCommand(const drive_packet &packet, drive_receiver *receiver, CommandSchedule *schedule)
+{
+	scheduled_command command;
+
+	command.execute_us=packet.execute_at_us + receiver->latency->OffsetUs();
+	command.timestamp_us=packet.timestamp_us;
+	command.command=packet.command;
+	command.param[0]=packet.param1;
+	command.param[1]=packet.param2;
+	command.param[2]=packet.param3;
+	command.param[3]=packet.param4;
+
+	SchedulePushResult result=schedule->Push(command, TimestampUs());
+
+	if(result == SCHEDULE_ACCEPTED)
+		++receiver->scheduled;
+	else if(result == SCHEDULE_LATE)
+		++receiver->scheduled_late;
+	else
+		++receiver->scheduled_rejected;
+
+	return result;
+}
+
+void QueueAck(drive_receiver *receiver, const drive_packet &packet, AckStatus status)
+{
+	command_ack *ack=receiver->acks + receiver->acks_pending++; //at most one per packet of the batch
+
+	ack->timestamp_us=packet.timestamp_us;
+	ack->sequence=packet.sequence;
+	ack->command=packet.command;
+	ack->status=status;
+}
+
+void SendAcks(int socket_udp, drive_receiver *receiver)
+{
+	static char buffer[COMMAND_ACK_BYTES];
+
+	for(int i=0;i<receiver->acks_pending;++i)
+		SendToUDP(socket_udp, receiver->controller, buffer, EncodeCommandAck(receiver->acks[i], buffer));
+
+	receiver->acks_pending=0;
+}
+
+void RunScheduledCommands(CommandSchedule *schedule, drive_receiver *receiver, drive_motors *motors, Trajectory *trajectory, LatencyHistogram *jitter)
+{
+	scheduled_command command;
+	drive_packet packet;
+	uint64_t now_us;
+
+	while(schedule->PopDue(now_us=TimestampUs(), &command))
+	{
+		packet.timestamp_us=command.timestamp_us;
+		packet.command=command.command;
+		packet.param1=command.param[0];
+		packet.param2=command.param[1];
+		packet.param3=command.param[2];
+		packet.param4=command.param[3];
+		packet.execute_at_us=0;
+
+		ProcessMessage(packet, receiver, motors, trajectory);
+		jitter->Add((int64_t)(now_us - command.execute_us));
 	}
 }
 
+void SendTimeSyncEcho(int socket_udp, drive_receiver *receiver)
+{
+	static char buffer[TIME_SYNC_BYTES];
+	time_sync_echo echo;
+
+	receiver->sync_pending=false;
+
+	echo.timestamp_us=receiver->sync_timestamp_us;
+	echo.received_us=receiver->received_us;
+	echo.offset_us=receiver->latency->OffsetUs();
+	echo.sent_us=TimestampUs();
+
+	SendToUDP(socket_udp, receiver->controller, buffer, EncodeTimeSyncEcho(echo, buffer));
+}
+
+void TrajectoryTick(drive_motors *motors, Trajectory *trajectory, bool *finished)
+{
+	int32_t position[2], speed[2];
+
+	ReadMotorPositions(*motors, position);
+	*finished=trajectory->Tick(TimestampUs(), position, speed);
+
+	if(!trajectory->Active())
+	{
+		StopMotors(motors->left, motors->right);
+		motors->trajectory_running=false;
+		return;
+	}
+
+	int16_t command=trajectory->ExecutingType() == TRAJECTORY_VELOCITY ? TRAJECTORY_ADD_VELOCITY : TRAJECTORY_ADD_WAYPOINT;
+	motors->last_command=command;
+
+	if(motors->safety->Enabled())
+	{
+		//stopped trajectory would try to catch up with the plan when the way clears, abort it instead
+		if(LimitForward(motors, command, speed) && motors->safety->Zone() == SAFETY_STOP)
+		{
+			StopTrajectory(motors, trajectory);
+			*finished=true;
+			return;
+		}
+	}
+
+	motors->left->SetSpeedSp(speed[0]);
+	motors->right->SetSpeedSp(speed[1]);
+
+	if(!motors->trajectory_running)
+	{ //speed_sp changes take effect immediately in run-forever mode
+		motors->left->RunForever();
+		motors->right->RunForever();
+		motors->trajectory_running=true;
+		motors->speed_running=motors->position_forward=false;
+	}
+}
+
+void StopTrajectory(drive_motors *motors, Trajectory *trajectory)
+{
+	if(motors->trajectory_running)
+		StopMotors(motors->left, motors->right);
+	motors->trajectory_running=false;
+	trajectory->Clear();
+}
+
+void SendTrajectoryReport(int socket_udp, const drive_receiver &receiver, const drive_motors &motors, const Trajectory &trajectory)
+{
+	static char buffer[TRAJECTORY_REPORT_BYTES];
+	trajectory_report report;
+
+	if(!receiver.has_controller)
+		return;
+
+	report.timestamp_us=TimestampUs();
+	report.executing_index=trajectory.ExecutingIndex();
+	report.next_index=trajectory.NextIndex();
+	report.depth=trajectory.Depth();
+	report.progress_permille=trajectory.ProgressPermille();
+	ReadMotorPositions(motors, report.position);
+
+	SendToUDP(socket_udp, receiver.controller, buffer, EncodeTrajectoryReport(report, buffer));
+}
+
+// sets the SET_SPEED speeds limited by the safety envelope
+void ApplySpeed(drive_motors *motors)
+{
+	int32_t speed[2]={motors->speed[0], motors->speed[1]};
+
+	if(motors->safety->Enabled())
+		LimitForward(motors, SET_SPEED, speed);
+
+	motors->left->SetSpeedSp(speed[0]);
+	motors->right->SetSpeedSp(speed[1]);
+
+	(speed[0]!=0) ? motors->left->RunForever() : motors->left->Stop();
+	(speed[1]!=0) ? motors->right->RunForever() : motors->right->Stop();
+}
+
+// between the commands the obstacles may come closer (trajectory checks on its own tick)
+void SafetyTick(drive_motors *motors)
+{
+	int32_t position[2];
+
+	if(motors->speed_running)
+		ApplySpeed(motors); //unchanged setpoints are skipped by the cache
+	else if(motors->position_forward && motors->safety->Update(TimestampUs()) == SAFETY_STOP)
+	{
+		ReadMotorPositions(*motors, position);
+		int remaining=(motors->position_target[0]-position[0] + motors->position_target[1]-position[1])/2;
+
+		if(remaining > TRAJECTORY_POSITION_TOLERANCE)
+		{
+			StopMotors(motors->left, motors->right);
+			RecordIntervention(motors, TO_POSITION_WITH_SPEED, remaining, 0);
+		}
+		motors->position_forward=false;
+	}
+}
+
+// limits the forward component of wheel speeds, rotation is kept
+// returns true if the speeds were limited
+bool LimitForward(drive_motors *motors, int16_t command, int32_t speed[2])
+{
+	int forward=(speed[0]+speed[1])/2;
+
+	if(motors->safety->Update(TimestampUs()) == SAFETY_CLEAR || forward <= 0)
+		return false;
+
+	int limited=motors->safety->LimitForward(forward);
+	if(limited == forward)
+		return false;
+
+	speed[0] -= forward-limited;
+	speed[1] -= forward-limited;
+	RecordIntervention(motors, command, forward, limited);
+	return true;
+}
+
+void RecordIntervention(drive_motors *motors, int16_t command, int requested, int applied)
+{
+	if(!motors->safety->Intervene(TimestampUs()))
+		return;
+
+	motors->intervention.pending=true;
+	motors->intervention.command=command;
+	motors->intervention.requested=requested;
+	motors->intervention.applied=applied;
+}
+
+void SendSafetyIntervention(int socket_udp, const drive_receiver &receiver, drive_motors *motors)
+{
+	static char buffer[SAFETY_INTERVENTION_BYTES];
+	const safety_intervention &i=motors->intervention;
+
+	motors->intervention.pending=false;
+
+	if(!receiver.has_controller)
+		return;
+
+	SendToUDP(socket_udp, receiver.controller, buffer, motors->safety->EncodeIntervention(buffer, i.command, i.requested, i.applied));
+}
+
+bool IsActuatorEchoDue(const drive_motors &motors)
+{
+	return motors.echo_ms && TimestampUs() - motors.echo_us + ACTUATOR_ECHO_SLACK_US >= (uint64_t)motors.echo_ms*1000;
+}
+
+// samples the setpoints and the measured motor state together
+void SendActuatorEcho(int socket_udp, const drive_receiver &receiver, drive_motors *motors)
+{
+	static char buffer[ACTUATOR_ECHO_BYTES];
+	const MotorCommandCache *caches[2]={motors->left, motors->right};
+	actuator_echo echo;
+	int position, speed, duty_cycle, state;
+
+	motors->echo_us=echo.timestamp_us=TimestampUs();
+	echo.command=motors->last_command;
+
+	for(int m=0;m<2;++m)
+	{
+		if( ReadSysfsInt(motors->position_fd[m], &position) == -1 || ReadSysfsInt(motors->speed_fd[m], &speed) == -1
+		|| ReadSysfsInt(motors->duty_cycle_fd[m], &duty_cycle) == -1 || ReadSysfsMotorState(motors->state_fd[m], &state) == -1)
+			DieErrno("ev3drive: read motor attributes failed");
+
+		echo.motor[m].speed_sp=caches[m]->SpeedSp();
+		echo.motor[m].position_sp=caches[m]->PositionSp();
+		echo.motor[m].duty_cycle_sp=caches[m]->DutyCycleSp();
+		echo.motor[m].state=state;
+		echo.motor[m].speed=speed;
+		echo.motor[m].position=position;
+		echo.motor[m].duty_cycle=duty_cycle;
+	}
+
+	if(!receiver.has_controller)
+		return;
+
+	SendToUDP(socket_udp, receiver.controller, buffer, EncodeActuatorEcho(echo, buffer));
+}
+
+void SendLatencyTelemetry(int socket_udp, const drive_receiver &receiver)
+{
+	static char buffer[LATENCY_TELEMETRY_BYTES];
+
+	if(!receiver.has_controller)
+		return;
+
+	SendToUDP(socket_udp, receiver.controller, buffer, receiver.latency->EncodeTelemetry(buffer));
+}
+
 void InitMotor(large_motor *m)
 {
 	if(!m->connected())
@@ -159,37 +964,184 @@ void InitMotor(large_motor *m)
 	m->set_stop_action(m->stop_action_coast);
 }
 
-void StopMotors(large_motor *left, large_motor *right)
+void InitMotorAttributes(drive_motors *motors)
+{
+	const MotorCommandCache *caches[2]={motors->left, motors->right};
+
+	for(int m=0;m<2;++m)
+	{
+		int index=caches[m]->Motor()->device_index();
+		motors->position_fd[m]=OpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, index, "position", O_RDONLY);
+		motors->speed_fd[m]=OpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, index, "speed", O_RDONLY);
+		motors->duty_cycle_fd[m]=OpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, index, "duty_cycle", O_RDONLY);
+		motors->state_fd[m]=OpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, index, "state", O_RDONLY);
+	}
+}
+
+void CloseMotorAttributes(drive_motors *motors)
 {
-	left->stop();
-	right->stop();	
+	for(int m=0;m<2;++m)
+	{
+		close(motors->position_fd[m]);
+		close(motors->speed_fd[m]);
+		close(motors->duty_cycle_fd[m]);
+		close(motors->state_fd[m]);
+	}
 }
 
+void ReadMotorPositions(const drive_motors &motors, int32_t position[2])
+{
+	int value;
+	for(int e=0;e<2;++e)
+	{
+		if( ReadSysfsInt(motors.position_fd[e], &value) == -1 )
+			DieErrno("ev3drive: read motor position failed");
+		position[e]=value;
+	}
+}
 
-// returns CONTROL_PACKET_BYTES on success  0 on timeout, -1 on error
-int RecvDrivePacket(int socket_udp, drive_packet *packet)
+void StopMotors(MotorCommandCache *left, MotorCommandCache *right)
 {
-	static char buffer[CONTROL_PACKET_BYTES];	
-	int recv_len;
-	
-	if((recv_len = recvfrom(socket_udp, buffer, CONTROL_PACKET_BYTES, 0, NULL, NULL)) == -1)	
+	left->Stop();
+	right->Stop();	
+}
+
+
+int InitTimer()
+{
+	int timer_fd;
+	if( (timer_fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1 )
+		DieErrno("ev3drive: timerfd_create failed");
+	return timer_fd;
+}
+
+// (re)starts the countdown, after expiry it fires every period_ms
+void ArmTimer(int timer_fd, int period_ms)
+{
+	struct itimerspec its;
+	its.it_value.tv_sec=period_ms / 1000;
+	its.it_value.tv_nsec=(period_ms % 1000) * 1000000L;
+	its.it_interval=its.it_value;
+
+	if( timerfd_settime(timer_fd, 0, &its, NULL) == -1 )
+		DieErrno("ev3drive: timerfd_settime failed");
+}
+
+// one shot at the local clock (TimestampUs) time
+void ArmTimerAt(int timer_fd, uint64_t timestamp_us)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec=timestamp_us / 1000000;
+	its.it_value.tv_nsec=(timestamp_us % 1000000) * 1000L;
+
+	if( timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1 )
+		DieErrno("ev3drive: timerfd_settime failed");
+}
+
+void DisarmTimer(int timer_fd)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+
+	if( timerfd_settime(timer_fd, 0, &its, NULL) == -1 )
+		DieErrno("ev3drive: timerfd_settime failed");
+}
+
+void InitEpoll(int *epoll_fd, const int *fds, int fds_count)
+{
+	struct epoll_event event;
+
+	if( (*epoll_fd=epoll_create1(EPOLL_CLOEXEC)) == -1 )
+		DieErrno("ev3drive: epoll_create1 failed");
+
+	for(int i=0;i<fds_count;++i)
+	{
+		memset(&event, 0, sizeof(event));
+		event.events=EPOLLIN;
+		event.data.fd=fds[i];
+		if( epoll_ctl(*epoll_fd, EPOLL_CTL_ADD, fds[i], &event) == -1 )
+			DieErrno("ev3drive: epoll_ctl failed");
+	}
+}
+
+// receives up to DRIVE_RECV_BATCH queued datagrams, drops incomplete and late ones
+// more is set if there may be more datagrams queued
+// returns the number of packets, -1 on error
+int RecvDrivePackets(int socket_udp, drive_receiver *receiver, drive_packet *packets, bool *more)
+{
+	static char buffers[DRIVE_RECV_BATCH][SEQUENCED_PACKET_BYTES];
+	static sockaddr_in addresses[DRIVE_RECV_BATCH];
+	static struct mmsghdr msgs[DRIVE_RECV_BATCH];
+	static struct iovec iovecs[DRIVE_RECV_BATCH];
+	int received, accepted=0;
+
+	*more=false;
+
+	for(int i=0;i<DRIVE_RECV_BATCH;++i)
+	{
+		iovecs[i].iov_base=buffers[i];
+		iovecs[i].iov_len=SEQUENCED_PACKET_BYTES;
+		memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_iov=iovecs+i;
+		msgs[i].msg_hdr.msg_iovlen=1;
+		msgs[i].msg_hdr.msg_name=addresses+i;
+		msgs[i].msg_hdr.msg_namelen=sizeof(addresses[i]);
+	}
+
+	while( (received=recvmmsg(socket_udp, msgs, DRIVE_RECV_BATCH, MSG_DONTWAIT, NULL)) == -1 )
 	{
-		if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINPROGRESS)
-			return 0; //timeout!
-		perror("ev3drive: error while receiving control packet");
-		return -1;
+		if(errno==EAGAIN || errno==EWOULDBLOCK)
+			return 0; //drained
+		if(errno!=EINTR)
+		{
+			perror("ev3drive: error while receiving control packets");
+			return -1;
+		}
 	}
-	if(recv_len < CONTROL_PACKET_BYTES)
+
+	receiver->received_us=TimestampUs();
+
+	for(int i=0;i<received;++i)
 	{
-		fprintf(stderr, "ev3drive: received incomplete datagram\n");
-		return -1; 
+		drive_packet *packet=packets+accepted;
+		++receiver->received;
+
+		if(msgs[i].msg_len < (unsigned)CONTROL_PACKET_BYTES)
+		{
+			fprintf(stderr, "ev3drive: received incomplete datagram\n");
+			++receiver->incomplete;
+			continue;
+		}
+
+		DecodeDrivePacket(packet, buffers[i], msgs[i].msg_len);
+
+		bool older=receiver->has_last && packet->timestamp_us <= receiver->last_timestamp_us;
+
+		if(older && receiver->last_timestamp_us - packet->timestamp_us >= receiver->session_window_us)
+			receiver->sequences->Reset(); //sender restart
+		else if(older && !packet->sequence) //sequenced are ordered by the window
+		{
+			++receiver->late;
+			continue;
+		}
+
+		if(!older || !packet->sequence)
+			receiver->last_timestamp_us=packet->timestamp_us;
+		receiver->has_last=true;
+		receiver->controller=addresses[i];
+		receiver->has_controller=true;
+		receiver->latency->Received(packet->timestamp_us, receiver->received_us);
+		++accepted;
 	}
-	DecodeDrivePacket(packet, buffer);	
 
-	return recv_len;	       
+	*more = received == DRIVE_RECV_BATCH;
+
+	return accepted;
 }
  
-void DecodeDrivePacket(drive_packet *packet, const char *data)
+// length is CONTROL_PACKET_BYTES or more, execute_at_us and sequence are decoded if present
+void DecodeDrivePacket(drive_packet *packet, const char *data, int length)
 {
 	packet->timestamp_us=be64toh(*((uint64_t*)data));
 	packet->command=be16toh(*((int16_t*)(data+8)));
@@ -197,17 +1149,95 @@ void DecodeDrivePacket(drive_packet *packet, const char *data)
 	packet->param2=be16toh(*((int16_t*)(data+12)));	
 	packet->param3=be16toh(*((int16_t*)(data+14)));
 	packet->param4=be16toh(*((int16_t*)(data+16)));
+	packet->execute_at_us= length >= SCHEDULED_PACKET_BYTES ? be64toh(*((uint64_t*)(data+18))) : 0;
+	packet->sequence= length >= SEQUENCED_PACKET_BYTES ? be32toh(*((uint32_t*)(data+26))) : 0;
+}
+
+int EncodeTrajectoryReport(const trajectory_report &report, char *buffer)
+{
+	size_t offset=0;
+
+	*((uint64_t*)buffer)=htobe64(report.timestamp_us);
+	offset += sizeof(report.timestamp_us);
+	*((int16_t*)(buffer+offset))=htobe16(report.executing_index);
+	offset += sizeof(report.executing_index);
+	*((int16_t*)(buffer+offset))=htobe16(report.next_index);
+	offset += sizeof(report.next_index);
+	*((int16_t*)(buffer+offset))=htobe16(report.depth);
+	offset += sizeof(report.depth);
+	*((int16_t*)(buffer+offset))=htobe16(report.progress_permille);
+	offset += sizeof(report.progress_permille);
+	*((int32_t*)(buffer+offset))=htobe32(report.position[0]);
+	offset += sizeof(report.position[0]);
+	*((int32_t*)(buffer+offset))=htobe32(report.position[1]);
+	offset += sizeof(report.position[1]);
+
+	return offset;
+}
+
+int EncodeTimeSyncEcho(const time_sync_echo &echo, char *buffer)
+{
+	*((uint64_t*)buffer)=htobe64(echo.timestamp_us);
+	*((uint64_t*)(buffer+8))=htobe64(echo.received_us);
+	*((uint64_t*)(buffer+16))=htobe64(echo.sent_us);
+	*((int64_t*)(buffer+24))=htobe64(echo.offset_us);
+
+	return TIME_SYNC_BYTES;
+}
+
+int EncodeActuatorEcho(const actuator_echo &echo, char *buffer)
+{
+	size_t offset=0;
+
+	*((uint64_t*)buffer)=htobe64(echo.timestamp_us);
+	offset += sizeof(echo.timestamp_us);
+	*((int16_t*)(buffer+offset))=htobe16(echo.command);
+	offset += sizeof(echo.command);
+
+	for(int m=0;m<2;++m)
+	{
+		const motor_echo &e=echo.motor[m];
+		*((int32_t*)(buffer+offset))=htobe32(e.speed_sp);
+		offset += sizeof(e.speed_sp);
+		*((int32_t*)(buffer+offset))=htobe32(e.position_sp);
+		offset += sizeof(e.position_sp);
+		*((int16_t*)(buffer+offset))=htobe16(e.duty_cycle_sp);
+		offset += sizeof(e.duty_cycle_sp);
+		*((int16_t*)(buffer+offset))=htobe16(e.state);
+		offset += sizeof(e.state);
+		*((int32_t*)(buffer+offset))=htobe32(e.speed);
+		offset += sizeof(e.speed);
+		*((int32_t*)(buffer+offset))=htobe32(e.position);
+		offset += sizeof(e.position);
+		*((int16_t*)(buffer+offset))=htobe16(e.duty_cycle);
+		offset += sizeof(e.duty_cycle);
+	}
+
+	return offset;
+}
+
+int EncodeCommandAck(const command_ack &ack, char *buffer)
+{
+	*((uint64_t*)buffer)=htobe64(ack.timestamp_us);
+	*((uint32_t*)(buffer+8))=htobe32(ack.sequence);
+	*((int16_t*)(buffer+12))=htobe16(ack.command);
+	*((int16_t*)(buffer+14))=htobe16(ack.status);
+
+	return COMMAND_ACK_BYTES;
 }
 
 void Usage()
 {
-	printf("ev3drive udp_port timeout_ms\n\n");
+	printf("ev3drive udp_port timeout_ms [stop_mm slow_mm]\n\n");
+	printf("stop_mm, slow_mm - safety envelope, forward speed is zeroed at stop_mm\n");
+	printf("and limited below slow_mm from the nearest obstacle ahead (needs ev3laser publishing obstacles)\n\n");
 	printf("examples:\n");
 	printf("./ev3drive 8003 500\n");
+	printf("./ev3drive 8003 500 250 600\n");
 }
-void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms)
+void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms, int *stop_mm, int *slow_mm)
 {
-	if(argc!=3)
+	if(argc!=3 && argc!=5)
 	{
 		Usage();
 		exit(EXIT_SUCCESS);		
@@ -232,6 +1262,18 @@ void ProcessArguments(int argc, char **argv, int *port, int *timeout_ms)
 	}
 	
 	*timeout_ms=temp;
+
+	*stop_mm=*slow_mm=0;
+	if(argc==5)
+	{
+		*stop_mm=strtol(argv[3], NULL, 0);
+		*slow_mm=strtol(argv[4], NULL, 0);
+		if(*stop_mm <= 0 || *slow_mm < *stop_mm || *slow_mm >= OBSTACLE_NONE)
+		{
+			fprintf(stderr, "ev3drive: the arguments have to satisfy 0 < stop_mm <= slow_mm < %d\n", OBSTACLE_NONE);
+			exit(EXIT_SUCCESS);
+		}
+	}
 }
 void Finish(int signal)
 {
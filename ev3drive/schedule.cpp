@@ -0,0 +1,58 @@
+/*
+ * ev3drive command schedule implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "schedule.h"
+
+CommandSchedule::CommandSchedule()
+{
+	Clear();
+}
+
+void CommandSchedule::Clear()
+{
+	count=0;
+}
+
+SchedulePushResult CommandSchedule::Push(const scheduled_command &command, uint64_t now_us)
+{
+	int64_t ahead_us=(int64_t)(command.execute_us - now_us);
+
+	if(ahead_us < -(int64_t)SCHEDULE_LATE_TOLERANCE_MS*1000)
+		return SCHEDULE_LATE;
+	if(ahead_us > (int64_t)SCHEDULE_MAX_AHEAD_MS*1000 || count == SCHEDULE_MAX_COMMANDS)
+		return SCHEDULE_REJECTED;
+
+	//insertion from the back, the queue is tiny and usually appended
+	int i=count;
+	for(;i>0 && commands[i-1].execute_us > command.execute_us;--i)
+		commands[i]=commands[i-1];
+
+	commands[i]=command;
+	++count;
+
+	return SCHEDULE_ACCEPTED;
+}
+
+bool CommandSchedule::PopDue(uint64_t now_us, scheduled_command *command)
+{
+	if(count == 0 || commands[0].execute_us > now_us)
+		return false;
+
+	*command=commands[0];
+	--count;
+	for(int i=0;i<count;++i)
+		commands[i]=commands[i+1];
+
+	return true;
+}
@@ -0,0 +1,67 @@
+/*
+ * ev3drive command schedule header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * CommandSchedule is the small time-ordered queue of "execute at" commands.
+ *
+ * The controller stamps a command with the execution time in its own clock,
+ * ev3drive maps it to the local clock with the offset estimated from the received
+ * commands and keepalives (see shared/latency.h ClockOffset) and holds it until then.
+ * Commands are kept sorted by local execution time, equal times keep arrival order.
+ *
+ * The offset includes the minimum transit time, so commands execute at
+ * execute_at + minimum transit in the controller clock - constant, not jittery.
+ */
+
+#pragma once
+
+#include <stdint.h> //int16_t, uint64_t
+
+/*
+ * Those constants can be tuned
+ */
+const int SCHEDULE_MAX_COMMANDS=16;
+const int SCHEDULE_LATE_TOLERANCE_MS=2; //later than that is dropped
+const int SCHEDULE_MAX_AHEAD_MS=10000; //further is rejected (wrong clock)
+
+struct scheduled_command
+{
+	uint64_t execute_us; //local clock
+	uint64_t timestamp_us; //sender clock
+	int16_t command;
+	int16_t param[4];
+};
+
+enum SchedulePushResult {SCHEDULE_ACCEPTED=0, SCHEDULE_LATE=1, SCHEDULE_REJECTED=-1};
+
+class CommandSchedule
+{
+public:
+	CommandSchedule();
+
+	void Clear();
+
+	SchedulePushResult Push(const scheduled_command &command, uint64_t now_us);
+
+	// takes the earliest command if it is due
+	bool PopDue(uint64_t now_us, scheduled_command *command);
+
+	bool Empty() const { return count == 0; }
+	int Depth() const { return count; }
+	// local execution time of the earliest command, undefined if empty
+	uint64_t NextUs() const { return commands[0].execute_us; }
+private:
+	scheduled_command commands[SCHEDULE_MAX_COMMANDS]; //sorted, earliest first
+	int count;
+};
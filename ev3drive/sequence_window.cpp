@@ -0,0 +1,64 @@
+/*
+ * ev3drive sequence window implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "sequence_window.h"
+
+SequenceWindow::SequenceWindow()
+{
+	Reset();
+}
+
+void SequenceWindow::Reset()
+{
+	highest=0;
+	bitmap=0;
+	empty=true;
+}
+
+bool SequenceWindow::Seen(uint32_t sequence) const
+{
+	if(empty)
+		return false;
+
+	int32_t behind=(int32_t)(highest - sequence);
+
+	if(behind < 0)
+		return false;
+	if(behind >= SEQUENCE_WINDOW_SIZE)
+		return true;
+
+	return (bitmap >> behind) & 1;
+}
+
+void SequenceWindow::Mark(uint32_t sequence)
+{
+	if(empty)
+	{
+		highest=sequence;
+		bitmap=1;
+		empty=false;
+		return;
+	}
+
+	int32_t ahead=(int32_t)(sequence - highest);
+
+	if(ahead > 0)
+	{
+		bitmap = ahead >= SEQUENCE_WINDOW_SIZE ? 0 : bitmap << ahead;
+		bitmap |= 1;
+		highest=sequence;
+	}
+	else if(-ahead < SEQUENCE_WINDOW_SIZE)
+		bitmap |= (uint64_t)1 << -ahead;
+}
@@ -0,0 +1,44 @@
+/*
+ * ev3drive sequence window header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * SequenceWindow remembers which command sequence numbers were already executed
+ * so that retransmissions are not executed twice.
+ *
+ * The highest sequence number and a bitmap of SEQUENCE_WINDOW_SIZE numbers below it are kept
+ * (the anti-replay window of IPsec). Sequence numbers wrap (uint32 serial arithmetic),
+ * numbers older than the window are treated as already seen.
+ */
+
+#pragma once
+
+#include <stdint.h> //uint32_t, uint64_t
+
+const int SEQUENCE_WINDOW_SIZE=64;
+
+class SequenceWindow
+{
+public:
+	SequenceWindow();
+
+	// forgets everything (the sender restarted)
+	void Reset();
+
+	bool Seen(uint32_t sequence) const;
+	void Mark(uint32_t sequence);
+private:
+	uint32_t highest;
+	uint64_t bitmap; //bit n - highest-n was seen
+	bool empty;
+};
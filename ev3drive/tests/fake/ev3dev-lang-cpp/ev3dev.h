@@ -0,0 +1,51 @@
+/*
+ * ev3dev-mapping fake ev3dev-lang-cpp motor for the benchmarks
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Shadows ev3dev-lang-cpp/ev3dev.h (first on the include path) with the part of motor
+ * used by shared/motor_cache.h. Instead of writing sysfs attributes the motor counts
+ * the writes and remembers the state they would leave the motor in.
+ */
+
+#pragma once
+
+#include <string> //std::string
+
+namespace ev3dev
+{
+
+class motor
+{
+public:
+	motor(): writes(0), speed_sp(0), position_sp(0), duty_cycle_sp(0), command("stop"), rel_pos_runs(0) {}
+
+	motor &set_speed_sp(int v) { ++writes; speed_sp=v; return *this; }
+	motor &set_position_sp(int v) { ++writes; position_sp=v; return *this; }
+	motor &set_duty_cycle_sp(int v) { ++writes; duty_cycle_sp=v; return *this; }
+
+	void run_forever() { Command("run-forever"); }
+	void run_to_abs_pos() { Command("run-to-abs-pos"); }
+	void run_to_rel_pos() { Command("run-to-rel-pos"); ++rel_pos_runs; }
+	void run_direct() { Command("run-direct"); }
+	void stop() { Command("stop"); }
+
+	int writes; //sysfs attribute writes the real motor would do
+	int speed_sp, position_sp, duty_cycle_sp;
+	std::string command;
+	int rel_pos_runs;
+private:
+	void Command(const char *c) { ++writes; command=c; }
+};
+
+}
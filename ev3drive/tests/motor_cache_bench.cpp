@@ -0,0 +1,142 @@
+/*
+ * ev3dev-mapping MotorCommandCache benchmark
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Measures MotorCommandCache (see shared/motor_cache.h) as used by ev3drive:
+ * -the sysfs writes per second with and without the cache for KEEPALIVE/SET_SPEED
+ *  packet mix at different packet rates, operator changing the speeds BENCH_OPERATOR_HZ
+ * -CPU cost of the cache per SET_SPEED packet
+ *
+ * The motors are fake (tests/fake/ev3dev-lang-cpp/ev3dev.h) and count the writes.
+ * Fails (exit status) if the cached motors end up in different state than
+ * the motors written directly or the cache writes more.
+ *
+ * Run it on the EV3 for the CPU numbers that matter, the sysfs writes are not included.
+ */
+
+#include "shared/misc.h"
+#include "shared/motor_cache.h"
+
+#include <stdio.h> //printf
+#include <stdlib.h> //EXIT_SUCCESS, EXIT_FAILURE
+
+const int BENCH_SECONDS=60; //simulated
+const int BENCH_OPERATOR_HZ=5; //speed changes per second
+const int BENCH_KEEPALIVE_EVERY=4; //every n-th packet is KEEPALIVE
+const int BENCH_PACKETS=1000000;
+
+//left and right speeds the operator steps through, stops included
+const int BENCH_SPEEDS[][2]={ {0, 0}, {200, 200}, {400, 400}, {400, 300}, {400, 400}, {-200, -200}, {0, 0}, {300, -300} };
+const int BENCH_SPEED_STEPS=sizeof(BENCH_SPEEDS)/sizeof(BENCH_SPEEDS[0]);
+
+// as ev3drive ApplySpeed with safety envelope disabled
+void ApplySpeed(MotorCommandCache *left, MotorCommandCache *right, const int *speed)
+{
+	left->SetSpeedSp(speed[0]);
+	right->SetSpeedSp(speed[1]);
+
+	(speed[0]!=0) ? left->RunForever() : left->Stop();
+	(speed[1]!=0) ? right->RunForever() : right->Stop();
+}
+
+// what ev3drive did before the cache
+void ApplySpeedDirect(ev3dev::motor *left, ev3dev::motor *right, const int *speed)
+{
+	left->set_speed_sp(speed[0]);
+	right->set_speed_sp(speed[1]);
+
+	(speed[0]!=0) ? left->run_forever() : left->stop();
+	(speed[1]!=0) ? right->run_forever() : right->stop();
+}
+
+bool SameState(const ev3dev::motor &a, const ev3dev::motor &b)
+{
+	return a.speed_sp == b.speed_sp && a.command == b.command;
+}
+
+// returns the number of state mismatches
+int BenchWrites(int packet_hz)
+{
+	ev3dev::motor cached_left, cached_right, direct_left, direct_right;
+	MotorCommandCache cache_left(&cached_left), cache_right(&cached_right);
+	int packets=BENCH_SECONDS*packet_hz, set_speed=0, mismatches=0;
+
+	for(int i=0;i<packets;++i)
+	{
+		if(i % BENCH_KEEPALIVE_EVERY == BENCH_KEEPALIVE_EVERY-1)
+			continue; //KEEPALIVE doesn't touch the motors
+
+		const int *speed=BENCH_SPEEDS[ (i*BENCH_OPERATOR_HZ/packet_hz) % BENCH_SPEED_STEPS ];
+
+		ApplySpeed(&cache_left, &cache_right, speed);
+		ApplySpeedDirect(&direct_left, &direct_right, speed);
+		++set_speed;
+
+		if( !SameState(cached_left, direct_left) || !SameState(cached_right, direct_right) )
+			++mismatches;
+	}
+
+	int direct=direct_left.writes+direct_right.writes;
+	int cached=cached_left.writes+cached_right.writes;
+
+	if(cached > direct)
+		++mismatches;
+
+	printf("%4d Hz (%4d SET_SPEED/s): writes/s direct %6.1f, cached %6.1f, saved %6.1f (%d%%)%s\n",
+		packet_hz, set_speed/BENCH_SECONDS, (double)direct/BENCH_SECONDS, (double)cached/BENCH_SECONDS,
+		(double)(direct-cached)/BENCH_SECONDS, direct ? (direct-cached)*100/direct : 0, mismatches ? " FAILED" : "");
+
+	return mismatches;
+}
+
+// ns of CPU per SET_SPEED packet
+double BenchCost()
+{
+	ev3dev::motor left, right;
+	MotorCommandCache cache_left(&left), cache_right(&right);
+
+	uint64_t start=ThreadCpuTimeUs();
+
+	for(int i=0;i<BENCH_PACKETS;++i)
+		ApplySpeed(&cache_left, &cache_right, BENCH_SPEEDS[ (i/16) % BENCH_SPEED_STEPS ]);
+
+	uint64_t elapsed_us=ThreadCpuTimeUs()-start;
+
+	if(left.writes == 42) //keeps the work from being optimized out
+		printf("\n");
+
+	return elapsed_us*1000.0/BENCH_PACKETS;
+}
+
+int main(int argc, char **argv)
+{
+	const int PACKET_HZ[]={10, 50, 100};
+	int failures=0;
+
+	printf("motor_cache_bench: %d s simulated, operator %d Hz, every %d-th packet KEEPALIVE, 2 motors\n",
+		BENCH_SECONDS, BENCH_OPERATOR_HZ, BENCH_KEEPALIVE_EVERY);
+
+	for(size_t r=0;r<sizeof(PACKET_HZ)/sizeof(PACKET_HZ[0]);++r)
+		failures += BenchWrites(PACKET_HZ[r]);
+
+	printf("cache cost %.1f ns per SET_SPEED packet\n", BenchCost());
+
+	if(failures)
+	{
+		fprintf(stderr, "motor_cache_bench: cached motors differ from the direct ones\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+/*
+ * ev3drive trajectory queue implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "trajectory.h"
+
+#include <stdlib.h> //abs
+
+static int32_t ClampSpeed(int64_t speed, int32_t limit)
+{
+	if(speed > limit)
+		return limit;
+	if(speed < -limit)
+		return -limit;
+	return (int32_t)speed;
+}
+
+Trajectory::Trajectory()
+{
+	Clear();
+}
+
+void Trajectory::Clear()
+{
+	head=count=0;
+	next_index=0;
+	running=segment_started=false;
+	progress_permille=0;
+}
+
+TrajectoryPushResult Trajectory::Push(const trajectory_segment &segment)
+{
+	int16_t ahead=(int16_t)(segment.index - next_index);
+
+	if(ahead < 0)
+		return TRAJECTORY_DUPLICATE;
+	if(ahead > 0 || count == TRAJECTORY_MAX_SEGMENTS)
+		return TRAJECTORY_REJECTED;
+	if(segment.type != TRAJECTORY_VELOCITY && segment.type != TRAJECTORY_WAYPOINT)
+		return TRAJECTORY_REJECTED;
+
+	segments[(head+count) % TRAJECTORY_MAX_SEGMENTS]=segment;
+	++count;
+	++next_index;
+
+	return TRAJECTORY_ACCEPTED;
+}
+
+void Trajectory::StartSegment(uint64_t timestamp_us, const int32_t position[2])
+{
+	const trajectory_segment &s=segments[head];
+
+	if(!running)
+	{ //new run starts where the robot is
+		for(int e=0;e<2;++e)
+			planned_q6[e]=(int64_t)position[e]*1000000;
+		running=true;
+	}
+
+	segment_start_us=last_us=timestamp_us;
+	segment_started=true;
+	progress_permille=0;
+
+	if(s.type == TRAJECTORY_WAYPOINT)
+	{
+		target[0]=(int32_t)(planned_q6[0]/1000000) + s.left;
+		target[1]=(int32_t)(planned_q6[1]/1000000) + s.right;
+		distance=abs(target[0]-position[0]) > abs(target[1]-position[1]) ? abs(target[0]-position[0]) : abs(target[1]-position[1]);
+	}
+}
+
+void Trajectory::FinishSegment()
+{
+	const trajectory_segment &s=segments[head];
+
+	if(s.type == TRAJECTORY_WAYPOINT)
+		for(int e=0;e<2;++e) //plan from the target, not from where we stopped
+			planned_q6[e]=(int64_t)target[e]*1000000;
+
+	head=(head+1) % TRAJECTORY_MAX_SEGMENTS;
+	--count;
+	segment_started=false;
+	progress_permille=1000;
+
+	if(!count)
+		running=false;
+}
+
+bool Trajectory::Tick(uint64_t timestamp_us, const int32_t position[2], int32_t speed[2])
+{
+	speed[0]=speed[1]=0;
+
+	if(!count)
+		return false;
+
+	if(!segment_started)
+		StartSegment(timestamp_us, position);
+
+	const trajectory_segment &s=segments[head];
+	const uint64_t elapsed_us=timestamp_us-segment_start_us;
+	const int64_t dt_us=(int64_t)(timestamp_us-last_us);
+	last_us=timestamp_us;
+
+	if(s.type == TRAJECTORY_VELOCITY)
+	{
+		const int16_t planned_speed[2]={s.left, s.right};
+		const uint64_t duration_us=(uint64_t)(uint16_t)s.param*1000;
+
+		for(int e=0;e<2;++e)
+		{
+			planned_q6[e] += planned_speed[e]*dt_us;
+			int64_t error=planned_q6[e]/1000000 - position[e];
+			speed[e]=ClampSpeed(planned_speed[e] + TRAJECTORY_FEEDBACK_GAIN*error, TRAJECTORY_MAX_SPEED);
+		}
+
+		if(elapsed_us >= duration_us)
+		{
+			FinishSegment();
+			return true;
+		}
+		progress_permille=(int)(elapsed_us*1000/duration_us);
+		return false;
+	}
+
+	//TRAJECTORY_WAYPOINT
+	int32_t remaining[2]={target[0]-position[0], target[1]-position[1]};
+	int32_t longest=abs(remaining[0]) > abs(remaining[1]) ? abs(remaining[0]) : abs(remaining[1]);
+
+	if(longest <= TRAJECTORY_POSITION_TOLERANCE)
+	{
+		FinishSegment();
+		return true;
+	}
+
+	int32_t limit=abs(s.param) > TRAJECTORY_MAX_SPEED ? TRAJECTORY_MAX_SPEED : abs(s.param);
+
+	if(longest < TRAJECTORY_SLOWDOWN_COUNTS)
+		limit=limit*longest/TRAJECTORY_SLOWDOWN_COUNTS;
+	if(limit < TRAJECTORY_MIN_SPEED)
+		limit=TRAJECTORY_MIN_SPEED;
+
+	for(int e=0;e<2;++e)
+		speed[e]=(int32_t)((int64_t)limit*remaining[e]/longest);
+
+	progress_permille = distance > longest ? 1000 - (int)((int64_t)longest*1000/distance) : 0;
+	return false;
+}
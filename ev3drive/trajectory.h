@@ -0,0 +1,101 @@
+/*
+ * ev3drive trajectory queue header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Trajectory is the queue of motion segments executed on-board by ev3drive.
+ *
+ * The controller uploads numbered segments ahead of time, ev3drive executes them
+ * on local control tick with feedback from the encoders:
+ * -velocity segment - both wheels follow the planned position (speed integrated over time)
+ *  for duration_ms, the error is corrected with proportional term
+ * -waypoint segment - both wheels drive to planned position + delta, the wheel with longer way
+ *  goes at the segment speed and the other is scaled so that they arrive together
+ *
+ * The planned position carries over between the segments so errors don't accumulate.
+ *
+ * Segments have to arrive in order of index (wrapping int16), duplicates are ignored,
+ * out of order segments are rejected and the controller resends from NextIndex().
+ *
+ * All units are tacho counts and counts per second (same as speed_sp).
+ */
+
+#pragma once
+
+#include <stdint.h> //int16_t, int32_t, int64_t, uint64_t
+
+/*
+ * Those constants can be tuned
+ */
+const int TRAJECTORY_MAX_SEGMENTS=64;
+const int TRAJECTORY_TICK_MS=10;
+const int TRAJECTORY_REPORT_MS=100;
+const int TRAJECTORY_MAX_SPEED=1050; //large motor limit, counts/s
+const int TRAJECTORY_MIN_SPEED=40; //counts/s, slower is stall when approaching waypoint
+const int TRAJECTORY_POSITION_TOLERANCE=4; //counts, waypoint is reached within that
+const int TRAJECTORY_SLOWDOWN_COUNTS=90; //start slowing down that far from waypoint
+const int TRAJECTORY_FEEDBACK_GAIN=4; //counts/s of correction per count of position error
+
+enum TrajectorySegmentType {TRAJECTORY_VELOCITY=0, TRAJECTORY_WAYPOINT=1};
+
+struct trajectory_segment
+{
+	int16_t index;
+	int16_t type; //TrajectorySegmentType
+	int16_t left; //speed for velocity, position delta for waypoint
+	int16_t right; //as above
+	int16_t param; //duration_ms for velocity, speed for waypoint
+};
+
+enum TrajectoryPushResult {TRAJECTORY_ACCEPTED=0, TRAJECTORY_DUPLICATE=1, TRAJECTORY_REJECTED=-1};
+
+class Trajectory
+{
+public:
+	Trajectory();
+
+	// empties the queue and stops execution, the next expected index is 0
+	void Clear();
+
+	TrajectoryPushResult Push(const trajectory_segment &segment);
+
+	// computes speeds for this control tick from the measured positions
+	// returns true if segment was finished in this tick
+	bool Tick(uint64_t timestamp_us, const int32_t position[2], int32_t speed[2]);
+
+	bool Active() const { return count > 0; }
+	int Depth() const { return count; }
+	int16_t NextIndex() const { return next_index; }
+	// index of the segment being executed or NextIndex() if idle
+	int16_t ExecutingIndex() const { return count ? segments[head].index : next_index; }
+	// TrajectorySegmentType of the segment being executed, undefined if idle
+	int16_t ExecutingType() const { return segments[head].type; }
+	int ProgressPermille() const { return progress_permille; }
+private:
+	void StartSegment(uint64_t timestamp_us, const int32_t position[2]);
+	void FinishSegment();
+
+	trajectory_segment segments[TRAJECTORY_MAX_SEGMENTS];
+	int head;
+	int count;
+	int16_t next_index;
+
+	bool running; //false until the first tick of the run, then planned position follows the encoders
+	bool segment_started;
+	uint64_t segment_start_us;
+	uint64_t last_us;
+	int64_t planned_q6[2]; //planned position in counts * 10^6 (speed * microseconds)
+	int32_t target[2]; //waypoint target
+	int32_t distance; //waypoint longest way at start
+	int progress_permille;
+};
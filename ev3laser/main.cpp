@@ -20,12 +20,14 @@
   * -reads lidar data from tty
   * -timestamps the data
   * -sends the above data in UDP messages
+  * -optionally publishes nearest obstacle per sector in shared memory (obstacle_map.h)
   *
   * See Usage() function for syntax details (or run the program without arguments)
   */
 
 #include "shared/misc.h"
 #include "shared/net_udp.h"
+#include "shared/obstacle_map.h"
 
 #include "xv11lidar/xv11lidar.h"
 
@@ -43,6 +45,9 @@ volatile sig_atomic_t g_finish_program=0;
 const int TTY_PATH_MAX=100;
 const int LASER_FRAMES_PER_READ=10;
 const int LASER_FRAMES_PER_ROTATION=90;
+// invalid reading of the degree that was nearer is the obstacle inside the lidar minimum range (~150 mm)
+// (the lidar error codes don't tell too close from no return reliably)
+const int LASER_NEAR_MM=500;
 const uint64_t MICROSECONDS_PER_MINUTE=60000000;
 const uint64_t LASER_SPEED_FIXED_POINT_PRECISION=64;
 
@@ -56,9 +61,9 @@ struct laser_packet
 
 const int LASER_PACKET_BYTES = 12 + 16 * LASER_FRAMES_PER_READ;
 
-void MainLoop(int socket_udp, const struct sockaddr_in &address, struct xv11lidar *laser, ev3dev::dc_motor *laser_motor);
+void MainLoop(int socket_udp, const struct sockaddr_in &address, struct xv11lidar *laser, ev3dev::dc_motor *laser_motor, obstacle_map *obstacles);
 
-int ProcessInput(int argc, char **argv, int *port, int *duty_cycle, int *crc_tolerance_pct);
+int ProcessInput(int argc, char **argv, int *port, int *duty_cycle, int *crc_tolerance_pct, int *publish_obstacles);
 void Usage();
 void RegisterSignals();
 void Finish(int signal);
@@ -71,14 +76,17 @@ int EncodeLaserPacket(const laser_packet &p, char *data);
 
 void SendLaserPacket(int socket_udp, const sockaddr_in &dst, const laser_packet &packet);
 
+void UpdateObstacleMap(obstacle_map *obstacles, uint16_t *ranges_mm, const xv11lidar_frame *frames, uint64_t timestamp_us);
+
 int main(int argc, char **argv)
 {
 	int socket_udp;
 	struct sockaddr_in address_udp;
 	struct xv11lidar *laser;    
-	int port, duty_cycle, crc_tolerance_pct;
+	struct obstacle_map *obstacles=NULL;
+	int port, duty_cycle, crc_tolerance_pct, publish_obstacles;
 	
-	if( ProcessInput(argc, argv, &port, &duty_cycle, &crc_tolerance_pct) )
+	if( ProcessInput(argc, argv, &port, &duty_cycle, &crc_tolerance_pct, &publish_obstacles) )
 	{
 		Usage();
 		return 0;
@@ -94,15 +102,22 @@ int main(int argc, char **argv)
 	RegisterSignals(Finish);
 	InitNetworkUDP(&socket_udp, &address_udp, host, port, 0);
 	InitLaserMotor(&motor, duty_cycle);
+
+	if(publish_obstacles)
+		obstacles=CreateObstacleMap();
 	 
  	if( (laser=xv11lidar_init(laser_tty, LASER_FRAMES_PER_READ, crc_tolerance_pct)) == NULL )
 	{
 		fprintf(stderr, "ev3laser: init laser failed\n");
 		g_finish_program=true;
 	}
+	else
+		NotifyReady();
 
-	MainLoop(socket_udp, address_udp, laser, &motor);
+	MainLoop(socket_udp, address_udp, laser, &motor, obstacles);
 
+	if(obstacles)
+		DestroyObstacleMap(obstacles);
 	xv11lidar_close(laser);
 	motor.stop();
 	CloseNetworkUDP(socket_udp);
@@ -112,16 +127,20 @@ int main(int argc, char **argv)
 	return 0;	
 }
 
-void MainLoop(int socket_udp, const struct sockaddr_in &address, struct xv11lidar *laser, ev3dev::dc_motor *laser_motor)
+void MainLoop(int socket_udp, const struct sockaddr_in &address, struct xv11lidar *laser, ev3dev::dc_motor *laser_motor, obstacle_map *obstacles)
 {
 	struct laser_packet packet;
 	struct xv11lidar_frame frames[LASER_FRAMES_PER_READ];
+	uint16_t ranges_mm[360]; //last reading at each degree for the obstacle map
 	uint64_t last_timestamp;
 	uint32_t rpm, sane_frames;
 	int status, counter, benchs=INT_MAX;
 	
 	uint64_t start=TimestampUs();	
 	last_timestamp=start;
+
+	for(int i=0;i<360;++i)
+		ranges_mm[i]=OBSTACLE_NONE;
 		
 	for(counter=0;!g_finish_program && counter<benchs;++counter)
 	{
@@ -152,6 +171,9 @@ void MainLoop(int socket_udp, const struct sockaddr_in &address, struct xv11lida
 		packet.laser_speed=rpm/sane_frames;
 	 
 		SendLaserPacket(socket_udp, address, packet);
+
+		if(obstacles)
+			UpdateObstacleMap(obstacles, ranges_mm, frames, last_timestamp);
 		
 		if(IsStandardInputEOF()) //the parent process has closed it's pipe end
 			break;
@@ -165,11 +187,11 @@ void MainLoop(int socket_udp, const struct sockaddr_in &address, struct xv11lida
 }
 
 
-int ProcessInput(int argc, char **argv, int *out_port, int *duty_cycle, int *crc_tolerance_pct)
+int ProcessInput(int argc, char **argv, int *out_port, int *duty_cycle, int *crc_tolerance_pct, int *publish_obstacles)
 {
 	long int port, duty, crc;
 				
-	if(argc!=7)
+	if(argc!=7 && argc!=8)
 		return -1;
 		
 	port=strtol(argv[4], NULL, 0);
@@ -195,15 +217,27 @@ int ProcessInput(int argc, char **argv, int *out_port, int *duty_cycle, int *crc
 		return -1;
 	}
 	*crc_tolerance_pct=crc;
+
+	*publish_obstacles=0;
+	if(argc==8)
+	{
+		*publish_obstacles=strtol(argv[7], NULL, 0);
+		if(*publish_obstacles != 0 && *publish_obstacles != 1)
+		{
+			fprintf(stderr, "ev3laser: the argument publish_obstacles has to be 0 or 1\n");
+			return -1;
+		}
+	}
 		
 	return 0;
 }
 void Usage()
 {
-	printf("ev3laser tty motor_port host port duty_cycle crc_tolerance_pct\n\n");
+	printf("ev3laser tty motor_port host port duty_cycle crc_tolerance_pct [publish_obstacles]\n\n");
+	printf("publish_obstacles 1 - share nearest obstacle per sector with the drive modules (only one laser may publish)\n\n");
 	printf("examples:\n");
 	printf("./ev3laser /dev/tty_in2 outB 192.168.0.103 8002 40 10\n");
-	printf("./ev3laser /dev/tty_in1 outC 192.168.0.103 8001 -40 10\n");
+	printf("./ev3laser /dev/tty_in1 outC 192.168.0.103 8001 -40 10 1\n");
 }
 
 void Finish(int signal)
@@ -276,4 +310,43 @@ void SendLaserPacket(int socket_udp, const sockaddr_in &dst, const laser_packet
 	static char buffer[LASER_PACKET_BYTES];
 	EncodeLaserPacket(packet, buffer);
 	SendToUDP(socket_udp, dst, buffer, LASER_PACKET_BYTES);
-}
\ No newline at end of file
+}
+
+void UpdateObstacleMap(obstacle_map *obstacles, uint16_t *ranges_mm, const xv11lidar_frame *frames, uint64_t timestamp_us)
+{
+	struct obstacle_snapshot snapshot;
+
+	// invalid readings are too close (0 mm) if the degree was near, otherwise no return (clear the degree)
+	for(int i=0;i<LASER_FRAMES_PER_READ;++i)
+	{
+		if(frames[i].index < 0xA0 || frames[i].index >= 0xA0 + LASER_FRAMES_PER_ROTATION)
+			continue;
+
+		int angle=(frames[i].index-0xA0)*4;
+
+		for(int r=0;r<4;++r)
+		{
+			const xv11lidar_reading &reading=frames[i].readings[r];
+
+			if(!reading.invalid_data)
+				ranges_mm[angle+r]=reading.distance;
+			else if(ranges_mm[angle+r] <= LASER_NEAR_MM)
+				ranges_mm[angle+r]=0;
+			else
+				ranges_mm[angle+r]=OBSTACLE_NONE;
+		}
+	}
+
+	snapshot.timestamp_us=timestamp_us;
+	for(int s=0;s<OBSTACLE_SECTORS;++s)
+		snapshot.distance_mm[s]=OBSTACLE_NONE;
+
+	for(int a=0;a<360;++a)
+	{
+		int s=ObstacleSector(a);
+		if(ranges_mm[a] < snapshot.distance_mm[s])
+			snapshot.distance_mm[s]=ranges_mm[a];
+	}
+
+	PublishObstacleMap(obstacles, snapshot);
+}
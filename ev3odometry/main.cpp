@@ -28,60 +28,47 @@
 
 #include "shared/misc.h"
 #include "shared/net_udp.h"
-
-#include "ev3dev-lang-cpp/ev3dev.h"
+#include "shared/pose_engine.h"
+#include "shared/pose_policies.h"
 
 #include <stdio.h>
-#include <endian.h> //htobe16, htobe32, htobe64
-#include <limits.h> //INT_MAX
+#include <stdlib.h> //strtol
 
 //odometry packets are binary compatible with dead-reconning packets (reserved field for heading)
-struct odometry_packet
-{
-	uint64_t timestamp_us;
-	int32_t position_left;
-	int32_t position_right;
-	int16_t reserved1;
-};
-
-const int ODOMETRY_PACKET_BYTES=18; //2 + 2*4 + 8
-
-void MainLoop(int socket_udp, const sockaddr_in &destination_udp, const ev3dev::large_motor &left,const ev3dev::large_motor &right, int poll_ms);
-
-void InitDriveMotor(ev3dev::large_motor *m);
-
-int EncodeOdometryPacket(const odometry_packet &packet, char *buffer);
-void SendOdometryFrameUDP(int socket, const sockaddr_in &dest, const odometry_packet &frame);
+typedef PoseEngine<DifferentialDrive, NoHeading> OdometryEngine;
 
 void Usage();
-int ProcessInput(int argc, char **argv, int *out_port, int *out_poll_ms);
+int ProcessInput(int argc, char **argv, int *out_port, int *out_poll_ms, int *out_threshold, int *out_heartbeat_ms, int *out_internal_hz);
 
 int main(int argc, char **argv)
 {
 	int socket_udp;
 	sockaddr_in destination_udp;
 	
-	int port, poll_ms;
+	int port, poll_ms, threshold, heartbeat_ms, internal_hz;
 		
-	if( ProcessInput(argc, argv, &port, &poll_ms) )
+	if( ProcessInput(argc, argv, &port, &poll_ms, &threshold, &heartbeat_ms, &internal_hz) )
 	{
 		Usage();
 		return 0;
 	}
 	const char *host=argv[1];
 	
-	ev3dev::large_motor motor_left(ev3dev::OUTPUT_A);
-	ev3dev::large_motor motor_right(ev3dev::OUTPUT_D);
+	OdometryEngine engine("ev3odometry");
+
+	engine.SetChangeDriven(threshold, heartbeat_ms);
+	engine.SetOversampling(internal_hz);
 
 	SetStandardInputNonBlocking();	
 
 	InitNetworkUDP(&socket_udp, &destination_udp, host, port, 0);
 	
-	InitDriveMotor(&motor_left);
-	InitDriveMotor(&motor_right);
+	engine.Init();
+	NotifyReady();
 		
-	MainLoop(socket_udp, destination_udp, motor_left, motor_right, poll_ms);
+	engine.MainLoop(socket_udp, destination_udp, poll_ms);
 	
+	engine.Close();
 	CloseNetworkUDP(socket_udp);
 
 	printf("ev3odemtry: bye\n");
@@ -89,76 +76,25 @@ int main(int argc, char **argv)
 	return 0;
 }
 
-void MainLoop(int socket_udp, const sockaddr_in &destination_udp, const ev3dev::large_motor &motor_left,const ev3dev::large_motor &motor_right, int poll_ms)
-{
-	const int BENCHS=INT_MAX;
-		
-	struct odometry_packet frame;
-	uint64_t start=TimestampUs();
-	int i, elapsed_us, poll_us=1000*poll_ms;
-	
-	for(i=0;i<BENCHS;++i)
-	{
-		frame.timestamp_us=TimestampUs();	
-		frame.position_left=  motor_left.position();
-		frame.position_right=  motor_right.position();
-		SendOdometryFrameUDP(socket_udp, destination_udp, frame);
-
-		if(IsStandardInputEOF()) //the parent process has closed it's pipe end
-			break;
-		
-		elapsed_us=(int)(TimestampUs()-frame.timestamp_us);
-		
-		if( elapsed_us < poll_us )
-			SleepUs(poll_us - elapsed_us);
-	}
-		
-	uint64_t end=TimestampUs();
-	double seconds_elapsed=(end-start)/ 1000000.0L;
-	printf("ev3odometry: average loop %f seconds\n", seconds_elapsed/i);
-}
-
-void InitDriveMotor(ev3dev::large_motor *m)
-{
-	if(!m->connected())
-		Die("ev3odometry: motor not connected");
-}
-
-int EncodeOdometryPacket(const odometry_packet &p, char *data)
-{
-	*((uint64_t*)data) = htobe64(p.timestamp_us);
-	data += sizeof(p.timestamp_us);
-
-	*((uint32_t*)data)= htobe32(p.position_left);
-	data += sizeof(p.position_left);
-
-	*((uint32_t*)data)= htobe32(p.position_right);
-	data += sizeof(p.position_right);
-	
-	*((uint16_t*)data)= htobe16(0);
-	data += sizeof(p.reserved1);
-		
-	return ODOMETRY_PACKET_BYTES;	
-}
-void SendOdometryFrameUDP(int socket, const sockaddr_in &destination, const odometry_packet &frame)
-{
-	static char buffer[ODOMETRY_PACKET_BYTES];
-	EncodeOdometryPacket(frame, buffer);
-	SendToUDP(socket, destination, buffer, ODOMETRY_PACKET_BYTES);
-}
-
 void Usage()
 {
-	printf("ev3odemtry host port poll_ms\n\n");
+	printf("ev3odemtry host port poll_ms [change_threshold heartbeat_ms [internal_hz]]\n\n");
 	printf("examples:\n");
 	printf("./ev3odometry 192.168.0.103 8005 10\n");
+	printf("./ev3odometry 192.168.0.103 8005 10 1 500\n");
+	printf("./ev3odometry 192.168.0.103 8005 10 0 0 500\n");
+	printf("\nwith change_threshold and heartbeat_ms sample is sent only if encoder or heading changes\n");
+	printf("by more than change_threshold degrees or after heartbeat_ms, packets get sequence number\n");
+	printf("(0 0 disables)\n");
+	printf("\nwith internal_hz encoders are sampled and filtered at internal_hz, sent at poll_ms with velocity\n");
+	printf("(internal_hz*poll_ms/1000 at most %d, the filter window)\n", POSE_FILTER_MAX_WINDOW);
 }
 
-int ProcessInput(int argc, char **argv, int *out_port, int *out_poll_ms)
+int ProcessInput(int argc, char **argv, int *out_port, int *out_poll_ms, int *out_threshold, int *out_heartbeat_ms, int *out_internal_hz)
 {
-	long int port, poll_ms;
+	long int port, poll_ms, threshold=0, heartbeat_ms=0, internal_hz=0;
 			
-	if(argc!=4)
+	if(argc!=4 && argc!=6 && argc!=7)
 		return -1;
 		
 	port=strtol(argv[2], NULL, 0);
@@ -176,6 +112,33 @@ int ProcessInput(int argc, char **argv, int *out_port, int *out_poll_ms)
 		return -1;
 	}
 	*out_poll_ms=poll_ms;
+
+	if(argc>=6)
+	{
+		threshold=strtol(argv[4], NULL, 0);
+		heartbeat_ms=strtol(argv[5], NULL, 0);
+		if( CheckChangeDriven("ev3odometry", threshold, heartbeat_ms, poll_ms) )
+			return -1;
+	}
+	*out_threshold=threshold;
+	*out_heartbeat_ms=heartbeat_ms;
+
+	if(argc==7)
+	{
+		internal_hz=strtol(argv[6], NULL, 0);
+		if(internal_hz < 2000/poll_ms || internal_hz > 1000)
+		{
+			fprintf(stderr, "ev3odometry: the argument internal_hz has to be in range <2000/poll_ms, 1000>\n");
+			return -1;
+		}
+		if(internal_hz*poll_ms/1000 > POSE_FILTER_MAX_WINDOW)
+		{
+			fprintf(stderr, "ev3odometry: the argument internal_hz has to be at most %ld for poll_ms %ld (filter window %d samples)\n",
+				POSE_FILTER_MAX_WINDOW*1000/poll_ms, poll_ms, POSE_FILTER_MAX_WINDOW);
+			return -1;
+		}
+	}
+	*out_internal_hz=internal_hz;
 	
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,143 @@
+/*
+ * ev3dev-mapping PoseFilter benchmark
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Measures PoseFilter (see shared/pose_filter.h) as used by ev3odometry oversampling:
+ * -CPU cost per internal sample (Push and Output every decimation samples)
+ * -the gain of sinusoidal encoder signal at output for frequencies below and above output Nyquist
+ *
+ * Fails (exit status) if the passband gain is below BENCH_MIN_PASSBAND_GAIN
+ * or the gain from 1.5 times output Nyquist exceeds BENCH_MAX_STOPBAND_GAIN.
+ *
+ * Run it on the EV3 for the numbers that matter, the sysfs read of the encoders is not included.
+ */
+
+#include "shared/misc.h"
+#include "shared/pose_filter.h"
+
+#include <stdio.h> //printf
+#include <stdlib.h> //strtol
+#include <math.h> //sin, fabs, log10
+
+const int BENCH_ENCODERS=2;
+const int BENCH_SAMPLES=1000000;
+const int BENCH_INTERNAL_HZ=1000;
+const int BENCH_AMPLITUDE=1000; //encoder counts
+const double BENCH_PASSBAND_RATIO=0.25; //of output Nyquist, at most
+const double BENCH_MIN_PASSBAND_GAIN=0.9;
+const double BENCH_STOPBAND_RATIO=1.5; //of output Nyquist, at least
+const double BENCH_MAX_STOPBAND_GAIN=0.4; //-8 dB, two sample boxcar (decimation 2) gives -8.3 dB at 1.5 Nyquist
+
+// ns of CPU per internal sample
+double BenchCost(int decimation)
+{
+	PoseFilter<BENCH_ENCODERS> filter;
+	int32_t position[BENCH_ENCODERS], out_position[BENCH_ENCODERS], out_velocity[BENCH_ENCODERS];
+	int64_t checksum=0;
+
+	if( !filter.SetWindow(decimation) )
+		Die("pose_filter_bench: invalid window");
+
+	uint64_t start=ThreadCpuTimeUs();
+
+	for(int i=0;i<BENCH_SAMPLES;++i)
+	{
+		position[0]=i;
+		position[1]=i/2;
+		filter.Push((uint64_t)i*1000, position);
+
+		if(i % decimation == 0 && filter.Ready())
+		{
+			filter.Output(out_position, out_velocity);
+			checksum+=out_position[0]+out_velocity[1];
+		}
+	}
+
+	uint64_t elapsed_us=ThreadCpuTimeUs()-start;
+
+	if(checksum == 42) //keeps the work from being optimized out
+		printf("\n");
+
+	return elapsed_us*1000.0/BENCH_SAMPLES;
+}
+
+// peak output amplitude relative to input for sine of frequency_hz sampled at BENCH_INTERNAL_HZ
+double BenchGain(int decimation, double frequency_hz)
+{
+	PoseFilter<BENCH_ENCODERS> filter;
+	int32_t position[BENCH_ENCODERS], out_position[BENCH_ENCODERS], out_velocity[BENCH_ENCODERS];
+	double peak=0;
+
+	if( !filter.SetWindow(decimation) )
+		Die("pose_filter_bench: invalid window");
+
+	//phase stepping so that the decimated samples don't stay on the sine zeros
+	for(int i=0;i<20*BENCH_INTERNAL_HZ;++i)
+	{
+		double t=(double)i/BENCH_INTERNAL_HZ;
+		position[0]=position[1]=(int32_t)lround(BENCH_AMPLITUDE*sin(2*M_PI*frequency_hz*t + 0.001*i));
+		filter.Push((uint64_t)i*1000000/BENCH_INTERNAL_HZ, position);
+
+		if(i % decimation == 0 && filter.Ready() && i > BENCH_INTERNAL_HZ)
+		{
+			filter.Output(out_position, out_velocity);
+			if( fabs(out_position[0]) > peak )
+				peak=fabs(out_position[0]);
+		}
+	}
+
+	return peak/BENCH_AMPLITUDE;
+}
+
+int main(int argc, char **argv)
+{
+	const int DECIMATIONS[]={2, 10, POSE_FILTER_MAX_WINDOW};
+	const double FREQUENCY_RATIOS[]={0.1, 0.25, 0.5, 1.0, 1.5, 2.0, 2.5, 3.0}; //of output Nyquist
+	int failures=0;
+
+	printf("pose_filter_bench: %d encoders, %d internal samples\n", BENCH_ENCODERS, BENCH_SAMPLES);
+
+	for(size_t d=0;d<sizeof(DECIMATIONS)/sizeof(DECIMATIONS[0]);++d)
+		printf("decimation %2d: %6.1f ns per internal sample\n", DECIMATIONS[d], BenchCost(DECIMATIONS[d]));
+
+	for(size_t d=0;d<sizeof(DECIMATIONS)/sizeof(DECIMATIONS[0]);++d)
+	{
+		double nyquist_hz=BENCH_INTERNAL_HZ/(2.0*DECIMATIONS[d]);
+
+		printf("\ndecimation %d at %d Hz (output Nyquist %.1f Hz)\n", DECIMATIONS[d], BENCH_INTERNAL_HZ, nyquist_hz);
+
+		for(size_t f=0;f<sizeof(FREQUENCY_RATIOS)/sizeof(FREQUENCY_RATIOS[0]);++f)
+		{
+			double frequency_hz=FREQUENCY_RATIOS[f]*nyquist_hz;
+
+			if(frequency_hz > BENCH_INTERNAL_HZ/2.0) //not representable at internal rate
+				continue;
+
+			double gain=BenchGain(DECIMATIONS[d], frequency_hz);
+			bool failed=(FREQUENCY_RATIOS[f] <= BENCH_PASSBAND_RATIO && gain < BENCH_MIN_PASSBAND_GAIN) ||
+				(FREQUENCY_RATIOS[f] >= BENCH_STOPBAND_RATIO && gain > BENCH_MAX_STOPBAND_GAIN);
+
+			printf("%7.1f Hz (%.2f Nyquist): gain %.3f (%6.1f dB)%s\n", frequency_hz, FREQUENCY_RATIOS[f], gain, 20*log10(gain > 1e-6 ? gain : 1e-6), failed ? " FAILED" : "");
+			failures += failed;
+		}
+	}
+
+	if(failures)
+	{
+		fprintf(stderr, "pose_filter_bench: %d gains out of the limits\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,298 @@
+/*
+ * ev3sampler program
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+ 
+ /*   
+  * This program was created for EV3 with ev3dev OS 
+  * 
+  * ev3sampler:
+  * -reads positions of all connected tacho motors (ports A-D)
+  * -optionally reads gyroscope angle (bias corrected)
+  * -timestamps the data on common tick
+  * -publishes the above data in shared memory sensor bus (see shared/sensor_bus.h)
+  *
+  * ev3odometry, ev3dead-reconning and ev3car-reconning read the sensor bus
+  * instead of sysfs when ev3sampler is running, enable it before them.
+  *
+  * ev3sampler may also be hosted in ev3control process (ev3sampler.so, see shared/module_host.h)
+  *
+  * Preconditions (for EV3/ev3dev):
+  * -for gyroscope - MicroInfinity CruizCore XG1300L gyroscope connected to port 3 with manually loaded I2C driver
+  *
+  * See Usage() function for syntax details (or run the program without arguments)
+  */
+
+#include "shared/misc.h"
+#include "shared/module_host.h"
+#include "shared/sensor_bus.h"
+#include "shared/sysfs.h"
+#include "shared/pose_policies.h"
+
+#include "ev3dev-lang-cpp/ev3dev.h"
+
+#include <limits.h> //INT_MAX
+#include <stdio.h>
+#include <stdlib.h> //strtol, abs, EXIT_FAILURE
+#include <signal.h> //sig_atomic_t
+#include <errno.h> //ENXIO
+#include <fcntl.h> //O_RDONLY
+#include <unistd.h> //close
+
+#include <exception> //exception
+
+// GLOBAL VARIABLES
+volatile sig_atomic_t g_finish_program=0;
+
+const int SAMPLER_STATIONARY_COUNTS=1;
+
+struct sampler_motors
+{
+	int position_fd[SENSOR_BUS_MOTORS];
+	uint16_t flags;
+};
+
+int Run(int poll_ms, int use_gyro, module_host *host);
+int MainLoop(sensor_bus *bus, const sampler_motors &motors, CruizCoreHeading *gyro, int poll_ms, module_host *host);
+
+int InitMotors(sampler_motors *motors);
+void CloseMotors(sampler_motors *motors);
+
+void Usage();
+int ProcessInput(int argc, char **argv, int *out_poll_ms, int *out_use_gyro);
+void Finish(int signal);
+
+int main(int argc, char **argv)
+{
+	int poll_ms, use_gyro;
+	
+	if( ProcessInput(argc, argv, &poll_ms, &use_gyro) )
+	{
+		Usage();
+		return 0;
+	}
+
+	SetStandardInputNonBlocking();
+	RegisterSignals(Finish);
+
+	return Run(poll_ms, use_gyro, NULL);
+}
+
+// in-process hosting entry point (see shared/module_host.h)
+extern "C" int ev3_module_run(int argc, char **argv, module_host *host)
+{
+	int poll_ms, use_gyro;
+	
+	if( ProcessInput(argc, argv, &poll_ms, &use_gyro) )
+	{
+		Usage();
+		return 1;
+	}
+
+	//ev3dev-lang-cpp throws on sysfs failures, uncaught it would terminate ev3control
+	try
+	{
+		return Run(poll_ms, use_gyro, host);
+	}
+	catch(const std::exception &e)
+	{
+		fprintf(stderr, "ev3sampler: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+}
+
+// host is NULL when running as separate process
+// the hardware failures are returned (not Die) so that the hosted module is reported as failed
+int Run(int poll_ms, int use_gyro, module_host *host)
+{
+	sampler_motors motors;
+	CruizCoreHeading gyro;
+	sensor_bus *bus;
+
+	if( InitMotors(&motors) == -1 )
+		return EXIT_FAILURE;
+
+	if( use_gyro && gyro.Open("ev3sampler") == -1 )
+	{
+		CloseMotors(&motors);
+		return EXIT_FAILURE;
+	}
+	
+	if( (bus=CreateSensorBus(1000*poll_ms)) == NULL )
+	{
+		if(use_gyro)
+			gyro.Close();
+		CloseMotors(&motors);
+		return EXIT_FAILURE;
+	}
+
+	ModuleReady(host);
+
+	int result=MainLoop(bus, motors, use_gyro ? &gyro : NULL, poll_ms, host);
+
+	DestroySensorBus(bus);
+
+	if(use_gyro)
+		gyro.Close();
+	CloseMotors(&motors);
+
+	printf("ev3sampler: bye\n");
+	
+	return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// returns 0 when stopped, -1 on sensor failure
+int MainLoop(sensor_bus *bus, const sampler_motors &motors, CruizCoreHeading *gyro, int poll_ms, module_host *host)
+{
+	const int BENCHS=INT_MAX;
+		
+	sensor_snapshot snapshot={0};
+	int32_t last_position[SENSOR_BUS_MOTORS]={0};
+	uint64_t start=TimestampUs();
+	int i, enxios=0, elapsed_us, poll_us=1000*poll_ms, status=0;
+	bool stationary;
+
+	snapshot.flags=motors.flags | (gyro ? SENSOR_BUS_GYRO : 0);
+		
+	for(i=0;!g_finish_program && i<BENCHS;++i)
+	{	
+		snapshot.timestamp_us=TimestampUs();
+		stationary= i>0;
+
+		for(int m=0;m<SENSOR_BUS_MOTORS && status == 0;++m)
+		{
+			if( !(motors.flags & (1 << m)) )
+				continue;
+			if( ReadSysfsInt(motors.position_fd[m], &snapshot.position[m]) == -1 )
+			{
+				perror("ev3sampler: read motor position failed");
+				status=-EIO;
+				break;
+			}
+			if( abs(snapshot.position[m]-last_position[m]) > SAMPLER_STATIONARY_COUNTS)
+				stationary=false;
+			last_position[m]=snapshot.position[m];
+		}
+
+		if(status == 0 && gyro)
+			status=gyro->Read(snapshot.timestamp_us, stationary, &snapshot.heading);
+
+		if(status == -ENXIO)
+		{ //this is workaround for occasional ENXIO problem
+			fprintf(stderr, "ev3sampler: got ENXIO, retrying %d\n", ++enxios);
+			status=0;
+			--i;
+			continue; //we need to collect data again, this failure could be time consuming
+		}
+		if(status != 0)
+			break;
+
+		PublishSensorBus(bus, snapshot);
+		enxios=0; //part of workaround for occasoinal ENXIO
+
+		if(ModuleStopRequested(host))
+			break;
+
+		elapsed_us=(int)(TimestampUs()-snapshot.timestamp_us);
+		
+		if( elapsed_us < poll_us )
+			SleepUs(poll_us - elapsed_us);
+	}
+		
+	uint64_t end=TimestampUs();
+	
+	double seconds_elapsed=(end-start)/ 1000000.0L;
+	printf("ev3sampler: average loop %f seconds\n", seconds_elapsed/i);
+
+	return status == 0 ? 0 : -1;
+}
+
+// returns -1 if there are no motors or on failure
+int InitMotors(sampler_motors *motors)
+{
+	const ev3dev::address_type ports[SENSOR_BUS_MOTORS]={ev3dev::OUTPUT_A, ev3dev::OUTPUT_B, ev3dev::OUTPUT_C, ev3dev::OUTPUT_D};
+
+	motors->flags=0;
+
+	for(int m=0;m<SENSOR_BUS_MOTORS;++m)
+		motors->position_fd[m]=-1;
+
+	for(int m=0;m<SENSOR_BUS_MOTORS;++m)
+	{
+		ev3dev::motor motor(ports[m]);
+
+		if(!motor.connected())
+			continue;
+
+		if( (motors->position_fd[m]=TryOpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, motor.device_index(), "position", O_RDONLY)) == -1 )
+		{
+			CloseMotors(motors);
+			return -1;
+		}
+		motors->flags |= 1 << m;
+
+		printf("ev3sampler: sampling motor on %s\n", ports[m].c_str());
+	}
+
+	if(motors->flags == 0)
+	{
+		fprintf(stderr, "ev3sampler: no tacho motors connected\n");
+		return -1;
+	}
+	return 0;
+}
+
+void CloseMotors(sampler_motors *motors)
+{
+	for(int m=0;m<SENSOR_BUS_MOTORS;++m)
+		if(motors->position_fd[m] != -1)
+			close(motors->position_fd[m]);
+}
+
+void Usage()
+{
+	printf("ev3sampler poll_ms use_gyro\n\n");
+	printf("examples:\n");
+	printf("./ev3sampler 10 1\n");
+	printf("./ev3sampler 10 0\n");
+}
+
+int ProcessInput(int argc, char **argv, int *out_poll_ms, int *out_use_gyro)
+{
+	long int poll_ms, use_gyro;
+		
+	if(argc!=3)
+		return -1;
+		
+	poll_ms=strtol(argv[1], NULL, 0);
+	if(poll_ms <= 0 || poll_ms > 1000)
+	{
+		fprintf(stderr, "ev3sampler: the argument poll_ms has to be in range <1, 1000>\n");
+		return -1;
+	}
+	*out_poll_ms=poll_ms;
+
+	use_gyro=strtol(argv[2], NULL, 0);
+	if(use_gyro != 0 && use_gyro != 1)
+	{
+		fprintf(stderr, "ev3sampler: the argument use_gyro has to be 0 or 1\n");
+		return -1;
+	}
+	*out_use_gyro=use_gyro;
+	
+	return 0;
+}
+
+void Finish(int signal)
+{
+	g_finish_program=1;
+}
@@ -80,6 +80,7 @@ int main(int argc, char **argv)
 	SetStandardInputNonBlocking();	
 
 	InitNetworkUDP(&socket_udp, &destination_udp, host, port, 0);
+	NotifyReady();
 			
 	MainLoop(socket_udp, destination_udp, wifi, poll_ms);
 	
@@ -0,0 +1,165 @@
+/*
+ * ev3dev-mapping gyroscope bias estimation implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "gyro_bias.h"
+
+#include "misc.h"
+
+#include <stdio.h> //fopen, fscanf, fprintf
+#include <string.h> //strcmp, strncpy
+#include <stdlib.h> //llabs
+
+const int GYRO_HALF_TURN=18000; //0.01 degree units
+const int64_t US_PER_S=1000000;
+
+// maps angle difference to <-18000, 18000)
+static int32_t NormalizeAngle(int32_t angle)
+{
+	while(angle >= GYRO_HALF_TURN)
+		angle -= 2*GYRO_HALF_TURN;
+	while(angle < -GYRO_HALF_TURN)
+		angle += 2*GYRO_HALF_TURN;
+	return angle;
+}
+
+int32_t ReadTemperature()
+{
+	int temperature_mc;
+	FILE *f=fopen(GYRO_TEMPERATURE_PATH, "r");
+	if(f == NULL)
+		return GYRO_TEMPERATURE_UNKNOWN;
+
+	if(fscanf(f, "%d", &temperature_mc) != 1)
+		temperature_mc=GYRO_TEMPERATURE_UNKNOWN;
+	fclose(f);
+	return temperature_mc;
+}
+
+int LoadGyroBiasCache(const char *path, gyro_bias_cache *cache)
+{
+	char boot_id[sizeof(cache->boot_id)];
+	int temperature_mc;
+	FILE *f;
+
+	if( ReadBootId(boot_id, sizeof(boot_id)) == -1 )
+		return -1;
+
+	if( (f=fopen(path, "r")) == NULL )
+		return -1;
+
+	int ok = fscanf(f, "%39s %d %d", cache->boot_id, &cache->bias_q16, &cache->temperature_mc) == 3;
+	fclose(f);
+
+	if(!ok || strcmp(boot_id, cache->boot_id) != 0) //the sensor was powered down since
+		return -1;
+
+	temperature_mc=ReadTemperature();
+
+	if(temperature_mc == GYRO_TEMPERATURE_UNKNOWN || cache->temperature_mc == GYRO_TEMPERATURE_UNKNOWN)
+		return 0;
+
+	if(llabs((long long)temperature_mc - cache->temperature_mc) > GYRO_CACHE_MAX_TEMPERATURE_DELTA_MC)
+		return -1;
+
+	return 0;
+}
+
+int SaveGyroBiasCache(const char *path, const gyro_bias_cache &cache)
+{
+	gyro_bias_cache c=cache;
+	FILE *f;
+
+	if( ReadBootId(c.boot_id, sizeof(c.boot_id)) == -1 )
+		return -1;
+
+	if( (f=fopen(path, "w")) == NULL )
+		return -1;
+
+	fprintf(f, "%s %d %d\n", c.boot_id, c.bias_q16, c.temperature_mc);
+
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+GyroBias::GyroBias(): bias_q16(0), bias_valid(false), updates(0),
+	zero_angle(0), correction_q16_us(0), last_us(0),
+	stationary(false), stationary_since_us(0), in_window(false), window_start_us(0), window_start_angle(0)
+{
+}
+
+void GyroBias::Start(uint64_t timestamp_us, int16_t raw_angle, int32_t bias, bool valid)
+{
+	bias_q16=bias;
+	bias_valid=valid;
+	zero_angle=raw_angle;
+	correction_q16_us=0;
+	last_us=timestamp_us;
+	stationary=in_window=false;
+}
+
+int16_t GyroBias::Correct(uint64_t timestamp_us, int16_t raw_angle, bool is_stationary)
+{
+	correction_q16_us += (int64_t)bias_q16 * (int64_t)(timestamp_us-last_us);
+	last_us=timestamp_us;
+
+	int32_t correction = (int32_t)(correction_q16_us / US_PER_S >> 16);
+	int16_t heading = NormalizeAngle(NormalizeAngle((int32_t)raw_angle - zero_angle) - NormalizeAngle(correction));
+
+	if(!is_stationary)
+	{
+		stationary=in_window=false;
+		return heading;
+	}
+
+	if(!stationary)
+	{
+		stationary=true;
+		stationary_since_us=timestamp_us;
+	}
+
+	if(!in_window)
+	{
+		if(timestamp_us - stationary_since_us >= (uint64_t)GYRO_BIAS_SETTLE_MS*1000)
+		{
+			in_window=true;
+			window_start_us=timestamp_us;
+			window_start_angle=raw_angle;
+		}
+		return heading;
+	}
+
+	uint64_t window_us=timestamp_us - window_start_us;
+
+	if(window_us < (uint64_t)GYRO_BIAS_WINDOW_MS*1000)
+		return heading;
+
+	//while stationary whole raw angle change is drift
+	int32_t drift=NormalizeAngle((int32_t)raw_angle - window_start_angle);
+	int64_t observed_q16=((int64_t)drift << 16) * US_PER_S / (int64_t)window_us;
+
+	if(llabs(observed_q16) <= ((int64_t)GYRO_BIAS_MAX_CENTIDEG_PER_S << 16))
+	{
+		if(!bias_valid)
+			bias_q16=(int32_t)observed_q16;
+		else //exponential moving average with 1/4 weight
+			bias_q16 += (int32_t)((observed_q16 - bias_q16) / 4);
+
+		bias_valid=true;
+		++updates;
+	}
+
+	window_start_us=timestamp_us;
+	window_start_angle=raw_angle;
+
+	return heading;
+}
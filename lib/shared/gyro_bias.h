@@ -0,0 +1,93 @@
+/*
+ * ev3dev-mapping gyroscope bias estimation header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * GyroBias estimates the residual drift of an integrating gyroscope
+ * (angle in 0.01 degree units, wrapping at +-180 degrees) and corrects the heading.
+ *
+ * Estimation happens only when the caller reports that the robot is stationary
+ * (e.g. the drive encoders don't change). After GYRO_BIAS_SETTLE_MS of stationarity
+ * the angle change over each GYRO_BIAS_WINDOW_MS window is pure drift.
+ *
+ * All the arithmetic is fixed point (EV3 has no FPU), bias is kept in
+ * 0.01 degree/s units with 16 fractional bits.
+ *
+ * The last good bias is persisted in a small text cache file together with
+ * the kernel boot id and temperature. The cache is only valid for the same boot
+ * (the sensor keeps its own calibration until power loss or RESET)
+ * and for similar temperature.
+ */
+
+#pragma once
+
+#include "misc.h" //BOOT_ID_LENGTH
+
+#include <stdint.h> //int16_t, int32_t, int64_t, uint64_t
+
+/*
+ * Those constants can be tuned
+ */
+const int GYRO_BIAS_SETTLE_MS=300;
+const int GYRO_BIAS_WINDOW_MS=1000;
+const int GYRO_BIAS_MAX_CENTIDEG_PER_S=100; //larger observed drift means we were not really stationary
+const int GYRO_CACHE_SAVE_MS=30000;
+const int GYRO_CACHE_MAX_TEMPERATURE_DELTA_MC=5000; //millidegrees Celsius
+const char *const GYRO_CACHE_PATH="/tmp/ev3dev-mapping-gyro.cache";
+const char *const GYRO_TEMPERATURE_PATH="/sys/class/thermal/thermal_zone0/temp";
+
+const int32_t GYRO_TEMPERATURE_UNKNOWN=INT32_MIN;
+
+struct gyro_bias_cache
+{
+	char boot_id[BOOT_ID_LENGTH];
+	int32_t bias_q16;
+	int32_t temperature_mc;
+};
+
+// returns 0 on success, -1 if there is no valid cache for current boot and temperature
+int LoadGyroBiasCache(const char *path, gyro_bias_cache *cache);
+// returns 0 on success, -1 on failure (non fatal)
+int SaveGyroBiasCache(const char *path, const gyro_bias_cache &cache);
+// returns temperature in millidegrees Celsius or GYRO_TEMPERATURE_UNKNOWN
+int32_t ReadTemperature();
+
+class GyroBias
+{
+public:
+	GyroBias();
+
+	// starts correction with raw_angle as zero heading
+	void Start(uint64_t timestamp_us, int16_t raw_angle, int32_t bias_q16, bool bias_valid);
+
+	// feeds raw angle sample and returns bias corrected heading
+	int16_t Correct(uint64_t timestamp_us, int16_t raw_angle, bool stationary);
+
+	int32_t BiasQ16() const { return bias_q16; }
+	bool BiasValid() const { return bias_valid; }
+	int Updates() const { return updates; }
+private:
+	int32_t bias_q16;
+	bool bias_valid;
+	int updates;
+
+	int16_t zero_angle;
+	int64_t correction_q16_us; //accumulated drift, 0.01 degree units << 16, scaled by 10^6
+	uint64_t last_us;
+
+	bool stationary;
+	uint64_t stationary_since_us;
+	bool in_window;
+	uint64_t window_start_us;
+	int16_t window_start_angle;
+};
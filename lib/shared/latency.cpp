@@ -0,0 +1,157 @@
+/*
+ * ev3dev-mapping latency instrumentation implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "latency.h"
+
+#include "misc.h"
+
+#include <endian.h> //htobe32
+#include <stdio.h> //printf
+#include <string.h> //memset
+
+LatencyHistogram::LatencyHistogram(): count(0), max_us(0), sum_us(0)
+{
+	memset(buckets, 0, sizeof(buckets));
+}
+
+void LatencyHistogram::Add(int64_t latency_us)
+{
+	uint32_t us = latency_us < 0 ? 0 : (latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us);
+	int b=0;
+
+	while(b < LATENCY_BUCKETS-1 && us >= LATENCY_BUCKET_LIMITS_US[b])
+		++b;
+
+	++buckets[b];
+	++count;
+	sum_us += us;
+	if(us > max_us)
+		max_us=us;
+}
+
+uint32_t LatencyHistogram::PercentileLimitUs(int percent) const
+{
+	uint64_t needed=((uint64_t)count*percent + 99) / 100, seen=0;
+
+	for(int b=0;b<LATENCY_BUCKETS-1;++b)
+		if( (seen += buckets[b]) >= needed )
+			return LATENCY_BUCKET_LIMITS_US[b];
+
+	return UINT32_MAX;
+}
+
+int LatencyHistogram::Encode(char *data) const
+{
+	*((uint32_t*)data)=htobe32(count);
+	*((uint32_t*)(data+4))=htobe32(max_us);
+	for(int b=0;b<LATENCY_BUCKETS;++b)
+		*((uint32_t*)(data+8+4*b))=htobe32(buckets[b]);
+
+	return LATENCY_HISTOGRAM_BYTES;
+}
+
+void LatencyHistogram::Print(const char *module, const char *name) const
+{
+	if(!count)
+	{
+		printf("%s: %s latency - no samples\n", module, name);
+		return;
+	}
+
+	printf("%s: %s latency - count %u, mean %llu us, max %u us, p50 < %u us, p99 < %u us\n", module, name, count,
+		(unsigned long long)(sum_us / count), max_us, PercentileLimitUs(50), PercentileLimitUs(99));
+
+	printf("%s: %s buckets -", module, name);
+	for(int b=0;b<LATENCY_BUCKETS-1;++b)
+		printf(" <%u:%u", LATENCY_BUCKET_LIMITS_US[b], buckets[b]);
+	printf(" >=%u:%u\n", LATENCY_BUCKET_LIMITS_US[LATENCY_BUCKETS-2], buckets[LATENCY_BUCKETS-1]);
+}
+
+ClockOffset::ClockOffset()
+{
+	Reset();
+}
+
+void ClockOffset::Reset()
+{
+	current_valid=previous_valid=false;
+	current_min=previous_min=0;
+	window_start_us=0;
+}
+
+int64_t ClockOffset::Update(uint64_t sender_us, uint64_t local_us)
+{
+	int64_t difference=(int64_t)(local_us - sender_us);
+
+	if(!current_valid && !previous_valid)
+		window_start_us=local_us;
+
+	if(local_us - window_start_us >= (uint64_t)CLOCK_OFFSET_WINDOW_MS*1000)
+	{
+		previous_min=current_min;
+		previous_valid=current_valid;
+		current_valid=false;
+		window_start_us=local_us;
+	}
+
+	if(!current_valid || difference < current_min)
+	{
+		current_min=difference;
+		current_valid=true;
+	}
+
+	return difference - OffsetUs();
+}
+
+int64_t ClockOffset::OffsetUs() const
+{
+	if(current_valid && previous_valid)
+		return current_min < previous_min ? current_min : previous_min;
+	return current_valid ? current_min : previous_min;
+}
+
+int64_t CommandLatency::Received(uint64_t sender_us, uint64_t received_us)
+{
+	int64_t delay_us=offset.Update(sender_us, received_us);
+	transit.Add(delay_us);
+	return delay_us;
+}
+
+void CommandLatency::Actuated(uint64_t sender_us, uint64_t received_us, uint64_t done_us)
+{
+	actuation.Add((int64_t)(done_us - received_us));
+	total.Add((int64_t)(done_us - sender_us) - offset.OffsetUs());
+}
+
+int CommandLatency::EncodeTelemetry(char *data) const
+{
+	int offset_bytes=16;
+
+	*((uint64_t*)data)=htobe64(TimestampUs());
+	*((int64_t*)(data+8))=htobe64(offset.OffsetUs());
+
+	offset_bytes += transit.Encode(data+offset_bytes);
+	offset_bytes += actuation.Encode(data+offset_bytes);
+	offset_bytes += total.Encode(data+offset_bytes);
+
+	return offset_bytes;
+}
+
+void CommandLatency::Print(const char *module) const
+{
+	printf("%s: clock offset %lld us (sender to local, including minimum transit)\n", module, (long long)offset.OffsetUs());
+	transit.Print(module, "transit");
+	actuation.Print(module, "actuation");
+	total.Print(module, "total");
+}
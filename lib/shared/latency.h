@@ -0,0 +1,103 @@
+/*
+ * ev3dev-mapping latency instrumentation header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * LatencyHistogram counts latencies in fixed, roughly logarithmic buckets
+ * (no allocation, O(buckets) insert).
+ *
+ * ClockOffset estimates the offset between the sender clock and our monotonic clock
+ * from one way messages. The minimum of (receive - send) over a window is taken
+ * as offset + minimum transit time, so the delay it returns is the transit time
+ * in excess of the minimum (queueing, retransmissions, scheduling).
+ * Two windows are kept so that the estimate follows clock drift.
+ *
+ * CommandLatency bundles the histograms of the drive modules:
+ * -transit - sender timestamp to our receive, above the minimum (see ClockOffset)
+ * -actuation - our receive to completion of the motor sysfs writes
+ * -total - sender timestamp to completion of the writes, above the minimum transit
+ *
+ * Telemetry datagram (big endian, cumulative since start):
+ * uint64 timestamp_us | int64 offset_us | transit | actuation | total
+ * where each histogram is:
+ * uint32 count | uint32 max_us | uint32 buckets[LATENCY_BUCKETS]
+ */
+
+#pragma once
+
+#include <stdint.h> //uint32_t, int64_t, uint64_t
+
+const int LATENCY_BUCKETS=13;
+// upper bounds (exclusive) of all but the last bucket in us, the last one is overflow
+const uint32_t LATENCY_BUCKET_LIMITS_US[LATENCY_BUCKETS-1]={100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000};
+const int LATENCY_HISTOGRAM_BYTES=4+4+LATENCY_BUCKETS*4;
+
+const int LATENCY_TELEMETRY_BYTES=8+8+3*LATENCY_HISTOGRAM_BYTES;
+const int LATENCY_TELEMETRY_MS=1000;
+
+const int CLOCK_OFFSET_WINDOW_MS=10000;
+
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+	void Add(int64_t latency_us);
+	uint32_t Count() const { return count; }
+	// returns the upper bucket limit containing the percentile or UINT32_MAX for overflow bucket
+	uint32_t PercentileLimitUs(int percent) const;
+	int Encode(char *data) const;
+	void Print(const char *module, const char *name) const;
+private:
+	uint32_t buckets[LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t sum_us;
+};
+
+class ClockOffset
+{
+public:
+	ClockOffset();
+	// forgets the estimate (e.g. the sender restarted)
+	void Reset();
+	// feeds message timestamps, returns the transit time above the minimum
+	int64_t Update(uint64_t sender_us, uint64_t local_us);
+	// local - sender clock, including minimum transit time
+	int64_t OffsetUs() const;
+	bool Valid() const { return current_valid || previous_valid; }
+private:
+	int64_t current_min, previous_min;
+	bool current_valid, previous_valid;
+	uint64_t window_start_us;
+};
+
+class CommandLatency
+{
+public:
+	// every accepted command, returns transit time above the minimum
+	int64_t Received(uint64_t sender_us, uint64_t received_us);
+	// commands that were written to the motors
+	void Actuated(uint64_t sender_us, uint64_t received_us, uint64_t done_us);
+	// the sender may have restarted with different clock
+	void ResetOffset() { offset.Reset(); }
+	// local - sender clock, including minimum transit time
+	int64_t OffsetUs() const { return offset.OffsetUs(); }
+
+	int EncodeTelemetry(char *data) const;
+	void Print(const char *module) const;
+private:
+	ClockOffset offset;
+	LatencyHistogram transit;
+	LatencyHistogram actuation;
+	LatencyHistogram total;
+};
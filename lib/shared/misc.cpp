@@ -1,5 +1,8 @@
 #include "misc.h"
 
+#include <stdio.h> //perror, fprintf
+#include <stdlib.h> //exit, getenv, unsetenv
+#include <errno.h> //errno
 #include <thread> //sleep related
 #include <chrono> //sleep related
 #include <time.h> //clock_gettime
@@ -8,6 +11,8 @@
 #include <unistd.h> //STDIN_FILE_NO
 #include <fcntl.h> //fcntl
 
+const char *BOOT_ID_PATH="/proc/sys/kernel/random/boot_id";
+
 uint64_t TimestampUs()
 {
 	timespec ts;
@@ -17,6 +22,15 @@ uint64_t TimestampUs()
 	return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec / 1000;
 }
 
+uint64_t ThreadCpuTimeUs()
+{
+	timespec ts;
+	if( clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) )
+		DieErrno("Thread CPU time failed");
+	
+	return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
 void Sleep(int ms)
 {	
 	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
@@ -83,4 +97,33 @@ bool IsStandardInputEOF()
 
 	Die("Nothing should be on standard input!");
 	return true; //make compiler happy
-}
\ No newline at end of file
+}
+
+void NotifyReady()
+{
+	const char *ready_fd_string=getenv(READY_FD_ENVIRONMENT);
+	char ready='R';
+
+	if(ready_fd_string == NULL)
+		return;
+
+	int ready_fd=strtol(ready_fd_string, NULL, 10);
+	unsetenv(READY_FD_ENVIRONMENT);
+
+	//ev3control may have already given up waiting
+	if( write(ready_fd, &ready, 1) == -1 )
+		perror("NotifyReady write failed");
+	close(ready_fd);
+}
+
+int ReadBootId(char *boot_id, int length)
+{
+	FILE *f=fopen(BOOT_ID_PATH, "r");
+	if(f == NULL)
+		return -1;
+
+	int ok = fscanf(f, "%39s", boot_id) == 1;
+	fclose(f);
+	boot_id[length-1]='\0';
+	return ok ? 0 : -1;
+}
@@ -2,7 +2,12 @@
 
 #include <stdint.h>
 
+const int BOOT_ID_LENGTH=40; //36 characters uuid + terminating zero, rounded up
+// ev3control passes the readiness pipe descriptor to the modules in this variable
+const char *const READY_FD_ENVIRONMENT="EV3CONTROL_READY_FD";
+
 uint64_t TimestampUs();
+uint64_t ThreadCpuTimeUs();
 void Sleep(int ms);
 void SleepUs(int us);
 void DieErrno(const char *s);
@@ -10,4 +15,8 @@ void Die(const char *s);
 void RegisterSignals(void (*signal_handler)(int) );
 void SetStandardInputNonBlocking();
 bool IsStandardInputEOF();
+// tells ev3control that initialization is finished, does nothing if not started by ev3control
+void NotifyReady();
+// returns 0 on success, -1 on failure
+int ReadBootId(char *boot_id, int length);
 
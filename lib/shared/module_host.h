@@ -0,0 +1,57 @@
+/*
+ * ev3dev-mapping in-process module hosting header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Modules that can be hosted in ev3control process are also built as shared objects
+ * exporting MODULE_HOST_ENTRY function (ModuleHostEntry signature).
+ *
+ * ev3control loads them with dlopen and runs the entry on its own thread:
+ * -argv is the module call (argv[0] is the shared object path)
+ * -the module calls ModuleReady when initialized (like NotifyReady for processes)
+ * -the module returns when ModuleStopRequested (like stdin EOF for processes)
+ * -the returned value is reported like the process exit status
+ *
+ * Hosted modules share the process with ev3control and other modules so they
+ * must not install signal handlers, use stdin or exit (Die) unless the failure is fatal anyway.
+ *
+ * The same code runs as a separate process with host=NULL.
+ */
+
+#pragma once
+
+#include "misc.h"
+
+struct module_host
+{
+	int stop; //set by the host from other thread, accessed with __atomic builtins
+	void (*ready)(module_host *host);
+	void *data; //host private
+};
+
+typedef int (*ModuleHostEntry)(int argc, char **argv, module_host *host);
+const char *const MODULE_HOST_ENTRY="ev3_module_run";
+
+inline void ModuleReady(module_host *host)
+{
+	if(host)
+		host->ready(host);
+	else
+		NotifyReady();
+}
+
+// for processes: the parent process has closed it's pipe end
+inline bool ModuleStopRequested(module_host *host)
+{
+	return host ? __atomic_load_n(&host->stop, __ATOMIC_ACQUIRE) != 0 : IsStandardInputEOF();
+}
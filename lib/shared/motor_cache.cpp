@@ -0,0 +1,128 @@
+/*
+ * ev3dev-mapping motor command cache implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "motor_cache.h"
+
+#include "misc.h"
+
+#include <stdio.h> //printf
+
+MotorCommandCache::MotorCommandCache(ev3dev::motor *m): motor(m), writes(0), skipped(0)
+{
+	Invalidate();
+}
+
+void MotorCommandCache::Invalidate()
+{
+	speed_valid=position_valid=duty_cycle_valid=false;
+	setpoint_changed=false;
+	command=COMMAND_UNKNOWN;
+}
+
+bool MotorCommandCache::SkipSetpoint(int *cached, bool *valid, int value)
+{
+	if(*valid && *cached == value)
+	{
+		++skipped;
+		return true;
+	}
+	*cached=value;
+	*valid=true;
+	setpoint_changed=true;
+	++writes;
+	return false;
+}
+
+bool MotorCommandCache::SkipCommand(Command next)
+{
+	bool redundant = command == next && next != COMMAND_RUN_TO_REL_POS;
+
+	//setpoint changes take effect immediately in run-forever and run-direct
+	if(setpoint_changed && next != COMMAND_RUN_FOREVER && next != COMMAND_RUN_DIRECT && next != COMMAND_STOP)
+		redundant=false;
+
+	setpoint_changed=false;
+
+	if(redundant)
+	{
+		++skipped;
+		return true;
+	}
+	command=next;
+	++writes;
+	return false;
+}
+
+void MotorCommandCache::SetSpeedSp(int speed)
+{
+	if(!SkipSetpoint(&speed_sp, &speed_valid, speed))
+		motor->set_speed_sp(speed);
+}
+
+void MotorCommandCache::SetPositionSp(int position)
+{
+	if(!SkipSetpoint(&position_sp, &position_valid, position))
+		motor->set_position_sp(position);
+}
+
+void MotorCommandCache::SetDutyCycleSp(int duty_cycle)
+{
+	if(!SkipSetpoint(&duty_cycle_sp, &duty_cycle_valid, duty_cycle))
+		motor->set_duty_cycle_sp(duty_cycle);
+}
+
+void MotorCommandCache::RunForever()
+{
+	if(!SkipCommand(COMMAND_RUN_FOREVER))
+		motor->run_forever();
+}
+
+void MotorCommandCache::RunToAbsPos()
+{
+	if(!SkipCommand(COMMAND_RUN_TO_ABS_POS))
+		motor->run_to_abs_pos();
+}
+
+void MotorCommandCache::RunToRelPos()
+{
+	if(!SkipCommand(COMMAND_RUN_TO_REL_POS))
+		motor->run_to_rel_pos();
+}
+
+void MotorCommandCache::RunDirect()
+{
+	if(!SkipCommand(COMMAND_RUN_DIRECT))
+		motor->run_direct();
+}
+
+void MotorCommandCache::Stop()
+{
+	if(!SkipCommand(COMMAND_STOP))
+		motor->stop();
+}
+
+void PrintMotorCacheSummary(const char *module, const MotorCommandCache *const *caches, int count, uint64_t start_us)
+{
+	int writes=0, skipped=0;
+	uint64_t elapsed_us=TimestampUs()-start_us;
+
+	for(int i=0;i<count;++i)
+	{
+		writes += caches[i]->Writes();
+		skipped += caches[i]->Skipped();
+	}
+
+	printf("%s: motor sysfs writes %d, skipped %d (%d%%), %.1f writes/s saved\n", module, writes, skipped,
+		writes+skipped ? skipped*100/(writes+skipped) : 0, elapsed_us ? skipped*1000000.0/elapsed_us : 0.0);
+}
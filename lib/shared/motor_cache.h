@@ -0,0 +1,84 @@
+/*
+ * ev3dev-mapping motor command cache header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * MotorCommandCache sits in front of ev3dev-lang-cpp motor and skips redundant sysfs writes.
+ *
+ * Every ev3dev-lang-cpp setter formats a string and writes a sysfs attribute.
+ * The drive modules repeat the same setpoints and commands on every packet,
+ * the cache remembers what was last written and skips:
+ * -setpoint writes with unchanged value
+ * -command writes repeating the last command when no setpoint changed since
+ *  (for run-forever and run-direct setpoint changes take effect immediately
+ *  so the command is never repeated)
+ * -stop when already stopped
+ *
+ * run-to-rel-pos is never skipped (each one moves further).
+ *
+ * The cache assumes it is the only writer, Invalidate() after anything else touched the motor.
+ *
+ * See ev3drive/tests (make bench) for the writes saved at different packet rates.
+ */
+
+#pragma once
+
+#include "ev3dev-lang-cpp/ev3dev.h"
+
+#include <stdint.h> //uint64_t
+
+class MotorCommandCache
+{
+public:
+	explicit MotorCommandCache(ev3dev::motor *motor);
+
+	void SetSpeedSp(int speed);
+	void SetPositionSp(int position);
+	void SetDutyCycleSp(int duty_cycle);
+
+	void RunForever();
+	void RunToAbsPos();
+	void RunToRelPos();
+	void RunDirect();
+	void Stop();
+
+	// forgets everything, the next writes go through
+	void Invalidate();
+
+	// the last written setpoints, 0 if not written since Invalidate()
+	int SpeedSp() const { return speed_valid ? speed_sp : 0; }
+	int PositionSp() const { return position_valid ? position_sp : 0; }
+	int DutyCycleSp() const { return duty_cycle_valid ? duty_cycle_sp : 0; }
+
+	ev3dev::motor *Motor() const { return motor; }
+	int Writes() const { return writes; }
+	int Skipped() const { return skipped; }
+private:
+	enum Command {COMMAND_UNKNOWN, COMMAND_RUN_FOREVER, COMMAND_RUN_TO_ABS_POS, COMMAND_RUN_TO_REL_POS, COMMAND_RUN_DIRECT, COMMAND_STOP};
+
+	bool SkipSetpoint(int *cached, bool *valid, int value);
+	bool SkipCommand(Command next);
+
+	ev3dev::motor *motor;
+
+	int speed_sp, position_sp, duty_cycle_sp;
+	bool speed_valid, position_valid, duty_cycle_valid;
+	bool setpoint_changed; //since the last command
+	Command command;
+
+	int writes;
+	int skipped;
+};
+
+// prints the write counts of the caches and skipped writes per second since start_us
+void PrintMotorCacheSummary(const char *module, const MotorCommandCache *const *caches, int count, uint64_t start_us);
@@ -0,0 +1,122 @@
+/*
+ * ev3dev-mapping obstacle map implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "obstacle_map.h"
+
+#include "misc.h"
+
+#include <sys/mman.h> //shm_open, mmap
+#include <sys/stat.h> //mode constants
+#include <fcntl.h> //O_* constants
+#include <unistd.h> //ftruncate, close
+#include <string.h> //memset
+
+obstacle_map *CreateObstacleMap()
+{
+	int fd;
+	void *mem;
+
+	if( (fd=shm_open(OBSTACLE_MAP_NAME, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 )
+		DieErrno("CreateObstacleMap shm_open");
+
+	if( ftruncate(fd, sizeof(obstacle_map)) == -1 )
+		DieErrno("CreateObstacleMap ftruncate");
+
+	if( (mem=mmap(NULL, sizeof(obstacle_map), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED )
+		DieErrno("CreateObstacleMap mmap");
+
+	close(fd);
+
+	obstacle_map *map=(obstacle_map*)mem;
+	memset(map, 0, sizeof(obstacle_map));
+	map->version=OBSTACLE_MAP_VERSION;
+
+	//readers check magic last
+	__atomic_store_n(&map->magic, OBSTACLE_MAP_MAGIC, __ATOMIC_RELEASE);
+
+	return map;
+}
+
+void PublishObstacleMap(obstacle_map *map, const obstacle_snapshot &snapshot)
+{
+	__atomic_store_n(&map->sequence, map->sequence+1, __ATOMIC_RELAXED); //odd - write in progress
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	map->snapshot=snapshot;
+
+	__atomic_store_n(&map->sequence, map->sequence+1, __ATOMIC_RELEASE); //even - consistent
+}
+
+void DestroyObstacleMap(obstacle_map *map)
+{
+	if( munmap(map, sizeof(obstacle_map)) == -1 )
+		DieErrno("DestroyObstacleMap munmap");
+	if( shm_unlink(OBSTACLE_MAP_NAME) == -1 )
+		DieErrno("DestroyObstacleMap shm_unlink");
+}
+
+obstacle_map *OpenObstacleMap()
+{
+	int fd;
+	void *mem;
+	struct stat st;
+
+	if( (fd=shm_open(OBSTACLE_MAP_NAME, O_RDONLY | O_CLOEXEC, 0)) == -1 )
+		return NULL;
+
+	if( fstat(fd, &st) == -1 || st.st_size != sizeof(obstacle_map) )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	mem=mmap(NULL, sizeof(obstacle_map), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(mem == MAP_FAILED)
+		return NULL;
+
+	obstacle_map *map=(obstacle_map*)mem;
+
+	if( __atomic_load_n(&map->magic, __ATOMIC_ACQUIRE) != OBSTACLE_MAP_MAGIC || map->version != OBSTACLE_MAP_VERSION)
+	{
+		munmap(mem, sizeof(obstacle_map));
+		return NULL;
+	}
+
+	return map;
+}
+
+void CloseObstacleMap(obstacle_map *map)
+{
+	if( munmap(map, sizeof(obstacle_map)) == -1 )
+		DieErrno("CloseObstacleMap munmap");
+}
+
+void ReadObstacleMap(const obstacle_map *map, obstacle_snapshot *out)
+{
+	uint32_t before, after;
+
+	do
+	{
+		before=__atomic_load_n(&map->sequence, __ATOMIC_ACQUIRE);
+		if(before & 1)
+			continue; //write in progress
+
+		*out=map->snapshot;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after=__atomic_load_n(&map->sequence, __ATOMIC_RELAXED);
+	} while( (before & 1) || before != after );
+}
@@ -0,0 +1,70 @@
+/*
+ * ev3dev-mapping obstacle map header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Obstacle map is a tiny POSIX shared memory region with the nearest obstacle
+ * distance in each angular sector around the lidar.
+ *
+ * The writer (ev3laser) publishes after every lidar read, the readers
+ * (drive modules) use it for local collision reflex without network round trip.
+ *
+ * Sector 0 is centred on the lidar angle 0, sectors go in the lidar angle direction.
+ * The single record is protected by a seqlock (see sensor_bus.h).
+ */
+
+#pragma once
+
+#include <stdint.h> //uint16_t, uint32_t, uint64_t
+
+const char *const OBSTACLE_MAP_NAME="/ev3dev-mapping-obstacles";
+const uint32_t OBSTACLE_MAP_MAGIC=0x4556334F; //"EV3O"
+const uint32_t OBSTACLE_MAP_VERSION=1;
+
+const int OBSTACLE_SECTORS=12; //30 degrees each
+const int OBSTACLE_SECTOR_DEGREES=360/OBSTACLE_SECTORS;
+const uint16_t OBSTACLE_NONE=0xFFFF; //nothing seen in the sector
+
+struct obstacle_snapshot
+{
+	uint64_t timestamp_us;
+	uint16_t distance_mm[OBSTACLE_SECTORS];
+};
+
+struct obstacle_map
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;
+	obstacle_snapshot snapshot;
+};
+
+// writer side, dies on failure
+obstacle_map *CreateObstacleMap();
+void PublishObstacleMap(obstacle_map *map, const obstacle_snapshot &snapshot);
+void DestroyObstacleMap(obstacle_map *map);
+
+// reader side
+// returns NULL if there is no obstacle map (the laser is not running or doesn't publish)
+obstacle_map *OpenObstacleMap();
+void CloseObstacleMap(obstacle_map *map);
+void ReadObstacleMap(const obstacle_map *map, obstacle_snapshot *out);
+
+// maps angle in degrees to sector
+inline int ObstacleSector(int angle_degrees)
+{
+	angle_degrees = (angle_degrees + OBSTACLE_SECTOR_DEGREES/2) % 360;
+	if(angle_degrees < 0)
+		angle_degrees += 360;
+	return angle_degrees / OBSTACLE_SECTOR_DEGREES;
+}
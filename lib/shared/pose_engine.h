@@ -0,0 +1,422 @@
+/*
+ * ev3dev-mapping pose engine header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * PoseEngine is the sampling loop shared by ev3odometry, ev3dead-reconning and ev3car-reconning:
+ * -reads drive motor positions (Kinematics policy)
+ * -reads heading (Heading policy)
+ * -timestamps the data
+ * -sends the above data in UDP messages
+ *
+ * If ev3sampler is running the engine doesn't touch the hardware at all,
+ * it reads coherent snapshots from the sensor bus instead (see sensor_bus.h).
+ *
+ * Kinematics policy has to provide:
+ * -static const int ENCODERS - number of positions sent (1 or 2)
+ * -static const int BUS_FLAGS - SensorBusFlags of the motors used
+ * -static int BusPort(int encoder) - sensor bus motor index of encoder
+ * -void Init(const char *name) - checks hardware, dies on failure
+ * -void Read(int32_t *positions) - reads ENCODERS positions
+ *
+ * Heading policy has to provide:
+ * -static const int BUS_FLAGS - SensorBusFlags of the sensors used
+ * -static int16_t BusHeading(const sensor_snapshot &snapshot)
+ * -void Init(const char *name) - prepares the sensor, dies on failure
+ * -int Read(uint64_t timestamp_us, bool stationary, int16_t *heading) - 0 on success, -ENXIO if the sample should be collected again,
+ *  -EIO on failure
+ *  (stationary is true when the encoders didn't change since the previous sample)
+ * -void Close()
+ *
+ * Packet format (big endian):
+ * timestamp_us (8) | ENCODERS * position (4) | heading (2, zero if there is no heading sensor)
+ *
+ * This keeps the wire formats of the original modules:
+ * -ev3odometry 18 bytes (the last field was reserved for heading)
+ * -ev3dead-reconning 18 bytes
+ * -ev3car-reconning 14 bytes
+ *
+ * Change driven transmission (SetChangeDriven):
+ * -a sample is sent only if any encoder or the heading changed by more than threshold degrees
+ *  since the last sent sample or if heartbeat_ms elapsed since the last sent sample
+ * -every packet has additional sequence number (4 bytes) appended so that receiver
+ *  can tell silence (no gaps) from packet loss (gaps)
+ *
+ * Oversampling (SetOversampling):
+ * -the encoders are sampled at internal_hz and filtered (see pose_filter.h)
+ * -decimated samples are sent at poll_ms with filtered positions, timestamped at the filter
+ *  window centre (half poll_ms back)
+ * -heading is read only for the decimated samples
+ * -every packet has ENCODERS * velocity (4 bytes, counts/s Q24.8) appended after heading
+ *  (and before sequence number if change driven transmission is also used)
+ */
+
+#pragma once
+
+#include "misc.h"
+#include "net_udp.h"
+#include "sensor_bus.h"
+#include "pose_filter.h"
+
+#include <stdio.h> //printf
+#include <errno.h> //ENXIO, EIO
+#include <limits.h> //INT_MAX
+#include <stdlib.h> //abs
+#include <endian.h> //htobe16, htobe32, htobe64
+
+const int POSE_MAX_ENCODERS=2;
+const int POSE_STATIONARY_COUNTS=1; //encoder jitter tolerated when checking if robot is stationary
+const int POSE_HEADING_UNITS_PER_DEGREE=100;
+const int POSE_HALF_TURN=180*POSE_HEADING_UNITS_PER_DEGREE;
+
+struct pose_sample
+{
+	uint64_t timestamp_us;
+	int32_t position[POSE_MAX_ENCODERS];
+	int16_t heading;
+	int32_t velocity_q8[POSE_MAX_ENCODERS]; //only with oversampling
+};
+
+// validates SetChangeDriven arguments of the pose modules, prints the reason and returns -1 if invalid:
+// -threshold in range <0, 360>
+// -heartbeat_ms in range <poll_ms, 10000> or 0 (disabled, threshold has to be 0 then)
+inline int CheckChangeDriven(const char *name, long threshold, long heartbeat_ms, long poll_ms)
+{
+	if(threshold < 0 || threshold > 360)
+	{
+		fprintf(stderr, "%s: the argument change_threshold has to be in range <0, 360>\n", name);
+		return -1;
+	}
+	if(heartbeat_ms == 0 && threshold != 0)
+	{
+		fprintf(stderr, "%s: the argument change_threshold has to be 0 with heartbeat_ms 0 (disabled)\n", name);
+		return -1;
+	}
+	if(heartbeat_ms != 0 && (heartbeat_ms < poll_ms || heartbeat_ms > 10000))
+	{
+		fprintf(stderr, "%s: the argument heartbeat_ms has to be 0 or in range <poll_ms, 10000>\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+template <class Kinematics, class Heading>
+class PoseEngine
+{
+public:
+	static const int PACKET_BYTES = 8 + 4*Kinematics::ENCODERS + 2;
+	static const int MAX_PACKET_BYTES = PACKET_BYTES + 4*Kinematics::ENCODERS + 4;
+
+	explicit PoseEngine(const char *module_name): name(module_name), bus(NULL), bus_published(0), bus_last_us(0), has_last(false),
+		change_threshold(0), heartbeat_us(0), sequence(0), sent(0), suppressed(0), has_sent(false), internal_hz(0), decimation(1) {}
+
+	// threshold in degrees (encoder counts and heading degrees), 0 heartbeat disables
+	// (validate the arguments with CheckChangeDriven)
+	void SetChangeDriven(int threshold, int heartbeat_ms)
+	{
+		change_threshold=threshold;
+		heartbeat_us=(uint64_t)heartbeat_ms*1000;
+	}
+
+	// 0 disables, otherwise should be multiple of 1000/poll_ms
+	// with hz*poll_ms/1000 (decimation) at most POSE_FILTER_MAX_WINDOW
+	void SetOversampling(int hz)
+	{
+		internal_hz=hz;
+	}
+
+	void Init()
+	{
+		if( (bus=OpenSensorBus()) != NULL )
+		{
+			printf("%s: reading from sensor bus\n", name);
+			bus_last_us=TimestampUs();
+			return;
+		}
+		heading.Init(name);
+		kinematics.Init(name);
+	}
+	void Close()
+	{
+		if(bus)
+			CloseSensorBus(bus);
+		else
+			heading.Close();
+	}
+
+	void MainLoop(int socket_udp, const sockaddr_in &destination_udp, int poll_ms);
+
+	int EncodePacket(const pose_sample &sample, char *data) const;
+	void SendFrameUDP(int socket, const sockaddr_in &destination, const pose_sample &sample);
+private:
+	bool ShouldSend(const pose_sample &frame) const;
+
+	// 0 on success, -ENXIO to collect again, -EAGAIN if there is no new data
+	void SampleEncoders(pose_sample *frame);
+	int SampleHeading(pose_sample *frame);
+	int SampleBus(pose_sample *frame);
+
+	const char *name;
+	Kinematics kinematics;
+	Heading heading;
+
+	sensor_bus *bus;
+	uint32_t bus_published;
+	uint64_t bus_last_us;
+
+	int32_t last_position[POSE_MAX_ENCODERS];
+	bool has_last;
+
+	int change_threshold;
+	uint64_t heartbeat_us;
+	uint32_t sequence;
+	int sent, suppressed;
+	pose_sample last_sent;
+	bool has_sent;
+
+	int internal_hz;
+	int decimation;
+	PoseFilter<Kinematics::ENCODERS> filter;
+};
+
+template <class Kinematics, class Heading>
+void PoseEngine<Kinematics, Heading>::MainLoop(int socket_udp, const sockaddr_in &destination_udp, int poll_ms)
+{
+	const int BENCHS=INT_MAX;
+
+	pose_sample frame, raw;
+	uint64_t start=TimestampUs(), loop_start, internal_cpu_us=0, cpu_start;
+	int i, status, enxios=0, elapsed_us, poll_us=1000*poll_ms;
+	int tick=0, internal_samples=0;
+
+	decimation=internal_hz*poll_ms/1000;
+
+	if(decimation > 1)
+	{
+		poll_us /= decimation; //internal sampling period
+		//the filter has to span the whole output period to attenuate above output Nyquist
+		if( !filter.SetWindow(decimation) )
+		{
+			fprintf(stderr, "%s: ", name);
+			Die("oversampling exceeds the filter window");
+		}
+		printf("%s: oversampling %dx, internal period %d us\n", name, decimation, poll_us);
+	}
+	else
+		decimation=1;
+
+	for(i=0;i<BENCHS;++i)
+	{
+		loop_start=TimestampUs();
+
+		if(decimation > 1)
+		{
+			cpu_start=ThreadCpuTimeUs();
+
+			status=0;
+			if(bus)
+				status=SampleBus(&raw);
+			else
+				SampleEncoders(&raw);
+
+			if(status == 0)
+			{
+				filter.Push(raw.timestamp_us, raw.position);
+				frame.heading=raw.heading; //only bus snapshot has it, SampleHeading overwrites otherwise
+				++internal_samples;
+			}
+
+			internal_cpu_us += ThreadCpuTimeUs()-cpu_start;
+
+			if(++tick < decimation || !filter.Ready())
+				status=-EAGAIN;
+			else
+			{
+				tick=0;
+				frame.timestamp_us=filter.Output(frame.position, frame.velocity_q8);
+				//with bus the output doesn't wait for the next snapshot (the last pushed heading is used)
+				status = bus ? 0 : SampleHeading(&frame);
+				if(status == -ENXIO)
+					tick=decimation-1; //try heading again on next internal sample
+			}
+		}
+		else if(bus)
+			status=SampleBus(&frame);
+		else
+		{
+			SampleEncoders(&frame);
+			status=SampleHeading(&frame);
+		}
+
+		if(status == -EIO)
+		{
+			fprintf(stderr, "%s: ", name);
+			Die("heading read failed");
+		}
+		if(status == -ENXIO)
+		{ //this is workaround for occasional ENXIO problem
+			fprintf(stderr, "%s: got ENXIO, retrying %d\n", name, ++enxios);
+			--i;
+			continue; //we need to collect data again, this failure could be time consuming
+		}
+		if(status == 0)
+		{
+			if(ShouldSend(frame))
+				SendFrameUDP(socket_udp, destination_udp, frame);
+			else
+				++suppressed;
+		}
+		enxios=0; //part of workaround for occasional ENXIO
+
+		if(IsStandardInputEOF()) //the parent process has closed it's pipe end
+			break;
+
+		elapsed_us=(int)(TimestampUs()-loop_start);
+
+		if( elapsed_us < poll_us )
+			SleepUs(poll_us - elapsed_us);
+	}
+
+	uint64_t end=TimestampUs();
+	double seconds_elapsed=(end-start)/ 1000000.0L;
+	printf("%s: average loop %f seconds\n", name, seconds_elapsed/i);
+	if(decimation > 1 && internal_samples)
+		printf("%s: %d internal samples, cpu %f us per internal sample\n", name, internal_samples, internal_cpu_us / (double)internal_samples);
+	if(heartbeat_us)
+		printf("%s: sent %d samples, suppressed %d unchanged\n", name, sent, suppressed);
+}
+
+template <class Kinematics, class Heading>
+bool PoseEngine<Kinematics, Heading>::ShouldSend(const pose_sample &frame) const
+{
+	if(!heartbeat_us || !has_sent)
+		return true;
+
+	if(frame.timestamp_us - last_sent.timestamp_us >= heartbeat_us)
+		return true;
+
+	for(int e=0;e<Kinematics::ENCODERS;++e)
+		if(abs(frame.position[e]-last_sent.position[e]) > change_threshold)
+			return true;
+
+	int heading_change=abs((int)frame.heading-last_sent.heading);
+	if(heading_change > POSE_HALF_TURN) //wrapped around
+		heading_change=2*POSE_HALF_TURN-heading_change;
+
+	return heading_change > change_threshold*POSE_HEADING_UNITS_PER_DEGREE;
+}
+
+template <class Kinematics, class Heading>
+void PoseEngine<Kinematics, Heading>::SampleEncoders(pose_sample *frame)
+{
+	frame->timestamp_us=TimestampUs();
+	kinematics.Read(frame->position);
+}
+
+template <class Kinematics, class Heading>
+int PoseEngine<Kinematics, Heading>::SampleHeading(pose_sample *frame)
+{
+	bool stationary=has_last;
+
+	for(int e=0;e<Kinematics::ENCODERS;++e)
+	{
+		if(abs(frame->position[e]-last_position[e]) > POSE_STATIONARY_COUNTS)
+			stationary=false;
+		last_position[e]=frame->position[e];
+	}
+	has_last=true;
+
+	return heading.Read(frame->timestamp_us, stationary, &frame->heading);
+}
+
+template <class Kinematics, class Heading>
+int PoseEngine<Kinematics, Heading>::SampleBus(pose_sample *frame)
+{
+	const int REQUIRED_FLAGS=Kinematics::BUS_FLAGS | Heading::BUS_FLAGS;
+	sensor_snapshot snapshot;
+
+	if( !ReadSensorBus(bus, &bus_published, &snapshot) )
+	{
+		if(TimestampUs() - bus_last_us > (uint64_t)SENSOR_BUS_STALE_MS*1000)
+		{
+			fprintf(stderr, "%s: ", name);
+			Die("sensor bus is stale, is ev3sampler running?");
+		}
+		return -EAGAIN;
+	}
+	bus_last_us=TimestampUs();
+
+	if( (snapshot.flags & REQUIRED_FLAGS) != REQUIRED_FLAGS )
+	{
+		fprintf(stderr, "%s: ", name);
+		Die("sensor bus doesn't provide required sensors");
+	}
+
+	//all the data comes from the same sampler tick
+	frame->timestamp_us=snapshot.timestamp_us;
+	for(int e=0;e<Kinematics::ENCODERS;++e)
+		frame->position[e]=snapshot.position[Kinematics::BusPort(e)];
+	frame->heading=Heading::BusHeading(snapshot);
+
+	return 0;
+}
+
+template <class Kinematics, class Heading>
+int PoseEngine<Kinematics, Heading>::EncodePacket(const pose_sample &p, char *data) const
+{
+	*((uint64_t*)data) = htobe64(p.timestamp_us);
+	data += sizeof(p.timestamp_us);
+
+	for(int e=0;e<Kinematics::ENCODERS;++e)
+	{
+		*((uint32_t*)data)= htobe32(p.position[e]);
+		data += sizeof(p.position[e]);
+	}
+
+	*((uint16_t*)data)= htobe16(p.heading);
+	data += sizeof(p.heading);
+
+	int length=PACKET_BYTES;
+
+	if(decimation > 1)
+	{
+		for(int e=0;e<Kinematics::ENCODERS;++e)
+		{
+			*((uint32_t*)data)= htobe32(p.velocity_q8[e]);
+			data += sizeof(p.velocity_q8[e]);
+		}
+		length += 4*Kinematics::ENCODERS;
+	}
+
+	if(heartbeat_us)
+	{
+		*((uint32_t*)data)= htobe32(sequence);
+		data += sizeof(sequence);
+		length += 4;
+	}
+
+	return length;
+}
+
+template <class Kinematics, class Heading>
+void PoseEngine<Kinematics, Heading>::SendFrameUDP(int socket, const sockaddr_in &destination, const pose_sample &frame)
+{
+	static char buffer[MAX_PACKET_BYTES];
+	int length=EncodePacket(frame, buffer);
+	SendToUDP(socket, destination, buffer, length);
+
+	++sequence;
+	++sent;
+	last_sent=frame;
+	has_sent=true;
+}
@@ -0,0 +1,120 @@
+/*
+ * ev3dev-mapping pose filter header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * PoseFilter is the anti-alias filter used by PoseEngine when oversampling.
+ *
+ * The encoders are sampled at high internal rate and PoseFilter keeps the last
+ * window of raw samples. At output rate it fits a straight line to the window
+ * (first order Savitzky-Golay) and returns:
+ * -position - the fit evaluated at the window centre (the mean of the window)
+ * -velocity - the slope of the fit in counts per second (Q24.8 fixed point)
+ * -timestamp - of the window centre (the mean of the window timestamps)
+ *
+ * With the window spanning the output period the position is boxcar decimator:
+ * -3 to -4 dB at output Nyquist, nulls at multiples of output rate, at least -8 dB from
+ * 1.5 times output Nyquist (-10 dB for decimation 10 and more, sidelobes -13 dB),
+ * see ev3odometry/tests (make bench, fails out of these limits).
+ * The price is the delay of half the output period (reported in the timestamp).
+ *
+ * Push is O(ENCODERS), Output is O(window * ENCODERS) and only integer arithmetic is used.
+ */
+
+#pragma once
+
+#include <stdint.h> //int32_t, int64_t, uint64_t
+
+const int POSE_FILTER_MAX_WINDOW=32;
+const int POSE_VELOCITY_FRACTIONAL_BITS=8;
+
+template <int ENCODERS>
+class PoseFilter
+{
+public:
+	PoseFilter(): window(0), count(0), next(0) {}
+
+	// the window should span the output period (decimation), false if not in range <2, POSE_FILTER_MAX_WINDOW>
+	bool SetWindow(int samples)
+	{
+		if(samples < 2 || samples > POSE_FILTER_MAX_WINDOW)
+			return false;
+		window=samples;
+		count=next=0;
+		return true;
+	}
+
+	void Push(uint64_t timestamp_us, const int32_t *position)
+	{
+		timestamps[next]=timestamp_us;
+		for(int e=0;e<ENCODERS;++e)
+			positions[next][e]=position[e];
+
+		next = (next+1) % window;
+		if(count < window)
+			++count;
+	}
+
+	bool Ready() const { return count == window; }
+
+	// returns the timestamp of the window centre
+	// prerequisities: Ready() is true
+	uint64_t Output(int32_t *out_position, int32_t *out_velocity_q8) const
+	{
+		const int newest=(next+window-1) % window;
+		const int oldest=next;
+		const int64_t span_us=(int64_t)(timestamps[newest]-timestamps[oldest]);
+
+		uint64_t sum_us=0;
+		for(int j=0;j<window;++j)
+			sum_us += timestamps[(oldest+j) % window]-timestamps[oldest];
+
+		// abscissa k=2j-(window-1) for j-th oldest sample, keeps k integer for even windows
+		int64_t sum_kk=0;
+		for(int j=0;j<window;++j)
+		{
+			int64_t k=2*j-(window-1);
+			sum_kk += k*k;
+		}
+
+		for(int e=0;e<ENCODERS;++e)
+		{
+			const int32_t reference=positions[newest][e]; //keeps the sums small
+			int64_t sum_x=0, sum_kx=0;
+
+			for(int j=0;j<window;++j)
+			{
+				int64_t x=positions[(oldest+j) % window][e] - reference;
+				sum_x += x;
+				sum_kx += (2*j-(window-1))*x;
+			}
+
+			// fit at window centre (k=0) is the mean
+			out_position[e]=reference + (int32_t)(sum_x / window);
+
+			// slope per sample is 2*sum_kx/sum_kk, sample period is span_us/(window-1)
+			if(span_us > 0)
+				out_velocity_q8[e]=(int32_t)( 2*sum_kx*(window-1)*1000000*(1 << POSE_VELOCITY_FRACTIONAL_BITS) / (sum_kk*span_us) );
+			else
+				out_velocity_q8[e]=0;
+		}
+
+		return timestamps[oldest] + sum_us/window;
+	}
+private:
+	int window;
+	int count;
+	int next;
+	uint64_t timestamps[POSE_FILTER_MAX_WINDOW];
+	int32_t positions[POSE_FILTER_MAX_WINDOW][ENCODERS];
+};
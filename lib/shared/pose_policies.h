@@ -0,0 +1,288 @@
+/*
+ * ev3dev-mapping pose engine policies header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Kinematics and Heading policies for PoseEngine (see pose_engine.h)
+ *
+ * Kinematics:
+ * -DifferentialDrive - two large motors on ports A (left) and D (right)
+ * -AckermannDrive - single large drive motor on port A (steering is not sampled)
+ *
+ * Heading:
+ * -NoHeading - heading field is sent as zero
+ * -CruizCoreHeading - MicroInfinity CruizCore XG1300L on port 3 (manually loaded I2C driver)
+ *  with online bias estimation while stationary and bias cache (see gyro_bias.h)
+ */
+
+#pragma once
+
+#include "misc.h"
+#include "gyro_bias.h"
+#include "sensor_bus.h"
+#include "sysfs.h"
+
+#include "ev3dev-lang-cpp/ev3dev.h"
+
+#include <stdio.h> //printf, snprintf
+#include <string.h> //memcpy
+#include <errno.h> //errno, ENXIO, EIO
+#include <unistd.h> //pread, close
+#include <fcntl.h> //open, O_RDONLY
+
+// GYRO CONSTANTS
+const char *const GYRO_PORT="i2c-legoev35:i2c1";
+const int GYRO_PATH_MAX=100;
+const int GYRO_ANGLE_REGISTER=0x42;
+
+class DifferentialDrive
+{
+public:
+	static const int ENCODERS=2;
+	static const int BUS_FLAGS=SENSOR_BUS_MOTOR_A | SENSOR_BUS_MOTOR_D;
+
+	static int BusPort(int encoder) { return encoder == 0 ? 0 : 3; }
+
+	DifferentialDrive(): left(ev3dev::OUTPUT_A), right(ev3dev::OUTPUT_D), left_fd(-1), right_fd(-1) {}
+	~DifferentialDrive()
+	{
+		if(left_fd != -1)
+			close(left_fd);
+		if(right_fd != -1)
+			close(right_fd);
+	}
+
+	void Init(const char *name)
+	{
+		if(!left.connected() || !right.connected())
+		{
+			fprintf(stderr, "%s: ", name);
+			Die("motor not connected");
+		}
+		left_fd=OpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, left.device_index(), "position", O_RDONLY);
+		right_fd=OpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, right.device_index(), "position", O_RDONLY);
+	}
+	void Read(int32_t *position)
+	{
+		if( ReadSysfsInt(left_fd, position) == -1 || ReadSysfsInt(right_fd, position+1) == -1 )
+			DieErrno("DifferentialDrive: read motor position failed");
+	}
+private:
+	ev3dev::large_motor left;
+	ev3dev::large_motor right;
+	int left_fd, right_fd;
+};
+
+class AckermannDrive
+{
+public:
+	static const int ENCODERS=1;
+	static const int BUS_FLAGS=SENSOR_BUS_MOTOR_A;
+
+	static int BusPort(int encoder) { return 0; }
+
+	AckermannDrive(): drive(ev3dev::OUTPUT_A), drive_fd(-1) {}
+	~AckermannDrive()
+	{
+		if(drive_fd != -1)
+			close(drive_fd);
+	}
+
+	void Init(const char *name)
+	{
+		if(!drive.connected())
+		{
+			fprintf(stderr, "%s: ", name);
+			Die("motor not connected");
+		}
+		drive_fd=OpenSysfsAttribute(SYSFS_TACHO_MOTOR_PATH, drive.device_index(), "position", O_RDONLY);
+	}
+	void Read(int32_t *position)
+	{
+		if( ReadSysfsInt(drive_fd, position) == -1 )
+			DieErrno("AckermannDrive: read motor position failed");
+	}
+private:
+	ev3dev::large_motor drive;
+	int drive_fd;
+};
+
+class NoHeading
+{
+public:
+	static const int BUS_FLAGS=0;
+
+	static int16_t BusHeading(const sensor_snapshot &snapshot) { return 0; }
+
+	void Init(const char *name) {}
+	int Read(uint64_t timestamp_us, bool stationary, int16_t *heading)
+	{
+		*heading=0;
+		return 0;
+	}
+	void Close() {}
+};
+
+class CruizCoreHeading
+{
+public:
+	static const int BUS_FLAGS=SENSOR_BUS_GYRO;
+
+	static int16_t BusHeading(const sensor_snapshot &snapshot) { return snapshot.heading; }
+
+	CruizCoreHeading(): gyro(GYRO_PORT, {"mi-xg1300l"}), direct_fd(-1), saved_updates(0), saved_us(0) {}
+
+	void Init(const char *name)
+	{
+		if(Open(name) == -1)
+			Die("CruizCoreHeading: gyroscope initialization failed");
+	}
+
+	// like Init but returns -1 on failure (reported on stderr) instead of dying, e.g. for hosted modules
+	int Open(const char *name)
+	{
+		char path[GYRO_PATH_MAX];
+		gyro_bias_cache cache;
+		int16_t raw_angle;
+		int result;
+
+		this->name=name;
+
+		if(!gyro.connected())
+		{
+			fprintf(stderr, "%s: unable to find gyroscope\n", name);
+			return -1;
+		}
+
+		gyro.set_poll_ms(0);
+
+		bool cached = LoadGyroBiasCache(GYRO_CACHE_PATH, &cache) == 0;
+
+		if(cached)
+			printf("%s: using cached gyroscope bias %d/65536 0.01 deg/s\n", name, cache.bias_q16);
+		else
+		{
+			gyro.set_command("RESET");
+
+			printf("%s: callculating gyroscope bias drift\n", name);
+			fflush(stdout);
+			Sleep(1000);
+
+			//the sensor has new calibration, the old residual bias doesn't apply anymore
+			cache.bias_q16=0;
+			cache.temperature_mc=ReadTemperature();
+			SaveGyroBiasCache(GYRO_CACHE_PATH, cache);
+		}
+
+		snprintf(path, GYRO_PATH_MAX, "/sys/class/lego-sensor/sensor%d/direct", gyro.device_index());
+
+		if((direct_fd=open(path, O_RDONLY | O_CLOEXEC))==-1)
+		{
+			perror("CruizCoreHeading: open(GYRO_PATH, O_RDONLY)");
+			return -1;
+		}
+
+		while( (result=ReadRawAngle(&raw_angle)) == -ENXIO)
+			fprintf(stderr, "%s: got ENXIO, retrying initial angle\n", name);
+
+		if(result == -EIO)
+		{
+			close(direct_fd);
+			direct_fd=-1;
+			return -1;
+		}
+
+		//with the cache we skip RESET so current angle becomes zero heading
+		bias.Start(TimestampUs(), cached ? raw_angle : 0, cache.bias_q16, cached);
+		saved_us=TimestampUs();
+
+		printf("%s: gyroscope ready\n", name);
+		return 0;
+	}
+
+	// -ENXIO to read again, -EIO on failure (reported on stderr)
+	int Read(uint64_t timestamp_us, bool stationary, int16_t *out_heading)
+	{
+		int16_t raw_angle;
+		int result;
+
+		if( (result=ReadRawAngle(&raw_angle)) != 0 )
+			return result;
+
+		*out_heading=bias.Correct(timestamp_us, raw_angle, stationary);
+
+		if(bias.Updates() != saved_updates && timestamp_us - saved_us >= (uint64_t)GYRO_CACHE_SAVE_MS*1000)
+			SaveBias(timestamp_us);
+
+		return 0;
+	}
+
+	void Close()
+	{
+		if(bias.BiasValid() && bias.Updates() != saved_updates)
+			SaveBias(TimestampUs());
+
+		if(bias.BiasValid())
+			printf("%s: gyroscope bias %d/65536 0.01 deg/s (%d updates)\n", name, bias.BiasQ16(), bias.Updates());
+
+		if(direct_fd!=-1)
+			close(direct_fd);
+		direct_fd=-1;
+	}
+private:
+	int ReadRawAngle(int16_t *out_angle)
+	{
+		char temp[2];
+		int result;
+
+		if( (result=pread(direct_fd, temp, 2, GYRO_ANGLE_REGISTER)) == 2)
+		{
+			memcpy(out_angle, temp, 2);
+			return 0;
+		}
+
+		if( (result <= 0 && errno != ENXIO) )
+		{
+			perror("CruizCoreHeading: read Gyro failed");
+			return -EIO;
+		}
+
+		if( result == 1)
+		{
+			fprintf(stderr, "CruizCoreHeading: incomplete I2C read\n");
+			return -EIO;
+		}
+
+		return -ENXIO;
+	}
+
+	void SaveBias(uint64_t timestamp_us)
+	{
+		gyro_bias_cache cache;
+		cache.bias_q16=bias.BiasQ16();
+		cache.temperature_mc=ReadTemperature();
+
+		if(SaveGyroBiasCache(GYRO_CACHE_PATH, cache) == -1)
+			fprintf(stderr, "%s: unable to save gyroscope bias cache %s\n", name, GYRO_CACHE_PATH);
+
+		saved_updates=bias.Updates();
+		saved_us=timestamp_us;
+	}
+
+	const char *name;
+	ev3dev::i2c_sensor gyro;
+	int direct_fd;
+	GyroBias bias;
+	int saved_updates;
+	uint64_t saved_us;
+};
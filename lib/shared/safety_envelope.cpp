@@ -0,0 +1,133 @@
+/*
+ * ev3dev-mapping safety envelope implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "safety_envelope.h"
+
+#include "misc.h"
+
+#include <endian.h> //htobe16, htobe64
+#include <stdio.h> //printf
+
+SafetyEnvelope::SafetyEnvelope(int stop, int slow): stop_mm(stop), slow_mm(slow), map(NULL), last_open_us(0),
+	zone(SAFETY_CLEAR), sector(0), distance_mm(OBSTACLE_NONE), reported_zone(SAFETY_CLEAR), reported_us(0),
+	interventions(0), stops(0), reports(0), stale(0)
+{
+	if(slow_mm < stop_mm)
+		slow_mm=stop_mm;
+}
+
+SafetyEnvelope::~SafetyEnvelope()
+{
+	if(map)
+		CloseObstacleMap(map);
+}
+
+SafetyZone SafetyEnvelope::Update(uint64_t now_us)
+{
+	obstacle_snapshot snapshot;
+
+	zone=SAFETY_CLEAR;
+	distance_mm=OBSTACLE_NONE;
+
+	if(!Enabled())
+		return zone;
+
+	if(!map && (last_open_us == 0 || now_us - last_open_us >= (uint64_t)SAFETY_OPEN_RETRY_MS*1000))
+	{
+		last_open_us=now_us;
+		map=OpenObstacleMap();
+	}
+
+	if(!map)
+		return zone;
+
+	ReadObstacleMap(map, &snapshot);
+
+	//the laser may be restarted with new map (the old one is unlinked), reopen it
+	if(snapshot.timestamp_us == 0 || now_us - snapshot.timestamp_us > (uint64_t)SAFETY_STALE_MS*1000)
+	{
+		++stale;
+		CloseObstacleMap(map);
+		map=NULL;
+		return zone;
+	}
+
+	int front=ObstacleSector(SAFETY_FRONT_ANGLE);
+
+	for(int i=-SAFETY_FRONT_HALF_SECTORS;i<=SAFETY_FRONT_HALF_SECTORS;++i)
+	{
+		int s=(front + i + OBSTACLE_SECTORS) % OBSTACLE_SECTORS;
+		if(snapshot.distance_mm[s] < distance_mm)
+		{
+			distance_mm=snapshot.distance_mm[s];
+			sector=s;
+		}
+	}
+
+	if(distance_mm <= stop_mm)
+		zone=SAFETY_STOP;
+	else if(distance_mm < slow_mm)
+		zone=SAFETY_SLOW;
+
+	return zone;
+}
+
+int SafetyEnvelope::LimitForward(int forward) const
+{
+	if(forward <= 0 || zone == SAFETY_CLEAR)
+		return forward;
+	if(zone == SAFETY_STOP)
+		return 0;
+
+	return forward * (distance_mm - stop_mm) / (slow_mm - stop_mm);
+}
+
+bool SafetyEnvelope::Intervene(uint64_t now_us)
+{
+	++interventions;
+	if(zone == SAFETY_STOP)
+		++stops;
+
+	if(zone == reported_zone && now_us - reported_us < (uint64_t)SAFETY_REPORT_MS*1000)
+		return false;
+
+	reported_zone=zone;
+	reported_us=now_us;
+	++reports;
+	return true;
+}
+
+int SafetyEnvelope::EncodeIntervention(char *data, int command, int requested, int applied) const
+{
+	*((uint64_t*)data)=htobe64(TimestampUs());
+	*((int16_t*)(data+8))=htobe16((int16_t)command);
+	*((int16_t*)(data+10))=htobe16((int16_t)zone);
+	*((int16_t*)(data+12))=htobe16((int16_t)sector);
+	*((uint16_t*)(data+14))=htobe16((uint16_t)distance_mm);
+	*((int16_t*)(data+16))=htobe16((int16_t)requested);
+	*((int16_t*)(data+18))=htobe16((int16_t)applied);
+
+	return SAFETY_INTERVENTION_BYTES;
+}
+
+void SafetyEnvelope::Print(const char *module) const
+{
+	if(!Enabled())
+	{
+		printf("%s: safety envelope disabled\n", module);
+		return;
+	}
+	printf("%s: safety envelope stop %d mm, slow %d mm, obstacle map %s\n", module, stop_mm, slow_mm, map ? "open" : "not found");
+	printf("%s: safety interventions %u (stops %u), reported %u, stale map reads %u\n", module, interventions, stops, reports, stale);
+}
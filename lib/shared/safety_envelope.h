@@ -0,0 +1,89 @@
+/*
+ * ev3dev-mapping safety envelope header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * SafetyEnvelope is the local collision reflex of the drive modules.
+ *
+ * It reads the obstacle map published by ev3laser (see obstacle_map.h)
+ * and limits forward speed by the nearest obstacle in the front sectors:
+ * -at or below stop_mm forward motion is zeroed
+ * -between stop_mm and slow_mm forward speed is scaled linearly
+ * -otherwise no limit
+ *
+ * The map is opened lazily (the laser may start after the drive module)
+ * and reopened when it gets stale (the laser may be restarted).
+ * Missing or stale map means no limit - the reflex is an addition to the controller, not a replacement.
+ * Reverse and rotation in place are never limited.
+ *
+ * Intervention datagram (big endian):
+ * uint64 timestamp_us | int16 command | int16 zone | int16 sector | uint16 distance_mm | int16 requested | int16 applied
+ * where requested and applied are the forward speed (or duty cycle) before and after the limit.
+ * Interventions are reported on zone change and then at most every SAFETY_REPORT_MS.
+ */
+
+#pragma once
+
+#include "obstacle_map.h"
+
+#include <stdint.h> //uint64_t
+
+const int SAFETY_CHECK_MS=20;
+const int SAFETY_FRONT_ANGLE=0; //lidar angle looking forward
+const int SAFETY_FRONT_HALF_SECTORS=1; //sectors checked on each side of the front one
+const int SAFETY_STALE_MS=500;
+const int SAFETY_OPEN_RETRY_MS=1000;
+const int SAFETY_REPORT_MS=200;
+const int SAFETY_INTERVENTION_BYTES=20;
+
+enum SafetyZone {SAFETY_CLEAR=0, SAFETY_SLOW=1, SAFETY_STOP=2};
+
+class SafetyEnvelope
+{
+public:
+	// stop_mm 0 disables the envelope
+	SafetyEnvelope(int stop_mm, int slow_mm);
+	~SafetyEnvelope();
+
+	bool Enabled() const { return stop_mm > 0; }
+
+	// refreshes the zone from the obstacle map
+	SafetyZone Update(uint64_t now_us);
+
+	// limits the forward (positive) value, negative values pass
+	int LimitForward(int forward) const;
+
+	// counts intervention, returns true if it should be reported now
+	bool Intervene(uint64_t now_us);
+
+	int EncodeIntervention(char *data, int command, int requested, int applied) const;
+
+	SafetyZone Zone() const { return zone; }
+	int Sector() const { return sector; }
+	int DistanceMm() const { return distance_mm; }
+
+	void Print(const char *module) const;
+private:
+	int stop_mm, slow_mm;
+	obstacle_map *map;
+	uint64_t last_open_us;
+
+	SafetyZone zone;
+	int sector;
+	int distance_mm;
+
+	SafetyZone reported_zone;
+	uint64_t reported_us;
+
+	uint32_t interventions, stops, reports, stale;
+};
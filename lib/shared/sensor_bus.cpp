@@ -0,0 +1,172 @@
+/*
+ * ev3dev-mapping sensor bus implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "sensor_bus.h"
+
+#include "misc.h"
+
+#include <sys/mman.h> //shm_open, mmap
+#include <sys/stat.h> //mode constants
+#include <fcntl.h> //O_* constants
+#include <unistd.h> //ftruncate, close
+#include <string.h> //memset
+#include <stdio.h> //fprintf, perror
+
+sensor_bus *CreateSensorBus(int poll_us)
+{
+	int fd;
+	void *mem;
+
+	if( (fd=shm_open(SENSOR_BUS_NAME, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 )
+	{
+		perror("CreateSensorBus shm_open");
+		return NULL;
+	}
+
+	if( ftruncate(fd, sizeof(sensor_bus)) == -1 || (mem=mmap(NULL, sizeof(sensor_bus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED )
+	{
+		perror("CreateSensorBus ftruncate/mmap");
+		close(fd);
+		shm_unlink(SENSOR_BUS_NAME);
+		return NULL;
+	}
+
+	close(fd);
+
+	sensor_bus *bus=(sensor_bus*)mem;
+	memset(bus, 0, sizeof(sensor_bus));
+	bus->version=SENSOR_BUS_VERSION;
+	bus->poll_us=poll_us;
+
+	//readers check magic last
+	__atomic_store_n(&bus->magic, SENSOR_BUS_MAGIC, __ATOMIC_RELEASE);
+
+	return bus;
+}
+
+void PublishSensorBus(sensor_bus *bus, const sensor_snapshot &snapshot)
+{
+	uint32_t published=bus->published;
+	sensor_bus_slot *slot=bus->slots + (published % SENSOR_BUS_SLOTS);
+
+	__atomic_store_n(&slot->sequence, slot->sequence+1, __ATOMIC_RELAXED); //odd - write in progress
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->snapshot=snapshot;
+
+	__atomic_store_n(&slot->sequence, slot->sequence+1, __ATOMIC_RELEASE); //even - consistent
+	__atomic_store_n(&bus->published, published+1, __ATOMIC_RELEASE);
+}
+
+void DestroySensorBus(sensor_bus *bus)
+{
+	if( munmap(bus, sizeof(sensor_bus)) == -1 )
+		perror("DestroySensorBus munmap");
+	if( shm_unlink(SENSOR_BUS_NAME) == -1 )
+		perror("DestroySensorBus shm_unlink");
+}
+
+// the bus left behind by the sampler that didn't exit cleanly (e.g. SIGKILL) has no new snapshots,
+// the sampler that has just started may have not published yet so the first one is waited for
+bool SensorBusFresh(const sensor_bus *bus)
+{
+	const uint64_t STALE_US=(uint64_t)SENSOR_BUS_STALE_MS*1000;
+	uint64_t start_us=TimestampUs();
+	uint32_t published=0;
+	sensor_snapshot snapshot;
+
+	while( !ReadSensorBus(bus, &published, &snapshot) )
+	{
+		if(TimestampUs() - start_us > STALE_US)
+			return false;
+		SleepUs(STALE_US/100);
+	}
+
+	return TimestampUs() - snapshot.timestamp_us <= STALE_US;
+}
+
+sensor_bus *OpenSensorBus()
+{
+	int fd;
+	void *mem;
+	struct stat st;
+
+	if( (fd=shm_open(SENSOR_BUS_NAME, O_RDONLY | O_CLOEXEC, 0)) == -1 )
+		return NULL;
+
+	if( fstat(fd, &st) == -1 || st.st_size != sizeof(sensor_bus) )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	mem=mmap(NULL, sizeof(sensor_bus), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(mem == MAP_FAILED)
+		return NULL;
+
+	sensor_bus *bus=(sensor_bus*)mem;
+
+	if( __atomic_load_n(&bus->magic, __ATOMIC_ACQUIRE) != SENSOR_BUS_MAGIC || bus->version != SENSOR_BUS_VERSION)
+	{
+		munmap(mem, sizeof(sensor_bus));
+		return NULL;
+	}
+
+	if( !SensorBusFresh(bus) )
+	{
+		fprintf(stderr, "OpenSensorBus: ignoring stale sensor bus, ev3sampler is not running\n");
+		munmap(mem, sizeof(sensor_bus));
+		return NULL;
+	}
+
+	return bus;
+}
+
+void CloseSensorBus(sensor_bus *bus)
+{
+	if( munmap(bus, sizeof(sensor_bus)) == -1 )
+		DieErrno("CloseSensorBus munmap");
+}
+
+bool ReadSensorBus(const sensor_bus *bus, uint32_t *last_published, sensor_snapshot *out)
+{
+	uint32_t published, before, after;
+
+	while(true)
+	{
+		published=__atomic_load_n(&bus->published, __ATOMIC_ACQUIRE);
+
+		if(published == 0 || published == *last_published)
+			return false;
+
+		const sensor_bus_slot *slot=bus->slots + ((published-1) % SENSOR_BUS_SLOTS);
+
+		before=__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if(before & 1) //writer is lapping us in this slot, take the newer one
+			continue;
+
+		*out=slot->snapshot;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after=__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+
+		if(before == after)
+			break;
+	}
+
+	*last_published=published;
+	return true;
+}
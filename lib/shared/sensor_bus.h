@@ -0,0 +1,79 @@
+/*
+ * ev3dev-mapping sensor bus header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Sensor bus is a POSIX shared memory ring of timestamped sensor snapshots.
+ *
+ * There is a single writer (ev3sampler) that reads the tacho motors and the gyroscope
+ * on common tick and publishes snapshots. Any number of modules read the snapshots.
+ *
+ * Each slot is protected by a seqlock:
+ * -the writer makes the sequence odd, writes the snapshot, makes the sequence even
+ * -the reader copies the snapshot and retries if the sequence was odd or has changed
+ *
+ * The writer never waits for the readers and the readers never block the writer.
+ */
+
+#pragma once
+
+#include <stdint.h> //uint16_t, uint32_t, uint64_t, int32_t
+
+const char *const SENSOR_BUS_NAME="/ev3dev-mapping-sensor-bus";
+const uint32_t SENSOR_BUS_MAGIC=0x45563342; //"EV3B"
+const uint32_t SENSOR_BUS_VERSION=1;
+
+const int SENSOR_BUS_SLOTS=64; //power of 2
+const int SENSOR_BUS_MOTORS=4; //ports A, B, C, D
+const int SENSOR_BUS_STALE_MS=1000; //readers give up if there is no new snapshot for that long
+
+enum SensorBusFlags {SENSOR_BUS_MOTOR_A=1, SENSOR_BUS_MOTOR_B=2, SENSOR_BUS_MOTOR_C=4, SENSOR_BUS_MOTOR_D=8, SENSOR_BUS_GYRO=16};
+
+struct sensor_snapshot
+{
+	uint64_t timestamp_us;
+	int32_t position[SENSOR_BUS_MOTORS];
+	int16_t heading; //bias corrected, 0.01 degree units
+	uint16_t flags; //SensorBusFlags for the sensors present in snapshot
+};
+
+struct sensor_bus_slot
+{
+	uint32_t sequence;
+	sensor_snapshot snapshot;
+};
+
+struct sensor_bus
+{
+	uint32_t magic;
+	uint32_t version;
+	int32_t poll_us;
+	uint32_t published; //total number of published snapshots, the newest is in slot (published-1) % SENSOR_BUS_SLOTS
+	sensor_bus_slot slots[SENSOR_BUS_SLOTS];
+};
+
+// writer side, failures are reported on stderr
+// returns NULL on failure
+sensor_bus *CreateSensorBus(int poll_us);
+void PublishSensorBus(sensor_bus *bus, const sensor_snapshot &snapshot);
+void DestroySensorBus(sensor_bus *bus);
+
+// reader side
+// returns NULL if there is no sensor bus or it is stale (the sampler is not running),
+// may wait up to SENSOR_BUS_STALE_MS for the first snapshot of just started sampler
+sensor_bus *OpenSensorBus();
+void CloseSensorBus(sensor_bus *bus);
+
+// copies the newest snapshot
+// returns false if there was nothing newer than last_published (which is updated on success)
+bool ReadSensorBus(const sensor_bus *bus, uint32_t *last_published, sensor_snapshot *out);
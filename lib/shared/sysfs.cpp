@@ -0,0 +1,94 @@
+/*
+ * ev3dev-mapping sysfs attribute access implementation file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "sysfs.h"
+
+#include "misc.h"
+
+#include <stdio.h> //snprintf
+#include <stdlib.h> //strtol
+#include <string.h> //strtok_r, strcmp
+#include <errno.h> //errno
+#include <unistd.h> //pread
+#include <fcntl.h> //open
+
+const int SYSFS_PATH_MAX=128;
+const int SYSFS_INT_MAX_CHARS=16;
+const int SYSFS_STATE_MAX_CHARS=64;
+
+int OpenSysfsAttribute(const char *class_path, int device_index, const char *attribute, int flags)
+{
+	int fd;
+
+	if( (fd=TryOpenSysfsAttribute(class_path, device_index, attribute, flags)) == -1 )
+		Die("OpenSysfsAttribute open failed");
+	return fd;
+}
+
+int TryOpenSysfsAttribute(const char *class_path, int device_index, const char *attribute, int flags)
+{
+	char path[SYSFS_PATH_MAX];
+	int fd;
+
+	snprintf(path, SYSFS_PATH_MAX, "%s%d/%s", class_path, device_index, attribute);
+
+	if( (fd=open(path, flags | O_CLOEXEC)) == -1 )
+		perror(path);
+	return fd;
+}
+
+int ReadSysfsInt(int fd, int *value)
+{
+	char buffer[SYSFS_INT_MAX_CHARS];
+	int result;
+
+	if( (result=pread(fd, buffer, SYSFS_INT_MAX_CHARS-1, 0)) <= 0 )
+	{
+		if(result == 0)
+			errno=ENODATA;
+		return -1;
+	}
+
+	buffer[result]='\0';
+	*value=strtol(buffer, NULL, 10);
+	return 0;
+}
+
+int ReadSysfsMotorState(int fd, int *flags)
+{
+	char buffer[SYSFS_STATE_MAX_CHARS];
+	char *word, *saveptr;
+	int result;
+
+	if( (result=pread(fd, buffer, SYSFS_STATE_MAX_CHARS-1, 0)) < 0 )
+		return -1;
+
+	buffer[result]='\0';
+	*flags=0;
+
+	for(word=strtok_r(buffer, " \n", &saveptr); word != NULL; word=strtok_r(NULL, " \n", &saveptr))
+	{
+		if(!strcmp(word, "running"))
+			*flags |= MOTOR_STATE_RUNNING;
+		else if(!strcmp(word, "ramping"))
+			*flags |= MOTOR_STATE_RAMPING;
+		else if(!strcmp(word, "holding"))
+			*flags |= MOTOR_STATE_HOLDING;
+		else if(!strcmp(word, "overloaded"))
+			*flags |= MOTOR_STATE_OVERLOADED;
+		else if(!strcmp(word, "stalled"))
+			*flags |= MOTOR_STATE_STALLED;
+	}
+	return 0;
+}
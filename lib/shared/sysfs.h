@@ -0,0 +1,39 @@
+/*
+ * ev3dev-mapping sysfs attribute access header file
+ *
+ * Copyright (C) 2016 Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Persistent descriptors for frequently read sysfs attributes.
+ *
+ * The attribute file is opened once and re-read with pread at offset 0,
+ * which is a single syscall per read (no open/close, no seek).
+ */
+
+#pragma once
+
+const char *const SYSFS_TACHO_MOTOR_PATH="/sys/class/tacho-motor/motor";
+
+// returns file descriptor, dies on failure
+int OpenSysfsAttribute(const char *class_path, int device_index, const char *attribute, int flags);
+// returns file descriptor, -1 on failure (reported on stderr)
+int TryOpenSysfsAttribute(const char *class_path, int device_index, const char *attribute, int flags);
+
+// returns 0 on success, -1 on failure (with errno set)
+int ReadSysfsInt(int fd, int *value);
+
+// tacho motor state attribute flags (space separated words in sysfs)
+enum MotorStateFlags {MOTOR_STATE_RUNNING=1, MOTOR_STATE_RAMPING=2, MOTOR_STATE_HOLDING=4, MOTOR_STATE_OVERLOADED=8, MOTOR_STATE_STALLED=16};
+
+// reads the tacho motor state attribute as MotorStateFlags
+// returns 0 on success, -1 on failure (with errno set)
+int ReadSysfsMotorState(int fd, int *flags);